@@ -0,0 +1,460 @@
+#ifndef STEREO_TUNER_AUTOTUNE_HPP
+#define STEREO_TUNER_AUTOTUNE_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "evaluation.hpp"
+#include "matcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* A point of the parameter space and how it scored in the last round */
+struct TuneCandidate
+{
+	MatcherParams params;
+	double error;
+	double runtime_ms;
+	double score;
+	bool failed;
+
+	TuneCandidate() : error(1), runtime_ms(0), score(0), failed(false)
+	{
+	}
+};
+
+static bool compare_candidate_score(const TuneCandidate &a, const TuneCandidate &b)
+{
+	return a.score < b.score;
+}
+
+static bool compare_candidate_error(const TuneCandidate &a, const TuneCandidate &b)
+{
+	return a.error < b.error;
+}
+
+/* Draws a random configuration of the given matcher. Only the fields that
+ * matter for that matcher are sampled, min_disparity is kept from `base`, and
+ * the constraints enforced by the sliders hold: odd block and pre-filter
+ * sizes, numDisparities a multiple of 16, P1 < P2 <= 2048. */
+static MatcherParams sample_params(MatcherType type, const MatcherParams &base, int max_disparities, RNG &rng)
+{
+	MatcherParams params = base;
+	params.matcher_type = type;
+	params.num_disparities = 16 * rng.uniform(1, max_disparities / 16 + 1);
+	params.disp_12_max_diff = rng.uniform(-1, 3);
+	params.uniqueness_ratio = rng.uniform(0, 31);
+	params.speckle_window_size = rng.uniform(0, 2) ? rng.uniform(50, 201) : 0;
+	params.speckle_range = rng.uniform(1, 5);
+	params.pre_filter_cap = rng.uniform(1, 64);
+
+	switch (type)
+	{
+	case BM:
+		params.block_size = 2 * rng.uniform(2, 11) + 1;
+		params.pre_filter_size = 2 * rng.uniform(2, 11) + 1;
+		params.pre_filter_type = rng.uniform(0, 2) ? StereoBM::PREFILTER_NORMALIZED_RESPONSE : StereoBM::PREFILTER_XSOBEL;
+		params.texture_threshold = rng.uniform(0, 51);
+		break;
+
+	case SGBM:
+		params.block_size = 2 * rng.uniform(2, 8) + 1;
+		params.p1 = min(1024, rng.uniform(1, 13) * params.block_size * params.block_size);
+		params.p2 = min(2048, params.p1 * rng.uniform(2, 9));
+		params.mode = rng.uniform(0, 4) ? StereoSGBM::MODE_SGBM : StereoSGBM::MODE_HH;
+		break;
+
+	case CENSUS:
+		params.block_size = 2 * rng.uniform(1, 8) + 1;
+		break;
+	}
+
+	return params;
+}
+
+/* Left-right consistency proxy used when there is no ground truth: the
+ * fraction of pixels that are invalid or whose disparity disagrees by more
+ * than one pixel with the disparity of the matching pixel in the right view.
+ * The right view is matched by mirroring and swapping the pair. */
+static double lr_inconsistency(const Ptr<StereoMatcher> &matcher, const Mat &left, const Mat &right, const Mat &disparity_left, int min_disparity)
+{
+	Mat flipped_left, flipped_right, flipped_disparity, disparity_right;
+	flip(left, flipped_left, 1);
+	flip(right, flipped_right, 1);
+	compute_disparity(matcher, flipped_right, flipped_left, flipped_disparity);
+	flip(flipped_disparity, disparity_right, 1);
+
+	Mat dl, dr;
+	disparity_to_float(disparity_left, dl);
+	disparity_to_float(disparity_right, dr);
+
+	size_t bad = 0;
+
+	for (int y = 0; y < dl.rows; y++)
+	{
+		const float *l = dl.ptr<float>(y);
+		const float *r = dr.ptr<float>(y);
+
+		for (int x = 0; x < dl.cols; x++)
+		{
+			int xr = cvRound(x - l[x]);
+
+			if (l[x] < min_disparity || xr < 0 || xr >= dr.cols || r[xr] < min_disparity || fabs(l[x] - r[xr]) > 1)
+			{
+				bad++;
+			}
+		}
+	}
+
+	return (double)bad / dl.total();
+}
+
+/* State shared by the tuning threads for one round */
+struct TuneRound
+{
+	vector<TuneCandidate> *candidates;
+	const vector<EvaluationScene> *scenes;
+	double fraction;
+	double runtime_weight;
+	atomic<size_t> next;
+
+	TuneRound() : candidates(NULL), scenes(NULL), fraction(1), runtime_weight(0), next(0)
+	{
+	}
+};
+
+/* Scores candidates until the round is exhausted. Each candidate is matched
+ * on a centered band holding `fraction` of the rows of every scene; the error
+ * is the bad-2px rate when there is ground truth, the left-right
+ * inconsistency otherwise. */
+static void tune_worker(TuneRound *round)
+{
+	Ptr<StereoMatcher> matcher;
+
+	for (size_t i = round->next++; i < round->candidates->size(); i = round->next++)
+	{
+		TuneCandidate &candidate = (*round->candidates)[i];
+		double error = 0, runtime_ms = 0;
+
+		try
+		{
+			configure_matcher(matcher, candidate.params, NULL, NULL);
+
+			for (size_t s = 0; s < round->scenes->size(); s++)
+			{
+				const EvaluationScene &scene = (*round->scenes)[s];
+				int rows = max(min(scene.left.rows, 4 * candidate.params.block_size), cvRound(scene.left.rows * round->fraction));
+				Rect band(0, (scene.left.rows - rows) / 2, scene.left.cols, rows);
+				Mat left = scene.left(band), right = scene.right(band), disparity;
+
+				int64 start = getTickCount();
+				compute_disparity(matcher, left, right, disparity);
+				runtime_ms += (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+				if (!scene.ground_truth.empty())
+				{
+					error += evaluate_disparity(disparity, candidate.params.min_disparity, scene.ground_truth(band)).bad[2];
+				}
+				else
+				{
+					error += lr_inconsistency(matcher, left, right, disparity, candidate.params.min_disparity);
+				}
+			}
+
+			candidate.error = error / round->scenes->size();
+			candidate.runtime_ms = runtime_ms / round->scenes->size();
+			candidate.score = candidate.error + round->runtime_weight * candidate.runtime_ms / 1000;
+		}
+		catch (const std::exception &)
+		{
+			// Rejected by the matcher, sort it last
+			candidate.failed = true;
+			candidate.score = HUGE_VAL;
+		}
+	}
+}
+
+static void evaluate_candidates(vector<TuneCandidate> &candidates, const vector<EvaluationScene> &scenes, double fraction, double runtime_weight, int threads)
+{
+	TuneRound round;
+	round.candidates = &candidates;
+	round.scenes = &scenes;
+	round.fraction = fraction;
+	round.runtime_weight = runtime_weight;
+
+	vector<std::thread> pool;
+	for (int t = 0; t < threads; t++)
+	{
+		pool.push_back(std::thread(tune_worker, &round));
+	}
+
+	for (size_t t = 0; t < pool.size(); t++)
+	{
+		pool[t].join();
+	}
+}
+
+/* Candidates not beaten on both error and runtime by another one */
+static vector<TuneCandidate> pareto_front(const vector<TuneCandidate> &candidates)
+{
+	vector<TuneCandidate> front;
+
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		bool dominated = candidates[i].failed;
+
+		for (size_t j = 0; j < candidates.size() && !dominated; j++)
+		{
+			dominated = !candidates[j].failed && candidates[j].error <= candidates[i].error && candidates[j].runtime_ms <= candidates[i].runtime_ms &&
+						(candidates[j].error < candidates[i].error || candidates[j].runtime_ms < candidates[i].runtime_ms);
+		}
+
+		if (!dominated)
+		{
+			front.push_back(candidates[i]);
+		}
+	}
+
+	sort(front.begin(), front.end(), compare_candidate_error);
+	return front;
+}
+
+/* Headless mode: random search with successive halving over the parameters
+ * of BM, SGBM and/or CENSUS.
+ *
+ * All candidates are first scored on a thin band of rows; after each round
+ * the best third (by error + runtime_weight * seconds) survives and the band
+ * grows by the same factor, until the survivors are scored on the full
+ * images. Candidates are scored concurrently, one per core, with OpenCV's
+ * own threading disabled so the runtimes are comparable. The Pareto-best
+ * configurations of the last round are written as parameter files that the
+ * Load button reads. */
+static int run_autotune(int argc, char *argv[])
+{
+	const char *input = NULL;
+	const char *left_filename = NULL;
+	const char *right_filename = NULL;
+	const char *gt_filename = NULL;
+	const char *params_filename = NULL;
+	const char *output_dir = ".";
+	double gt_scale = 1.0;
+	double runtime_weight = 0.1;
+	int samples = 64;
+	int max_disparities = 256;
+	int threads = getNumberOfCPUs();
+	unsigned long long seed = 0x5eed;
+	vector<MatcherType> types;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-input") == 0 && i + 1 < argc)
+		{
+			input = argv[++i];
+		}
+		else if (strcmp(argv[i], "-left") == 0 && i + 1 < argc)
+		{
+			left_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-right") == 0 && i + 1 < argc)
+		{
+			right_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-groundtruth") == 0 && i + 1 < argc)
+		{
+			gt_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-gtscale") == 0 && i + 1 < argc)
+		{
+			gt_scale = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-params") == 0 && i + 1 < argc)
+		{
+			params_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-output") == 0 && i + 1 < argc)
+		{
+			output_dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-matcher") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "bm") == 0 || strcmp(argv[i], "both") == 0 || strcmp(argv[i], "all") == 0)
+			{
+				types.push_back(BM);
+			}
+			if (strcmp(argv[i], "sgbm") == 0 || strcmp(argv[i], "both") == 0 || strcmp(argv[i], "all") == 0)
+			{
+				types.push_back(SGBM);
+			}
+			if (strcmp(argv[i], "census") == 0 || strcmp(argv[i], "all") == 0)
+			{
+				types.push_back(CENSUS);
+			}
+		}
+		else if (strcmp(argv[i], "-samples") == 0 && i + 1 < argc)
+		{
+			samples = max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-maxdisp") == 0 && i + 1 < argc)
+		{
+			max_disparities = max(16, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-runtime-weight") == 0 && i + 1 < argc)
+		{
+			runtime_weight = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+		{
+			threads = max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+		{
+			seed = strtoull(argv[++i], NULL, 10);
+		}
+	}
+
+	if (types.empty())
+	{
+		types.push_back(BM);
+		types.push_back(SGBM);
+	}
+
+	vector<EvaluationScene> scenes;
+
+	if (input != NULL)
+	{
+		if (!load_middlebury_scenes(input, scenes))
+		{
+			return 1;
+		}
+	}
+	else if (left_filename != NULL && right_filename != NULL)
+	{
+		EvaluationScene scene;
+		scene.name = left_filename;
+		scene.left = imread(left_filename, IMREAD_GRAYSCALE);
+		scene.right = imread(right_filename, IMREAD_GRAYSCALE);
+
+		if (scene.left.empty() || scene.right.empty() || scene.left.size() != scene.right.size())
+		{
+			printf("Could not read the pair %s %s.\n", left_filename, right_filename);
+			return 1;
+		}
+
+		if (gt_filename != NULL && !load_ground_truth(gt_filename, gt_scale, scene.left.size(), scene.ground_truth))
+		{
+			printf("Could not read ground truth %s.\n", gt_filename);
+			return 1;
+		}
+
+		scenes.push_back(scene);
+	}
+	else
+	{
+		printf("Usage: %s --autotune (-input <middlebury dir> | -left l.png -right r.png [-groundtruth gt.png -gtscale s]) [-params start.yml] [-matcher bm|sgbm|census|both|all] [-samples n] [-maxdisp n] [-runtime-weight w] [-threads n] [-seed n] [-output dir]\n", argv[0]);
+		return 1;
+	}
+
+	// The search range cannot exceed the narrowest image
+	for (size_t s = 0; s < scenes.size(); s++)
+	{
+		max_disparities = min(max_disparities, scenes[s].left.cols / 2 / 16 * 16);
+	}
+	max_disparities = max(16, max_disparities);
+
+	MatcherParams base;
+
+	if (params_filename != NULL)
+	{
+		FileStorage fs(params_filename, FileStorage::READ);
+
+		if (!fs.isOpened() || !read_params(fs, base))
+		{
+			printf("Could not read matcher parameters from %s.\n", params_filename);
+			return 1;
+		}
+	}
+
+	if (!utils::fs::createDirectories(output_dir))
+	{
+		printf("Could not create output directory %s.\n", output_dir);
+		return 1;
+	}
+
+	// The starting point is always part of the search
+	RNG rng(seed);
+	vector<TuneCandidate> candidates;
+	TuneCandidate start;
+	start.params = base;
+	candidates.push_back(start);
+
+	for (int i = 1; i < samples; i++)
+	{
+		MatcherType type = types[i % types.size()];
+		TuneCandidate candidate;
+		candidate.params = sample_params(type, base, max_disparities, rng);
+		candidates.push_back(candidate);
+	}
+
+	// Successive halving keeps at least a handful of candidates for the
+	// full-size round, so the Pareto front has something to choose from.
+	const int eta = 3;
+	const size_t final_candidates = 8;
+	int rounds = 1;
+	for (size_t n = candidates.size(); n / eta >= final_candidates; n /= eta)
+	{
+		rounds++;
+	}
+
+	int opencv_threads = getNumThreads();
+	setNumThreads(1);
+	int64 tuning_start = getTickCount();
+
+	for (int r = 0; r < rounds; r++)
+	{
+		double fraction = pow((double)eta, r - (rounds - 1));
+		evaluate_candidates(candidates, scenes, fraction, runtime_weight, threads);
+		sort(candidates.begin(), candidates.end(), compare_candidate_score);
+
+		printf("Round %d: %zu candidates on %.0f%% of the rows, best error %.2f%% in %.1f ms\n",
+			   r + 1, candidates.size(), fraction * 100, candidates[0].error * 100, candidates[0].runtime_ms);
+
+		if (r < rounds - 1)
+		{
+			candidates.resize((candidates.size() + eta - 1) / eta);
+		}
+	}
+
+	setNumThreads(opencv_threads);
+
+	vector<TuneCandidate> front = pareto_front(candidates);
+	printf("Tuning took %.1f s. Pareto-best configurations (%s):\n",
+		   (getTickCount() - tuning_start) / getTickFrequency(), scenes[0].ground_truth.empty() ? "left-right inconsistency" : "bad 2px");
+
+	for (size_t i = 0; i < front.size(); i++)
+	{
+		char filename[1024];
+		snprintf(filename, sizeof(filename), "%s/autotune_%02zu.yml", output_dir, i + 1);
+
+		FileStorage fs(filename, FileStorage::WRITE);
+		write_params(fs, front[i].params);
+		fs.release();
+
+		printf("  %s: %s, error %.2f%%, %.1f ms\n", filename, matcher_type_name(front[i].params.matcher_type),
+			   front[i].error * 100, front[i].runtime_ms);
+	}
+
+	return 0;
+}
+
+#endif
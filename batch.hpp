@@ -0,0 +1,485 @@
+#ifndef STEREO_TUNER_BATCH_HPP
+#define STEREO_TUNER_BATCH_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blocking_queue.hpp"
+#include "disparity_cache.hpp"
+#include "matcher.hpp"
+#include "pointcloud.hpp"
+#include "rectify.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* File names of a left/right pair */
+struct StereoPairPaths
+{
+	string left, right;
+};
+
+/* A pair travelling through the batch pipeline. `color` is the left image,
+ * only kept when the point clouds are coloured. */
+struct BatchItem
+{
+	size_t index;
+	Mat left, right, disparity, color;
+};
+
+/* Builds the list of pairs to process. The input is either a directory with
+ * `left` and `right` subdirectories (files are paired in sorted order) or a
+ * text file with one "left right" pair per line. */
+static bool list_pairs(const string &input, vector<StereoPairPaths> &pairs)
+{
+	if (utils::fs::isDirectory(input))
+	{
+		vector<String> left_files, right_files;
+		glob(input + "/left/*", left_files, false);
+		glob(input + "/right/*", right_files, false);
+
+		if (left_files.size() != right_files.size())
+		{
+			printf("Found %zu left and %zu right images in %s.\n", left_files.size(), right_files.size(), input.c_str());
+			return false;
+		}
+
+		for (size_t i = 0; i < left_files.size(); i++)
+		{
+			StereoPairPaths pair;
+			pair.left = left_files[i];
+			pair.right = right_files[i];
+			pairs.push_back(pair);
+		}
+	}
+	else
+	{
+		ifstream list(input.c_str());
+
+		if (!list.is_open())
+		{
+			printf("Could not open input list %s.\n", input.c_str());
+			return false;
+		}
+
+		string line;
+		while (getline(list, line))
+		{
+			StereoPairPaths pair;
+			istringstream fields(line);
+
+			if (fields >> pair.left >> pair.right)
+			{
+				pairs.push_back(pair);
+			}
+		}
+	}
+
+	if (pairs.empty())
+	{
+		printf("No image pairs found in %s.\n", input.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+/* Output file for a pair: the left image name with the given extension */
+static string output_filename(const string &output_dir, const string &left_filename, const char *extension)
+{
+	string name = left_filename.substr(left_filename.find_last_of("/\\") + 1);
+	size_t dot = name.find_last_of('.');
+
+	if (dot != string::npos)
+	{
+		name = name.substr(0, dot);
+	}
+
+	return output_dir + "/" + name + extension;
+}
+
+/* Outputs are named after the left image only: two pairs whose left images
+ * share a name (in different directories) would overwrite each other.
+ * Returns false, after printing both, when that happens. */
+static bool check_output_names(const string &output_dir, const vector<StereoPairPaths> &pairs)
+{
+	map<string, size_t> first_of;
+
+	for (size_t i = 0; i < pairs.size(); i++)
+	{
+		string name = output_filename(output_dir, pairs[i].left, ".png");
+		map<string, size_t>::const_iterator found = first_of.find(name);
+
+		if (found != first_of.end())
+		{
+			printf("%s and %s would both be written as %s, rename one of them.\n", pairs[found->second].left.c_str(),
+				   pairs[i].left.c_str(), name.c_str());
+			return false;
+		}
+
+		first_of[name] = i;
+	}
+
+	return true;
+}
+
+/* Offset of the disparities written by the batch, so negative disparities
+ * fit an unsigned PNG. The disparity cache stores CV_16S maps the same way. */
+static const int BATCH_DISPARITY_OFFSET = 32768;
+
+/* Encodes a disparity map as written by the batch: 16 bits, the disparity
+ * multiplied by 16 plus BATCH_DISPARITY_OFFSET. Maps of 8-bit whole pixels
+ * (the CUDA block matcher) are scaled by 16 first. */
+static void encode_disparity(const Mat &disparity, Mat &encoded)
+{
+	double scale = disparity.depth() == CV_16S ? 1.0 : (double)StereoMatcher::DISP_SCALE;
+	disparity.convertTo(encoded, CV_16U, scale, BATCH_DISPARITY_OFFSET);
+}
+
+/* State shared by the stages of the batch pipeline */
+struct BatchContext
+{
+	MatcherParams params;
+	vector<StereoPairPaths> pairs;
+	string output_dir;
+	bool use_rectification;
+	Rectification rect;
+	bool write_clouds;
+	PointCloudFormat cloud_format;
+
+	/* Disk only: every pair is matched once per run, the memory tier would
+	 * never hit */
+	bool use_cache;
+	DisparityCache cache;
+
+	BlockingQueue<BatchItem> decoded, matched;
+	atomic<size_t> next_pair;
+	atomic<size_t> written;
+	atomic<size_t> failed;
+	atomic<size_t> cached;
+
+	explicit BatchContext(size_t queue_size)
+		: use_rectification(false), write_clouds(false), cloud_format(CLOUD_PLY), use_cache(false), cache(0), decoded(queue_size),
+		  matched(queue_size), next_pair(0), written(0), failed(0), cached(0)
+	{
+	}
+};
+
+/* Stage 1: decodes (and rectifies) pairs until the list is exhausted */
+static void batch_decode(BatchContext *ctx)
+{
+	for (size_t i = ctx->next_pair++; i < ctx->pairs.size(); i = ctx->next_pair++)
+	{
+		BatchItem item;
+		item.index = i;
+		bool keep_color = ctx->write_clouds && ctx->cloud_format != CLOUD_XYZ;
+
+		if (keep_color)
+		{
+			item.color = imread(ctx->pairs[i].left, IMREAD_COLOR);
+
+			// With rectification, the gray view comes out of rectify_view
+			if (ctx->use_rectification)
+			{
+				item.left = item.color;
+			}
+			else if (!item.color.empty())
+			{
+				cvtColor(item.color, item.left, COLOR_BGR2GRAY);
+			}
+		}
+		else
+		{
+			item.left = imread(ctx->pairs[i].left, IMREAD_GRAYSCALE);
+		}
+
+		item.right = imread(ctx->pairs[i].right, IMREAD_GRAYSCALE);
+
+		if (item.left.empty() || item.right.empty() || item.left.size() != item.right.size())
+		{
+			fprintf(stderr, "WARNING: skipping unreadable pair %s %s\n", ctx->pairs[i].left.c_str(), ctx->pairs[i].right.c_str());
+			ctx->failed++;
+			continue;
+		}
+
+		if (ctx->use_rectification && keep_color)
+		{
+			Mat rectified_right;
+			rectify_view(item.color, ctx->rect.map11, ctx->rect.map12, item.color, item.left);
+			remap(item.right, rectified_right, ctx->rect.map21, ctx->rect.map22, INTER_LINEAR);
+			item.right = rectified_right;
+		}
+		else if (ctx->use_rectification)
+		{
+			Mat rectified_left, rectified_right;
+			rectify_pair(ctx->rect, item.left, item.right, rectified_left, rectified_right);
+			item.left = rectified_left;
+			item.right = rectified_right;
+		}
+
+		ctx->decoded.push(item);
+	}
+}
+
+/* Stage 2: matching. Every thread owns its matcher instance. Pairs found in
+ * the cache, matched by an earlier run with the same parameters, skip the
+ * matcher. */
+static void batch_match(BatchContext *ctx)
+{
+	Ptr<StereoMatcher> matcher;
+	const Rect *roi1 = ctx->use_rectification ? &ctx->rect.roi1 : NULL;
+	const Rect *roi2 = ctx->use_rectification ? &ctx->rect.roi2 : NULL;
+	BatchItem item;
+
+	while (ctx->decoded.pop(item))
+	{
+		try
+		{
+			uint64_t key = ctx->use_cache ? whole_pair_key(hash_pair(item.left, item.right), ctx->params, roi1, roi2) : 0;
+
+			if (key != 0 && ctx->cache.get(key, item.disparity))
+			{
+				ctx->cached++;
+			}
+			else
+			{
+				configure_matcher(matcher, ctx->params, roi1, roi2);
+				compute_disparity(matcher, item.left, item.right, item.disparity);
+				post_filter(ctx->params, item.left, item.disparity);
+
+				if (key != 0)
+				{
+					ctx->cache.put(key, item.disparity);
+				}
+			}
+
+			item.left.release();
+			item.right.release();
+			ctx->matched.push(item);
+		}
+		catch (const std::exception &e)
+		{
+			fprintf(stderr, "WARNING: matching failed on %s: %s\n", ctx->pairs[item.index].left.c_str(), e.what());
+			ctx->failed++;
+		}
+	}
+}
+
+/* Stage 3: writes the 16-bit disparity maps, and the point clouds */
+static void batch_write(BatchContext *ctx)
+{
+	BatchItem item;
+	Mat disparity_16u;
+	PointCloudExporter exporter;
+
+	while (ctx->matched.pop(item))
+	{
+		encode_disparity(item.disparity, disparity_16u);
+		string filename = output_filename(ctx->output_dir, ctx->pairs[item.index].left, ".png");
+
+		if (!imwrite(filename, disparity_16u))
+		{
+			fprintf(stderr, "WARNING: could not write %s\n", filename.c_str());
+			ctx->failed++;
+			continue;
+		}
+
+		if (ctx->write_clouds)
+		{
+			string cloud = output_filename(ctx->output_dir, ctx->pairs[item.index].left, cloud_extension(ctx->cloud_format));
+
+			if (!exporter.write(cloud, ctx->cloud_format, item.disparity, item.color, ctx->rect.q, ctx->params.min_disparity))
+			{
+				fprintf(stderr, "WARNING: could not write %s\n", cloud.c_str());
+				ctx->failed++;
+				continue;
+			}
+		}
+
+		ctx->written++;
+	}
+}
+
+/* Headless mode: applies a parameter file saved by the tuner to a whole
+ * sequence of pairs and writes 16-bit PNG disparity maps (see
+ * encode_disparity), and optionally a point cloud per
+ * pair, reprojected with the Q matrix of the calibration.
+ *
+ * The work is split in a pipeline: decode (and rectify) workers, matcher
+ * workers with their own matcher instance each, and a single writer thread.
+ * Images are processed at their native resolution.
+ *
+ * With -cache, the disparity maps are also kept in a directory, keyed by the
+ * pair and the parameters, so a rerun only matches what changed. */
+static int run_batch(int argc, char *argv[])
+{
+	const char *params_filename = NULL;
+	const char *input = NULL;
+	const char *output_dir = NULL;
+	const char *intrinsics_filename = NULL;
+	const char *extrinsics_filename = NULL;
+	const char *cloud_format = NULL;
+	const char *cache_dir = NULL;
+	int threads = getNumberOfCPUs();
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-params") == 0 && i + 1 < argc)
+		{
+			params_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-input") == 0 && i + 1 < argc)
+		{
+			input = argv[++i];
+		}
+		else if (strcmp(argv[i], "-output") == 0 && i + 1 < argc)
+		{
+			output_dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-intrinsics") == 0 && i + 1 < argc)
+		{
+			intrinsics_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-extrinsics") == 0 && i + 1 < argc)
+		{
+			extrinsics_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+		{
+			threads = max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-cloud") == 0 && i + 1 < argc)
+		{
+			cloud_format = argv[++i];
+		}
+		else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+		{
+			cache_dir = argv[++i];
+		}
+	}
+
+	if (params_filename == NULL || input == NULL || output_dir == NULL)
+	{
+		printf("Usage: %s --batch -params params.yml -input <dir|list.txt> -output <dir> [-intrinsics file -extrinsics file] [-threads n] [-cloud ply|xyz|xyzrgb] [-cache dir]\n", argv[0]);
+		return 1;
+	}
+
+	BatchContext ctx(2 * threads);
+	ctx.output_dir = output_dir;
+	FileStorage fs(params_filename, FileStorage::READ);
+
+	if (!fs.isOpened() || !read_params(fs, ctx.params))
+	{
+		printf("Could not read matcher parameters from %s.\n", params_filename);
+		return 1;
+	}
+
+	if (!list_pairs(input, ctx.pairs) || !check_output_names(ctx.output_dir, ctx.pairs))
+	{
+		return 1;
+	}
+
+	if (!utils::fs::createDirectories(output_dir))
+	{
+		printf("Could not create output directory %s.\n", output_dir);
+		return 1;
+	}
+
+	// The maps depend on the image size, which is only known after decoding
+	// the first pair.
+	if (intrinsics_filename != NULL && extrinsics_filename != NULL)
+	{
+		Mat first = imread(ctx.pairs[0].left, IMREAD_GRAYSCALE);
+
+		if (first.empty())
+		{
+			printf("Could not read left image %s.\n", ctx.pairs[0].left.c_str());
+			return 1;
+		}
+
+		if (!load_rectification(intrinsics_filename, extrinsics_filename, first.size(), ctx.rect))
+		{
+			return 1;
+		}
+
+		ctx.use_rectification = true;
+	}
+
+	if (cloud_format != NULL)
+	{
+		if (!parse_cloud_format(cloud_format, ctx.cloud_format))
+		{
+			printf("Unknown point cloud format %s, use ply, xyz or xyzrgb.\n", cloud_format);
+			return 1;
+		}
+
+		if (!ctx.use_rectification)
+		{
+			printf("Point clouds need the calibration (-intrinsics and -extrinsics).\n");
+			return 1;
+		}
+
+		ctx.write_clouds = true;
+	}
+
+	if (cache_dir != NULL)
+	{
+		if (!ctx.cache.set_directory(cache_dir))
+		{
+			printf("Could not create cache directory %s.\n", cache_dir);
+			return 1;
+		}
+
+		ctx.use_cache = true;
+	}
+
+	printf("Processing %zu pairs with %d threads.\n", ctx.pairs.size(), threads);
+
+	int64 start = getTickCount();
+	vector<std::thread> decoders, matchers;
+
+	for (int t = 0; t < threads; t++)
+	{
+		decoders.push_back(std::thread(batch_decode, &ctx));
+		matchers.push_back(std::thread(batch_match, &ctx));
+	}
+	std::thread writer(batch_write, &ctx);
+
+	for (size_t t = 0; t < decoders.size(); t++)
+	{
+		decoders[t].join();
+	}
+	ctx.decoded.close();
+
+	for (size_t t = 0; t < matchers.size(); t++)
+	{
+		matchers[t].join();
+	}
+	ctx.matched.close();
+	writer.join();
+
+	double seconds = (double)(getTickCount() - start) / getTickFrequency();
+	size_t written = ctx.written;
+	printf("Wrote %zu disparity maps to %s in %.2f s (%.2f pairs/sec), %zu failed.\n",
+		   written, output_dir, seconds, seconds > 0 ? written / seconds : 0.0, ctx.failed.load());
+
+	if (ctx.use_cache)
+	{
+		printf("%zu maps were taken from the cache.\n", ctx.cached.load());
+	}
+
+	return ctx.failed == 0 ? 0 : 1;
+}
+
+#endif
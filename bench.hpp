@@ -0,0 +1,292 @@
+#ifndef STEREO_TUNER_BENCH_HPP
+#define STEREO_TUNER_BENCH_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "census.hpp"
+#include "evaluation.hpp"
+#include "fixed_bm.hpp"
+#include "tiled_matcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* A pair of the benchmark, with an optional ground truth */
+struct BenchPair
+{
+	const char *name;
+	const char *left;
+	const char *right;
+	const char *ground_truth;
+	double gt_scale;
+};
+
+static const BenchPair BENCH_PAIRS[] = {
+	{"tsukuba", "tsukuba/scene1.row3.col3.ppm", "tsukuba/scene1.row3.col5.ppm", "tsukuba/truedisp.row3.col3.pgm", 8.0},
+	{"obeya", "obeya/left.png", "obeya/right.png", NULL, 0},
+};
+
+/* Median wall-clock time of `repeat` calls of `run`, in ms. `prepare` is
+ * called before each of them, untimed. */
+template <class Run, class Prepare>
+static double bench_median(int repeat, Run run, Prepare prepare)
+{
+	vector<double> times;
+
+	// Warm-up run: allocations, thread pool start
+	run();
+
+	for (int i = 0; i < repeat; i++)
+	{
+		prepare();
+		int64 start = getTickCount();
+		run();
+		times.push_back((getTickCount() - start) * 1000.0 / getTickFrequency());
+	}
+
+	sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+/* Median wall-clock time of `repeat` runs of the matcher, in ms. When
+ * `fresh` is set the winner data of a CostVolumeMatcher is dropped before
+ * every run, so the whole matching is timed. */
+static double bench_matcher(const Ptr<StereoMatcher> &matcher, const Mat &left, const Mat &right, int repeat, bool fresh, Mat &disparity)
+{
+	return bench_median(
+		repeat, [&]()
+		{ matcher->compute(left, right, disparity); },
+		[&]()
+		{
+			if (fresh)
+			{
+				matcher->clear();
+			}
+		});
+}
+
+/* Same for the block matcher specialised for the given size and range, with
+ * the other parameters of `settings` */
+template <int BlockSize, int NumDisparities>
+static double bench_fixed_bm(const Ptr<StereoBM> &settings, const Mat &left, const Mat &right, int repeat, Mat &disparity)
+{
+	FixedBlockMatcher<BlockSize, NumDisparities> matcher;
+	matcher.min_disparity = settings->getMinDisparity();
+	matcher.pre_filter_type = settings->getPreFilterType();
+	matcher.pre_filter_size = settings->getPreFilterSize();
+	matcher.pre_filter_cap = settings->getPreFilterCap();
+	matcher.texture_threshold = settings->getTextureThreshold();
+	matcher.uniqueness_ratio = settings->getUniquenessRatio();
+	matcher.speckle_window_size = settings->getSpeckleWindowSize();
+	matcher.speckle_range = settings->getSpeckleRange();
+	return bench_median(
+		repeat, [&]()
+		{ matcher.compute(left, right, disparity); },
+		[]() {});
+}
+
+/* The specialisations the benchmark is built with: one per number of
+ * disparities for a block size */
+template <int BlockSize>
+static bool bench_fixed_bm_of_range(const Ptr<StereoBM> &settings, int num_disparities, const Mat &left, const Mat &right, int repeat, Mat &disparity, double &ms)
+{
+	switch (num_disparities)
+	{
+	case 32:
+		ms = bench_fixed_bm<BlockSize, 32>(settings, left, right, repeat, disparity);
+		return true;
+	case 64:
+		ms = bench_fixed_bm<BlockSize, 64>(settings, left, right, repeat, disparity);
+		return true;
+	case 128:
+		ms = bench_fixed_bm<BlockSize, 128>(settings, left, right, repeat, disparity);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Times the specialised block matcher for the block size and number of
+ * disparities of `settings`. Returns false when the benchmark has no kernel
+ * for them. */
+static bool bench_fixed_bm(const Ptr<StereoBM> &settings, const Mat &left, const Mat &right, int repeat, Mat &disparity, double &ms)
+{
+	int num_disparities = settings->getNumDisparities();
+
+	switch (settings->getBlockSize())
+	{
+	case 5:
+		return bench_fixed_bm_of_range<5>(settings, num_disparities, left, right, repeat, disparity, ms);
+	case 7:
+		return bench_fixed_bm_of_range<7>(settings, num_disparities, left, right, repeat, disparity, ms);
+	case 9:
+		return bench_fixed_bm_of_range<9>(settings, num_disparities, left, right, repeat, disparity, ms);
+	case 11:
+		return bench_fixed_bm_of_range<11>(settings, num_disparities, left, right, repeat, disparity, ms);
+	case 15:
+		return bench_fixed_bm_of_range<15>(settings, num_disparities, left, right, repeat, disparity, ms);
+	case 21:
+		return bench_fixed_bm_of_range<21>(settings, num_disparities, left, right, repeat, disparity, ms);
+	default:
+		return false;
+	}
+}
+
+/* Pixels where the tiled matching of the interface differs from a single
+ * compute() over the whole pair */
+static int tiled_differences(MatcherParams params, MatcherType type, const Mat &left, const Mat &right)
+{
+	params.matcher_type = type;
+	TiledMatcher tiled(getNumberOfCPUs());
+	Mat tiled_disparity, whole;
+	tiled.compute(params, left, right, Rect(), tiled_disparity);
+
+	Ptr<StereoMatcher> matcher;
+	configure_matcher(matcher, params, NULL, NULL);
+	compute_disparity(matcher, left, right, whole);
+	whole.convertTo(whole, tiled_disparity.type());
+	return countNonZero(tiled_disparity != whole);
+}
+
+/* Share of the pixels two maps agree on */
+static double share_equal(const Mat &a, const Mat &b)
+{
+	return (double)countNonZero(a == b) / a.total();
+}
+
+static void print_bench_line(const char *matcher, double ms, const Mat &left, int num_disparities, const Mat &disparity, const Mat &ground_truth)
+{
+	double rate = left.total() * (double)num_disparities / (ms * 1000.0);
+	printf("  %-22s %9.2f ms %9.1f Mdisp/s", matcher, ms, rate);
+
+	if (!ground_truth.empty())
+	{
+		EvaluationResult result = evaluate_disparity(disparity, 0, ground_truth);
+		printf("   bad 2px %5.1f%%", result.bad[2] * 100);
+	}
+
+	printf("\n");
+}
+
+/* Headless mode: times OpenCV's StereoBM and StereoSGBM (on the CPU, whatever
+ * WITH_CUDA says) against the block matcher specialised for the block size
+ * and number of disparities, and against the census matcher with every
+ * Hamming kernel the CPU runs, on the bundled tsukuba and obeya pairs at
+ * their native resolution. The census matcher is also timed when only its
+ * post-processing reruns. */
+static int run_benchmark(int argc, char *argv[])
+{
+	int repeat = 10;
+	int num_disparities = 64;
+	int block_size = 9;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+		{
+			repeat = max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-numdisp") == 0 && i + 1 < argc)
+		{
+			num_disparities = max(16, atoi(argv[++i]) / 16 * 16);
+		}
+		else if (strcmp(argv[i], "-blocksize") == 0 && i + 1 < argc)
+		{
+			block_size = max(5, atoi(argv[++i]) | 1);
+		}
+	}
+
+	printf("numDisparities %d, blockSize %d, median of %d runs, %d threads\n", num_disparities, block_size, repeat, getNumThreads());
+
+	for (size_t p = 0; p < sizeof(BENCH_PAIRS) / sizeof(BENCH_PAIRS[0]); p++)
+	{
+		const BenchPair &pair = BENCH_PAIRS[p];
+		Mat left = imread(pair.left, IMREAD_GRAYSCALE);
+		Mat right = imread(pair.right, IMREAD_GRAYSCALE);
+		Mat ground_truth, disparity;
+
+		if (left.empty() || right.empty())
+		{
+			printf("%s: could not read %s or %s, skipped.\n", pair.name, pair.left, pair.right);
+			continue;
+		}
+
+		if (pair.ground_truth != NULL && !load_ground_truth(pair.ground_truth, pair.gt_scale, left.size(), ground_truth))
+		{
+			ground_truth.release();
+		}
+
+		printf("%s (%dx%d)\n", pair.name, left.cols, left.rows);
+
+		Ptr<StereoBM> bm = StereoBM::create(num_disparities, block_size);
+		double bm_ms = bench_matcher(bm, left, right, repeat, false, disparity);
+		print_bench_line("StereoBM", bm_ms, left, num_disparities, disparity, ground_truth);
+		Mat bm_disparity = disparity.clone();
+
+		// Penalties of OpenCV's stereo_match sample
+		int area = block_size * block_size;
+		Ptr<StereoSGBM> sgbm = StereoSGBM::create(0, num_disparities, block_size, 8 * area, 32 * area);
+		double sgbm_ms = bench_matcher(sgbm, left, right, repeat, false, disparity);
+		print_bench_line("StereoSGBM", sgbm_ms, left, num_disparities, disparity, ground_truth);
+
+		double ms;
+
+		if (bench_fixed_bm(bm, left, right, repeat, disparity, ms))
+		{
+			print_bench_line("Fixed BM", ms, left, num_disparities, disparity, ground_truth);
+			printf("  %-22s %9.2fx StereoBM %7.2fx StereoSGBM\n", "Fixed BM speedup", bm_ms / ms, sgbm_ms / ms);
+			printf("  %-22s %8.2f%% of pixels", "Fixed BM = StereoBM", share_equal(disparity, bm_disparity) * 100);
+
+			// Once more with the speckle filter on, both fed the same range
+			bm->setSpeckleWindowSize(100);
+			bm->setSpeckleRange(32);
+			bm->compute(left, right, bm_disparity);
+			bench_fixed_bm(bm, left, right, 1, disparity, ms);
+			printf(", %.2f%% with a speckle window of 100 and range of 32\n", share_equal(disparity, bm_disparity) * 100);
+		}
+		else
+		{
+			printf("  %-22s not built for blockSize %d and numDisparities %d\n", "Fixed BM", block_size, num_disparities);
+		}
+
+		const CensusKernel kernels[] = {CENSUS_KERNEL_SCALAR, CENSUS_KERNEL_SSE42, CENSUS_KERNEL_AVX2};
+		Ptr<CensusMatcher> census = CensusMatcher::create();
+		census->setNumDisparities(num_disparities);
+		census->setBlockSize(block_size);
+
+		for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+		{
+			if (!census_kernel_supported(kernels[k]))
+			{
+				continue;
+			}
+
+			string name = string("Census ") + census_kernel_name(kernels[k]);
+			census->setKernel(kernels[k]);
+			ms = bench_matcher(census, left, right, repeat, true, disparity);
+			print_bench_line(name.c_str(), ms, left, num_disparities, disparity, ground_truth);
+		}
+
+		census->setKernel(census_best_kernel());
+		ms = bench_matcher(census, left, right, repeat, false, disparity);
+		print_bench_line("Census, cost reused", ms, left, num_disparities, disparity, ground_truth);
+
+		// Tiles must not show at their seams (the speckle filter is off)
+		MatcherParams params;
+		params.block_size = block_size;
+		params.num_disparities = num_disparities;
+		printf("  %-22s BM %d, census %d pixels differ\n", "Tiled vs whole frame", tiled_differences(params, BM, left, right),
+			   tiled_differences(params, CENSUS, left, right));
+	}
+
+	return 0;
+}
+
+#endif
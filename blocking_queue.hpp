@@ -0,0 +1,71 @@
+#ifndef STEREO_TUNER_BLOCKING_QUEUE_HPP
+#define STEREO_TUNER_BLOCKING_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+
+/* Bounded multi-producer/multi-consumer queue used between pipeline stages.
+ * push() blocks while the queue is full, pop() blocks while it is empty and
+ * returns false once the queue has been closed and drained. */
+template <typename T>
+class BlockingQueue
+{
+public:
+	explicit BlockingQueue(size_t capacity) : capacity(capacity), closed(false)
+	{
+	}
+
+	void push(const T &item)
+	{
+		unique_lock<mutex> lock(mtx);
+		not_full.wait(lock, [this]
+					  { return items.size() < capacity || closed; });
+
+		if (closed)
+		{
+			return;
+		}
+
+		items.push_back(item);
+		not_empty.notify_one();
+	}
+
+	bool pop(T &item)
+	{
+		unique_lock<mutex> lock(mtx);
+		not_empty.wait(lock, [this]
+					   { return !items.empty() || closed; });
+
+		if (items.empty())
+		{
+			return false;
+		}
+
+		item = items.front();
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	/* No more items will be pushed. Consumers finish what is queued. */
+	void close()
+	{
+		lock_guard<mutex> lock(mtx);
+		closed = true;
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed;
+	deque<T> items;
+	mutex mtx;
+	condition_variable not_empty, not_full;
+};
+
+#endif
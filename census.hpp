@@ -0,0 +1,254 @@
+#ifndef STEREO_TUNER_CENSUS_HPP
+#define STEREO_TUNER_CENSUS_HPP
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "cost_volume.hpp"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define STEREO_TUNER_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+/* Census window: 9x7 pixels around the centre, which is left out, so a code
+ * holds 62 bits */
+static const int CENSUS_RADIUS_X = 4;
+static const int CENSUS_RADIUS_Y = 3;
+
+/* Implementations of the Hamming cost */
+typedef enum
+{
+	CENSUS_KERNEL_SCALAR,
+	CENSUS_KERNEL_SSE42,
+	CENSUS_KERNEL_AVX2
+} CensusKernel;
+
+/* Adds (sign 1) or removes (sign -1) popcount(left[i] ^ right[i]) to sums[i] */
+typedef void (*HammingRowFunc)(const uint64_t *left, const uint64_t *right, int *sums, int count, int sign);
+
+static inline int popcount64(uint64_t v)
+{
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+}
+
+static void hamming_row_scalar(const uint64_t *left, const uint64_t *right, int *sums, int count, int sign)
+{
+	for (int i = 0; i < count; i++)
+	{
+		sums[i] += sign * popcount64(left[i] ^ right[i]);
+	}
+}
+
+#ifdef STEREO_TUNER_X86_KERNELS
+/* Hardware POPCNT, one code at a time */
+__attribute__((target("sse4.2,popcnt"))) static void hamming_row_sse42(const uint64_t *left, const uint64_t *right, int *sums, int count, int sign)
+{
+	for (int i = 0; i < count; i++)
+	{
+		sums[i] += sign * (int)_mm_popcnt_u64(left[i] ^ right[i]);
+	}
+}
+
+/* Four codes at a time: nibble lookup with PSHUFB, bytes summed with PSADBW */
+__attribute__((target("avx2"))) static void hamming_row_avx2(const uint64_t *left, const uint64_t *right, int *sums, int count, int sign)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+											0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+	const __m256i low_dwords = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(left + i)),
+									 _mm256_loadu_si256((const __m256i *)(right + i)));
+		__m256i lo = _mm256_and_si256(v, low_nibbles);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles);
+		__m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+		__m256i counts = _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+		__m128i counts32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(counts, low_dwords));
+		__m128i s = _mm_loadu_si128((const __m128i *)(sums + i));
+		s = sign > 0 ? _mm_add_epi32(s, counts32) : _mm_sub_epi32(s, counts32);
+		_mm_storeu_si128((__m128i *)(sums + i), s);
+	}
+
+	for (; i < count; i++)
+	{
+		sums[i] += sign * popcount64(left[i] ^ right[i]);
+	}
+}
+#endif
+
+static const char *census_kernel_name(CensusKernel kernel)
+{
+	switch (kernel)
+	{
+	case CENSUS_KERNEL_AVX2:
+		return "AVX2";
+	case CENSUS_KERNEL_SSE42:
+		return "SSE4.2";
+	default:
+		return "scalar";
+	}
+}
+
+/* Whether the kernel was compiled in and the CPU runs it. OpenCV reads the
+ * CPU features with CPUID when it starts. */
+static bool census_kernel_supported(CensusKernel kernel)
+{
+	switch (kernel)
+	{
+#ifdef STEREO_TUNER_X86_KERNELS
+	case CENSUS_KERNEL_AVX2:
+		return checkHardwareSupport(CPU_AVX2);
+	case CENSUS_KERNEL_SSE42:
+		return checkHardwareSupport(CPU_SSE4_2) && checkHardwareSupport(CPU_POPCNT);
+#endif
+	case CENSUS_KERNEL_SCALAR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static CensusKernel census_best_kernel()
+{
+	if (census_kernel_supported(CENSUS_KERNEL_AVX2))
+	{
+		return CENSUS_KERNEL_AVX2;
+	}
+
+	if (census_kernel_supported(CENSUS_KERNEL_SSE42))
+	{
+		return CENSUS_KERNEL_SSE42;
+	}
+
+	return CENSUS_KERNEL_SCALAR;
+}
+
+static HammingRowFunc census_kernel_function(CensusKernel kernel)
+{
+	switch (kernel)
+	{
+#ifdef STEREO_TUNER_X86_KERNELS
+	case CENSUS_KERNEL_AVX2:
+		return hamming_row_avx2;
+	case CENSUS_KERNEL_SSE42:
+		return hamming_row_sse42;
+#endif
+	default:
+		return hamming_row_scalar;
+	}
+}
+
+/* Census transform of a gray image, one code per pixel, bit set where the
+ * neighbour is darker than the centre. Borders are replicated. */
+static void census_transform(const Mat &image, vector<uint64_t> &codes)
+{
+	CV_Assert(image.type() == CV_8UC1);
+	codes.resize(image.total());
+
+	parallel_for_(Range(0, image.rows), [&image, &codes](const Range &range)
+				  {
+					  const uchar *rows[2 * CENSUS_RADIUS_Y + 1];
+					  int width = image.cols;
+
+					  for (int y = range.start; y < range.end; y++)
+					  {
+						  for (int dy = -CENSUS_RADIUS_Y; dy <= CENSUS_RADIUS_Y; dy++)
+						  {
+							  rows[dy + CENSUS_RADIUS_Y] = image.ptr<uchar>(min(max(y + dy, 0), image.rows - 1));
+						  }
+
+						  const uchar *centre = rows[CENSUS_RADIUS_Y];
+						  uint64_t *out = &codes[(size_t)y * width];
+
+						  for (int x = 0; x < width; x++)
+						  {
+							  uint64_t code = 0;
+
+							  for (int dy = 0; dy <= 2 * CENSUS_RADIUS_Y; dy++)
+							  {
+								  for (int dx = -CENSUS_RADIUS_X; dx <= CENSUS_RADIUS_X; dx++)
+								  {
+									  if (dy == CENSUS_RADIUS_Y && dx == 0)
+									  {
+										  continue;
+									  }
+
+									  int xx = min(max(x + dx, 0), width - 1);
+									  code = (code << 1) | (uint64_t)(rows[dy][xx] < centre[x]);
+								  }
+							  }
+
+							  out[x] = code;
+						  }
+					  } });
+}
+
+/* Census transform plus Hamming cost, summed over block_size windows and
+ * filtered like StereoBM (uniqueness, left-right check, speckles). Costs of
+ * neighbouring pixels are robust to gain and bias changes between the
+ * cameras, which the SAD of StereoBM is not.
+ *
+ * The Hamming cost uses the fastest kernel the CPU supports (AVX2, SSE4.2
+ * POPCNT or portable C++), picked at construction. Runs on the CPU, row bands
+ * in parallel, and reuses its winner data like every CostVolumeMatcher. */
+class CensusMatcher : public CostVolumeMatcher
+{
+public:
+	static Ptr<CensusMatcher> create()
+	{
+		return makePtr<CensusMatcher>();
+	}
+
+	CensusMatcher() : width(0)
+	{
+		setKernel(census_best_kernel());
+	}
+
+	/* Forces an implementation of the Hamming cost (benchmarks). Falls back
+	 * to the best supported one when the CPU lacks it. */
+	void setKernel(CensusKernel value)
+	{
+		kernel = census_kernel_supported(value) ? value : census_best_kernel();
+		hamming_row = census_kernel_function(kernel);
+	}
+
+	CensusKernel getKernel() const
+	{
+		return kernel;
+	}
+
+protected:
+	void prepare(const Mat &left, const Mat &right, Mat &deviation) override
+	{
+		census_transform(left, census_left);
+		census_transform(right, census_right);
+		width = left.cols;
+		deviation.release();
+	}
+
+	void accumulate_row(int *sums, int y, int disparity, int begin, int end, int sign) const override
+	{
+		const uint64_t *l = &census_left[(size_t)y * width];
+		const uint64_t *r = &census_right[(size_t)y * width] - disparity;
+		hamming_row(l + begin, r + begin, sums + begin, end - begin, sign);
+	}
+
+private:
+	CensusKernel kernel;
+	HammingRowFunc hamming_row;
+	vector<uint64_t> census_left, census_right;
+	int width;
+};
+
+#endif
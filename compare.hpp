@@ -0,0 +1,124 @@
+#ifndef STEREO_TUNER_COMPARE_HPP
+#define STEREO_TUNER_COMPARE_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+/* Differences shown at full brightness on the difference map, in pixels */
+static const int COMPARE_FULL_SCALE_PX = 4;
+
+/* Agreement of two disparity maps of the same pair. The valid ratios are of
+ * all the pixels of the maps, the rest of the pixels valid in both. */
+struct ComparisonStats
+{
+	double valid_a, valid_b, valid_both;
+	double mean_abs_diff; /* Pixels */
+	double over_1px; /* Ratio whose disparities differ by more than 1 px */
+
+	ComparisonStats() : valid_a(0), valid_b(0), valid_both(0), mean_abs_diff(0), over_1px(0)
+	{
+	}
+};
+
+/* Compares disparity maps A and B (CV_16S scaled by 16, or CV_8U in whole
+ * pixels) of the same size and draws their difference into `diff`, a BGR
+ * image: black where they agree, brighter up to COMPARE_FULL_SCALE_PX of
+ * difference, blue where only A is valid, red where only B is, dark gray
+ * where neither is. Rows are compared in parallel. */
+static ComparisonStats compare_disparities(const Mat &a, int min_a, const Mat &b, int min_b, Mat &diff)
+{
+	CV_Assert(a.size() == b.size());
+
+	Mat fixed_a = a, fixed_b = b;
+
+	if (a.depth() != CV_16S)
+	{
+		a.convertTo(fixed_a, CV_16S, StereoMatcher::DISP_SCALE);
+	}
+
+	if (b.depth() != CV_16S)
+	{
+		b.convertTo(fixed_b, CV_16S, StereoMatcher::DISP_SCALE);
+	}
+
+	const int invalid_a = min_a * StereoMatcher::DISP_SCALE, invalid_b = min_b * StereoMatcher::DISP_SCALE;
+	const int full_scale = COMPARE_FULL_SCALE_PX * StereoMatcher::DISP_SCALE;
+
+	// Per-row counts, summed once the rows are done
+	vector<int> only_a(a.rows, 0), only_b(a.rows, 0), both(a.rows, 0), over(a.rows, 0);
+	vector<double> abs_sum(a.rows, 0);
+
+	diff.create(a.size(), CV_8UC3);
+
+	parallel_for_(Range(0, a.rows), [&](const Range &rows)
+				  {
+					  for (int y = rows.start; y < rows.end; y++)
+					  {
+						  const short *da = fixed_a.ptr<short>(y);
+						  const short *db = fixed_b.ptr<short>(y);
+						  uchar *out = diff.ptr<uchar>(y);
+
+						  for (int x = 0; x < a.cols; x++, out += 3)
+						  {
+							  bool va = da[x] >= invalid_a, vb = db[x] >= invalid_b;
+
+							  if (va && vb)
+							  {
+								  int d = abs(da[x] - db[x]);
+								  uchar level = (uchar)(min(d, full_scale) * 255 / full_scale);
+								  out[0] = out[1] = out[2] = level;
+								  both[y]++;
+								  abs_sum[y] += d;
+								  over[y] += d > StereoMatcher::DISP_SCALE;
+							  }
+							  else if (va)
+							  {
+								  out[0] = 255;
+								  out[1] = out[2] = 0;
+								  only_a[y]++;
+							  }
+							  else if (vb)
+							  {
+								  out[0] = out[1] = 0;
+								  out[2] = 255;
+								  only_b[y]++;
+							  }
+							  else
+							  {
+								  out[0] = out[1] = out[2] = 48;
+							  }
+						  }
+					  } });
+
+	ComparisonStats stats;
+	double total_both = 0, total_abs = 0, total_over = 0, total_a = 0, total_b = 0;
+
+	for (int y = 0; y < a.rows; y++)
+	{
+		total_both += both[y];
+		total_abs += abs_sum[y];
+		total_over += over[y];
+		total_a += both[y] + only_a[y];
+		total_b += both[y] + only_b[y];
+	}
+
+	double pixels = max((double)a.total(), 1.0);
+	stats.valid_a = total_a / pixels;
+	stats.valid_b = total_b / pixels;
+	stats.valid_both = total_both / pixels;
+
+	if (total_both > 0)
+	{
+		stats.mean_abs_diff = total_abs / total_both / StereoMatcher::DISP_SCALE;
+		stats.over_1px = total_over / total_both;
+	}
+
+	return stats;
+}
+
+#endif
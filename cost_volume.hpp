@@ -0,0 +1,486 @@
+#ifndef STEREO_TUNER_COST_VOLUME_HPP
+#define STEREO_TUNER_COST_VOLUME_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <climits>
+#include <cstdlib>
+#include <vector>
+
+#include "profiler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Local (block aggregated, winner takes all) matcher that keeps what it
+ * learnt from the last pair. Subclasses provide the per-pixel matching cost;
+ * it is summed over block_size x block_size windows.
+ *
+ * The expensive part of block matching is the cost volume: one aggregated cost
+ * per pixel and disparity. The volume itself is never stored; while it is built, every
+ * pixel only keeps its winner (best disparity and cost), the best cost away
+ * from the winner, the costs on both sides of the winner and the winner of the
+ * right view. Those are all the post-processing stages need, so calling
+ * compute() again on the same images with only the uniqueness ratio, the
+ * texture threshold, disp12MaxDiff or the speckle settings changed only
+ * reruns the selection and filtering, which is linear in the number of
+ * pixels.
+ *
+ * The images are recognised by their buffers: a caller that overwrites an
+ * image in place must call clear() before the next compute(). */
+class CostVolumeMatcher : public StereoMatcher
+{
+public:
+	CostVolumeMatcher()
+		: min_disparity(0), num_disparities(64), block_size(21), speckle_window_size(0), speckle_range(0),
+		  disp_12_max_diff(-1), texture_threshold(10), uniqueness_ratio(15), has_volume(false), volume_reused(false), x_begin(0), x_end(0), has_texture(false)
+	{
+	}
+
+	void compute(InputArray left_array, InputArray right_array, OutputArray disparity_array) override
+	{
+		Mat left = left_array.getMat();
+		Mat right = right_array.getMat();
+
+		CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+		CV_Assert(num_disparities > 0 && num_disparities % 16 == 0 && block_size % 2 == 1 && block_size >= 3);
+
+		volume_reused = volume_matches(left, right);
+
+		if (!volume_reused)
+		{
+			ScopedTimer timer("cost");
+			build_volume(left, right);
+		}
+
+		disparity_array.create(left.size(), CV_16S);
+		Mat disparity = disparity_array.getMat();
+		ScopedTimer timer("filter");
+		select(disparity);
+	}
+
+	/* Whether the last compute() only ran the post-processing */
+	bool reused_cost_volume() const
+	{
+		return volume_reused;
+	}
+
+	void clear() override
+	{
+		has_volume = false;
+		cached_left.release();
+		cached_right.release();
+	}
+
+	int getMinDisparity() const override { return min_disparity; }
+	void setMinDisparity(int value) override { min_disparity = value; }
+	int getNumDisparities() const override { return num_disparities; }
+	void setNumDisparities(int value) override { num_disparities = value; }
+	int getBlockSize() const override { return block_size; }
+	void setBlockSize(int value) override { block_size = value; }
+	int getSpeckleWindowSize() const override { return speckle_window_size; }
+	void setSpeckleWindowSize(int value) override { speckle_window_size = value; }
+	int getSpeckleRange() const override { return speckle_range; }
+	void setSpeckleRange(int value) override { speckle_range = value; }
+	int getDisp12MaxDiff() const override { return disp_12_max_diff; }
+	void setDisp12MaxDiff(int value) override { disp_12_max_diff = value; }
+
+	void setTextureThreshold(int value) { texture_threshold = value; }
+	void setUniquenessRatio(int value) { uniqueness_ratio = value; }
+	void setROI1(Rect roi) { roi1 = roi; }
+	void setROI2(Rect roi) { roi2 = roi; }
+
+protected:
+	/* Transforms the pair into whatever accumulate_row reads. `deviation`
+	 * receives the per-pixel texture measure (CV_8U) summed over the block for
+	 * the texture check; leaving it empty disables the check. */
+	virtual void prepare(const Mat &left, const Mat &right, Mat &deviation) = 0;
+
+	/* Adds (sign 1) or removes (sign -1) the matching costs of left pixels
+	 * [begin, end) of row y against the right pixels at x - disparity */
+	virtual void accumulate_row(int *sums, int y, int disparity, int begin, int end, int sign) const = 0;
+
+	/* Parameters the winner data depends on. Subclasses add their own. */
+	virtual void volume_key(vector<int> &key) const
+	{
+		key.push_back(min_disparity);
+		key.push_back(num_disparities);
+		key.push_back(block_size);
+	}
+
+	int min_disparity, num_disparities, block_size;
+	int speckle_window_size, speckle_range, disp_12_max_diff;
+	int texture_threshold, uniqueness_ratio;
+	Rect roi1, roi2;
+
+private:
+	/* Rows handled by one task while building the winner data */
+	static const int BAND_ROWS = 32;
+
+	bool volume_matches(const Mat &left, const Mat &right) const
+	{
+		vector<int> key;
+		volume_key(key);
+
+		return has_volume && left.data == cached_left.data && right.data == cached_right.data &&
+			   left.size() == cached_left.size() && left.step == cached_left.step && key == cached_key;
+	}
+
+	void build_volume(const Mat &left, const Mat &right)
+	{
+		Size size = left.size();
+		int radius = block_size / 2;
+		Mat deviation, deviation_sum;
+
+		prepare(left, right, deviation);
+		has_texture = !deviation.empty();
+
+		if (has_texture)
+		{
+			integral(deviation, deviation_sum, CV_32S);
+		}
+
+		best.create(size, CV_16S);
+		best.setTo(Scalar(-1));
+		right_best.create(size, CV_16S);
+		right_best.setTo(Scalar(-1));
+		best_cost.create(size, CV_32S);
+		second_cost.create(size, CV_32S);
+		lower_cost.create(size, CV_32S);
+		upper_cost.create(size, CV_32S);
+		texture = Mat::zeros(size, CV_32S);
+
+		// Pixels whose block and all candidate blocks lie inside the images
+		int max_disparity = min_disparity + num_disparities - 1;
+		x_begin = radius + max(0, max_disparity);
+		x_end = size.width - radius - max(0, -min_disparity);
+
+		if (x_begin < x_end && size.height > 2 * radius)
+		{
+			for (int y = radius; y < size.height - radius && has_texture; y++)
+			{
+				const int *top = deviation_sum.ptr<int>(y - radius);
+				const int *bottom = deviation_sum.ptr<int>(y + radius + 1);
+				int *t = texture.ptr<int>(y);
+
+				for (int x = x_begin; x < x_end; x++)
+				{
+					t[x] = bottom[x + radius + 1] - top[x + radius + 1] - bottom[x - radius] + top[x - radius];
+				}
+			}
+
+			int bands = (size.height + BAND_ROWS - 1) / BAND_ROWS;
+			parallel_for_(Range(0, bands), [this](const Range &range)
+						  {
+							  for (int band = range.start; band < range.end; band++)
+							  {
+								  match_band(band * BAND_ROWS, min((band + 1) * BAND_ROWS, best.rows));
+							  } });
+		}
+
+		cached_left = left;
+		cached_right = right;
+		cached_key.clear();
+		volume_key(cached_key);
+		has_volume = true;
+	}
+
+	/* Builds the winner data of rows [y0, y1). The SAD of every disparity is
+	 * obtained from running column sums, updated by one row at a time. */
+	void match_band(int y0, int y1)
+	{
+		int width = best.cols;
+		int radius = block_size / 2;
+		int ndisp = num_disparities;
+		int y_begin = max(y0, radius);
+		int y_end = min(y1, best.rows - radius);
+		int column_begin = x_begin - radius;
+		int column_end = x_end + radius;
+
+		if (y_begin >= y_end)
+		{
+			return;
+		}
+
+		vector<int> column_sums((size_t)ndisp * width, 0);
+		vector<int> costs((size_t)width * ndisp, INT_MAX);
+
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int d = 0; d < ndisp; d++)
+			{
+				int disparity = min_disparity + d;
+				int *sums = &column_sums[(size_t)d * width];
+
+				if (y == y_begin)
+				{
+					for (int wy = y - radius; wy <= y + radius; wy++)
+					{
+						accumulate_row(sums, wy, disparity, column_begin, column_end, 1);
+					}
+				}
+				else
+				{
+					accumulate_row(sums, y + radius, disparity, column_begin, column_end, 1);
+					accumulate_row(sums, y - radius - 1, disparity, column_begin, column_end, -1);
+				}
+
+				int sad = 0;
+				for (int x = x_begin - radius; x < x_begin + radius; x++)
+				{
+					sad += sums[x];
+				}
+
+				for (int x = x_begin; x < x_end; x++)
+				{
+					sad += sums[x + radius];
+					costs[(size_t)x * ndisp + d] = sad;
+					sad -= sums[x - radius];
+				}
+			}
+
+			short *b = best.ptr<short>(y);
+			int *bc = best_cost.ptr<int>(y);
+			int *sc = second_cost.ptr<int>(y);
+			int *lc = lower_cost.ptr<int>(y);
+			int *uc = upper_cost.ptr<int>(y);
+
+			for (int x = x_begin; x < x_end; x++)
+			{
+				const int *c = &costs[(size_t)x * ndisp];
+				int winner = 0;
+
+				for (int d = 1; d < ndisp; d++)
+				{
+					if (c[d] < c[winner])
+					{
+						winner = d;
+					}
+				}
+
+				int second = INT_MAX;
+				for (int d = 0; d < ndisp; d++)
+				{
+					if ((d < winner - 1 || d > winner + 1) && c[d] < second)
+					{
+						second = c[d];
+					}
+				}
+
+				// Same padding as StereoBM at both ends of the range
+				b[x] = (short)winner;
+				bc[x] = c[winner];
+				sc[x] = second;
+				lc[x] = c[winner > 0 ? winner - 1 : 1];
+				uc[x] = c[winner < ndisp - 1 ? winner + 1 : ndisp - 2];
+			}
+
+			// Winner of every right pixel xr, whose candidates are the left
+			// pixels xr + disparity
+			short *rb = right_best.ptr<short>(y);
+			int xr_begin = x_begin - (min_disparity + ndisp - 1);
+			int xr_end = x_end - min_disparity;
+
+			for (int xr = xr_begin; xr < xr_end; xr++)
+			{
+				int winner = -1, winner_cost = INT_MAX;
+
+				for (int d = 0; d < ndisp; d++)
+				{
+					int x = xr + min_disparity + d;
+
+					if (x >= x_begin && x < x_end && costs[(size_t)x * ndisp + d] < winner_cost)
+					{
+						winner = d;
+						winner_cost = costs[(size_t)x * ndisp + d];
+					}
+				}
+
+				rb[xr] = (short)winner;
+			}
+		}
+	}
+
+	/* Post-processing: texture and uniqueness checks, sub-pixel refinement,
+	 * left-right check, speckle filter and ROI, in the order of StereoBM */
+	void select(Mat &disparity)
+	{
+		short invalid = (short)((min_disparity - 1) * StereoMatcher::DISP_SCALE);
+		disparity.setTo(Scalar(invalid));
+
+		parallel_for_(Range(0, disparity.rows), [this, &disparity](const Range &range)
+					  {
+						  for (int y = range.start; y < range.end; y++)
+						  {
+							  const short *b = best.ptr<short>(y);
+							  const short *rb = right_best.ptr<short>(y);
+							  const int *bc = best_cost.ptr<int>(y);
+							  const int *sc = second_cost.ptr<int>(y);
+							  const int *lc = lower_cost.ptr<int>(y);
+							  const int *uc = upper_cost.ptr<int>(y);
+							  const int *t = texture.ptr<int>(y);
+							  short *out = disparity.ptr<short>(y);
+
+							  for (int x = 0; x < disparity.cols; x++)
+							  {
+								  int d = b[x];
+
+								  if (d < 0 || (has_texture && t[x] < texture_threshold))
+								  {
+									  continue;
+								  }
+
+								  if (uniqueness_ratio > 0 && sc[x] <= bc[x] + bc[x] * uniqueness_ratio / 100)
+								  {
+									  continue;
+								  }
+
+								  if (disp_12_max_diff >= 0)
+								  {
+									  int right = rb[x - min_disparity - d];
+
+									  if (right < 0 || abs(right - d) > disp_12_max_diff)
+									  {
+										  continue;
+									  }
+								  }
+
+								  int64 lower = lc[x], upper = uc[x];
+								  int64 k = lower + upper - 2 * (int64)bc[x] + (lower > upper ? lower - upper : upper - lower);
+								  int64 offset = k != 0 ? (lower - upper) * 256 / k : 0;
+								  out[x] = (short)(((min_disparity + d) * 256 + offset + 15) >> 4);
+							  }
+						  } });
+
+		if (speckle_range >= 0 && speckle_window_size > 0)
+		{
+			filterSpeckles(disparity, invalid, speckle_window_size, speckle_range, speckle_buffer);
+		}
+
+		if (roi1.area() > 0 && roi2.area() > 0)
+		{
+			Rect valid = getValidDisparityROI(roi1, roi2, min_disparity, num_disparities, block_size);
+			Mat inside = Mat::zeros(disparity.size(), CV_8U);
+			inside(valid & Rect(0, 0, disparity.cols, disparity.rows)).setTo(Scalar(255));
+			disparity.setTo(Scalar(invalid), inside == 0);
+		}
+	}
+
+	/* What the winner data was built from */
+	Mat cached_left, cached_right;
+	vector<int> cached_key;
+	bool has_volume;
+	bool volume_reused;
+
+	int x_begin, x_end;
+	bool has_texture;
+
+	/* Per pixel winner data. best and right_best hold the disparity index
+	 * (0 for min_disparity), -1 where no block could be matched. */
+	Mat best, right_best;
+	Mat best_cost, second_cost, lower_cost, upper_cost;
+	Mat texture;
+	Mat speckle_buffer;
+};
+
+/* CostVolumeMatcher with the cost of StereoBM: absolute differences of the
+ * pre-filtered images. The pre-filters follow StereoBM closely but not bit
+ * for bit, so the maps are close to, not identical with, the ones of
+ * StereoBM. */
+class CostVolumeBM : public CostVolumeMatcher
+{
+public:
+	static Ptr<CostVolumeBM> create()
+	{
+		return makePtr<CostVolumeBM>();
+	}
+
+	CostVolumeBM()
+		: pre_filter_type(StereoBM::PREFILTER_NORMALIZED_RESPONSE), pre_filter_size(9), pre_filter_cap(31)
+	{
+	}
+
+	void setPreFilterType(int value) { pre_filter_type = value; }
+	void setPreFilterSize(int value) { pre_filter_size = value; }
+	void setPreFilterCap(int value) { pre_filter_cap = value; }
+
+protected:
+	void prepare(const Mat &left, const Mat &right, Mat &deviation) override
+	{
+		prefilter(left, filtered_left);
+		prefilter(right, filtered_right);
+
+		// Texture of the left block: sum of |filtered - cap|
+		deviation.create(left.size(), CV_8U);
+		for (int y = 0; y < left.rows; y++)
+		{
+			const uchar *f = filtered_left.ptr<uchar>(y);
+			uchar *d = deviation.ptr<uchar>(y);
+
+			for (int x = 0; x < left.cols; x++)
+			{
+				d[x] = (uchar)abs((int)f[x] - pre_filter_cap);
+			}
+		}
+	}
+
+	void accumulate_row(int *sums, int y, int disparity, int begin, int end, int sign) const override
+	{
+		const uchar *l = filtered_left.ptr<uchar>(y);
+		const uchar *r = filtered_right.ptr<uchar>(y) - disparity;
+
+		for (int x = begin; x < end; x++)
+		{
+			sums[x] += sign * abs((int)l[x] - (int)r[x]);
+		}
+	}
+
+	void volume_key(vector<int> &key) const override
+	{
+		CostVolumeMatcher::volume_key(key);
+		key.push_back(pre_filter_type);
+		key.push_back(pre_filter_size);
+		key.push_back(pre_filter_cap);
+	}
+
+private:
+	/* StereoBM pre-filter: the image minus its local mean (normalized
+	 * response) or the horizontal Sobel derivative, clipped to
+	 * [-pre_filter_cap, pre_filter_cap] and offset by pre_filter_cap */
+	void prefilter(const Mat &src, Mat &dst) const
+	{
+		Mat response;
+
+		if (pre_filter_type == StereoBM::PREFILTER_XSOBEL)
+		{
+			Sobel(src, response, CV_32F, 1, 0, 3, 1, 0, BORDER_REPLICATE);
+		}
+		else
+		{
+			Mat image, mean;
+			src.convertTo(image, CV_32F);
+			boxFilter(image, mean, CV_32F, Size(pre_filter_size, pre_filter_size), Point(-1, -1), true, BORDER_REPLICATE);
+			response = image - mean;
+		}
+
+		dst.create(src.size(), CV_8U);
+
+		for (int y = 0; y < src.rows; y++)
+		{
+			const float *r = response.ptr<float>(y);
+			uchar *d = dst.ptr<uchar>(y);
+
+			for (int x = 0; x < src.cols; x++)
+			{
+				int v = cvRound(r[x]);
+				d[x] = (uchar)(min(max(v, -pre_filter_cap), pre_filter_cap) + pre_filter_cap);
+			}
+		}
+	}
+
+	int pre_filter_type, pre_filter_size, pre_filter_cap;
+	Mat filtered_left, filtered_right;
+};
+
+#endif
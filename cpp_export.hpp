@@ -0,0 +1,191 @@
+#ifndef STEREO_TUNER_CPP_EXPORT_HPP
+#define STEREO_TUNER_CPP_EXPORT_HPP
+
+#include <cctype>
+#include <cstdio>
+#include <string>
+
+#include "matcher.hpp"
+
+using namespace std;
+
+/* The specialised kernel the exported headers include. Like the glade file,
+ * it is read from the working directory and copied next to the export. */
+static const char CPP_EXPORT_KERNEL[] = "fixed_bm.hpp";
+
+/* Include guard of an exported header, from its file name */
+static string cpp_export_guard(const string &filename)
+{
+	size_t slash = filename.find_last_of("/\\");
+	string name = slash == string::npos ? filename : filename.substr(slash + 1);
+	string guard;
+
+	for (size_t i = 0; i < name.size(); i++)
+	{
+		guard += isalnum((unsigned char)name[i]) ? (char)toupper((unsigned char)name[i]) : '_';
+	}
+
+	return isdigit((unsigned char)guard[0]) ? "_" + guard : guard;
+}
+
+static void cpp_export_constant(FILE *file, const char *name, int value)
+{
+	fprintf(file, "constexpr int %s = %d;\n", name, value);
+}
+
+static void write_cpp_header(FILE *file, const string &guard, const MatcherParams &params)
+{
+	fprintf(file, "/* %s matcher parameters exported by Stereo Tuner */\n\n", matcher_type_name(params.matcher_type));
+	fprintf(file, "#ifndef %s\n#define %s\n\n", guard.c_str(), guard.c_str());
+	fprintf(file, "#include <opencv2/core.hpp>\n#include <opencv2/calib3d.hpp>\n");
+
+	if (params.matcher_type == BM)
+	{
+		fprintf(file, "\n#include \"%s\"\n", CPP_EXPORT_KERNEL);
+	}
+
+	fprintf(file, "\nnamespace tuned\n{\n");
+	cpp_export_constant(file, "block_size", params.block_size);
+	cpp_export_constant(file, "min_disparity", params.min_disparity);
+	cpp_export_constant(file, "num_disparities", params.num_disparities);
+	cpp_export_constant(file, "disp_12_max_diff", params.disp_12_max_diff);
+	cpp_export_constant(file, "speckle_range", params.speckle_range);
+	cpp_export_constant(file, "speckle_window_size", params.speckle_window_size);
+	cpp_export_constant(file, "uniqueness_ratio", params.uniqueness_ratio);
+
+	switch (params.matcher_type)
+	{
+	case BM:
+		cpp_export_constant(file, "pre_filter_cap", params.pre_filter_cap);
+		cpp_export_constant(file, "pre_filter_size", params.pre_filter_size);
+		cpp_export_constant(file, "pre_filter_type", params.pre_filter_type);
+		cpp_export_constant(file, "texture_threshold", params.texture_threshold);
+		fprintf(file,
+				"\n/* Block matching specialised for the tuned window and disparity count */\n"
+				"typedef FixedBlockMatcher<block_size, num_disparities> Matcher;\n\n"
+				"inline Matcher create_matcher()\n{\n"
+				"\tMatcher matcher;\n"
+				"\tmatcher.min_disparity = min_disparity;\n"
+				"\tmatcher.pre_filter_type = pre_filter_type;\n"
+				"\tmatcher.pre_filter_size = pre_filter_size;\n"
+				"\tmatcher.pre_filter_cap = pre_filter_cap;\n"
+				"\tmatcher.texture_threshold = texture_threshold;\n"
+				"\tmatcher.uniqueness_ratio = uniqueness_ratio;\n"
+				"\tmatcher.speckle_window_size = speckle_window_size;\n"
+				"\tmatcher.speckle_range = speckle_range;\n"
+				"\treturn matcher;\n}\n\n"
+				"/* OpenCV's generic matcher with the same parameters, which also does\n"
+				" * the left-right check (disp_12_max_diff) */\n"
+				"inline cv::Ptr<cv::StereoBM> create_generic_matcher()\n{\n"
+				"\tcv::Ptr<cv::StereoBM> matcher = cv::StereoBM::create(num_disparities, block_size);\n"
+				"\tmatcher->setMinDisparity(min_disparity);\n"
+				"\tmatcher->setDisp12MaxDiff(disp_12_max_diff);\n"
+				"\tmatcher->setSpeckleRange(speckle_range);\n"
+				"\tmatcher->setSpeckleWindowSize(speckle_window_size);\n"
+				"\tmatcher->setPreFilterCap(pre_filter_cap);\n"
+				"\tmatcher->setPreFilterSize(pre_filter_size);\n"
+				"\tmatcher->setPreFilterType(pre_filter_type);\n"
+				"\tmatcher->setTextureThreshold(texture_threshold);\n"
+				"\tmatcher->setUniquenessRatio(uniqueness_ratio);\n"
+				"\treturn matcher;\n}\n");
+		break;
+
+	case SGBM:
+		cpp_export_constant(file, "pre_filter_cap", params.pre_filter_cap);
+		cpp_export_constant(file, "p1", params.p1);
+		cpp_export_constant(file, "p2", params.p2);
+		cpp_export_constant(file, "mode", params.mode);
+		fprintf(file,
+				"\n/* Semi-global matching has no specialised kernel: OpenCV's matcher\n"
+				" * with the tuned parameters */\n"
+				"inline cv::Ptr<cv::StereoSGBM> create_generic_matcher()\n{\n"
+				"\treturn cv::StereoSGBM::create(min_disparity, num_disparities, block_size, p1, p2, disp_12_max_diff,\n"
+				"\t\tpre_filter_cap, uniqueness_ratio, speckle_window_size, speckle_range, mode);\n}\n");
+		break;
+
+	case CENSUS:
+		fprintf(file, "\n/* The census matcher lives in Stereo Tuner (census.hpp): the values only */\n");
+		break;
+	}
+
+	if (params.post_filter != POST_FILTER_NONE)
+	{
+		fprintf(file, "\n/* Post-filter of the tuner (postfilter.hpp), not applied by this header */\n");
+		cpp_export_constant(file, "post_filter", params.post_filter);
+		cpp_export_constant(file, "post_filter_radius", params.post_filter_radius);
+		cpp_export_constant(file, "post_filter_sigma", params.post_filter_sigma);
+	}
+
+	fprintf(file, "}\n\n#endif\n");
+}
+
+/* Copies a text file. Read whole first, so copying it onto itself is
+ * harmless. */
+static bool copy_text_file(const string &from, const string &to)
+{
+	FILE *in = fopen(from.c_str(), "rb");
+
+	if (in == NULL)
+	{
+		return false;
+	}
+
+	string text;
+	char buffer[4096];
+	size_t bytes;
+
+	while ((bytes = fread(buffer, 1, sizeof(buffer), in)) > 0)
+	{
+		text.append(buffer, bytes);
+	}
+
+	fclose(in);
+	FILE *out = fopen(to.c_str(), "wb");
+
+	if (out == NULL)
+	{
+		return false;
+	}
+
+	bool ok = fwrite(text.data(), 1, text.size(), out) == text.size();
+	return fclose(out) == 0 && ok;
+}
+
+/* Writes the parameters as constexpr values in a C++ header. For block
+ * matching, the header also defines the FixedBlockMatcher specialised for
+ * them, and the kernel is copied next to it. Returns false, with the reason
+ * in `error`, when a file cannot be read or written. */
+static bool export_cpp_header(const string &filename, const MatcherParams &params, string &error)
+{
+	if (params.matcher_type == BM)
+	{
+		size_t slash = filename.find_last_of('/');
+		string kernel = (slash == string::npos ? string() : filename.substr(0, slash + 1)) + CPP_EXPORT_KERNEL;
+
+		if (!copy_text_file(CPP_EXPORT_KERNEL, kernel))
+		{
+			error = "Could not copy " + string(CPP_EXPORT_KERNEL) + " to " + kernel + ".";
+			return false;
+		}
+	}
+
+	FILE *file = fopen(filename.c_str(), "w");
+
+	if (file == NULL)
+	{
+		error = "Could not write " + filename + ".";
+		return false;
+	}
+
+	write_cpp_header(file, cpp_export_guard(filename), params);
+
+	if (fclose(file) != 0)
+	{
+		error = "Could not write " + filename + ".";
+		return false;
+	}
+
+	return true;
+}
+
+#endif
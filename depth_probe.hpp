@@ -0,0 +1,72 @@
+#ifndef STEREO_TUNER_DEPTH_PROBE_HPP
+#define STEREO_TUNER_DEPTH_PROBE_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+/* Depth of every 16-bit fixed-point disparity (disparity * 16), so probing a
+ * pixel is a single table read whatever the camera settings. The table is
+ * only rebuilt when the focal length or the baseline change. */
+class DepthLut
+{
+public:
+	DepthLut() : focal_px(0), baseline(0)
+	{
+	}
+
+	/* `focal_px` in pixels, `baseline` in the unit the depths should be in */
+	void update(double focal, double base)
+	{
+		if (!table.empty() && focal == focal_px && base == baseline)
+		{
+			return;
+		}
+
+		focal_px = focal;
+		baseline = base;
+		table.resize(65536);
+
+		for (int raw = -32768; raw < 32768; raw++)
+		{
+			// No depth for zero or negative disparities (at or beyond infinity)
+			table[raw + 32768] = raw > 0 && focal > 0 && base > 0 ? (float)(focal * base * StereoMatcher::DISP_SCALE / raw) : -1.0f;
+		}
+	}
+
+	/* Depth of a fixed-point disparity, negative when there is none */
+	float depth(int raw) const
+	{
+		return table.empty() ? -1.0f : table[(short)raw + 32768];
+	}
+
+private:
+	vector<float> table;
+	double focal_px, baseline;
+};
+
+/* Fixed-point disparity (disparity * 16) of a pixel of a CV_16S map, or of a
+ * CV_8U map in whole pixels. False outside the map or on invalid pixels. */
+static bool disparity_at(const Mat &disparity, Point p, int min_disparity, int &raw)
+{
+	if (!Rect(Point(), disparity.size()).contains(p))
+	{
+		return false;
+	}
+
+	if (disparity.depth() == CV_16S)
+	{
+		raw = disparity.at<short>(p);
+	}
+	else
+	{
+		raw = disparity.at<uchar>(p) * StereoMatcher::DISP_SCALE;
+	}
+
+	return raw >= min_disparity * StereoMatcher::DISP_SCALE;
+}
+
+#endif
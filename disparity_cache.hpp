@@ -0,0 +1,354 @@
+#ifndef STEREO_TUNER_DISPARITY_CACHE_HPP
+#define STEREO_TUNER_DISPARITY_CACHE_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "matcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Memory the disparity maps of the cache may take */
+static const size_t DISPARITY_CACHE_MAX_BYTES = 256 << 20;
+
+/* Part of every key: bump it when a matcher, a post-filter or the encoding of
+ * the stored PNGs changes the map a key stands for, so maps written to a
+ * cache directory by an older build are not reused */
+static const int DISPARITY_CACHE_VERSION = 1;
+
+/* 64-bit hash built up from the inputs of a disparity map. Not
+ * cryptographic: eight bytes are mixed at a time, so hashing a whole image
+ * costs about as much as copying it. */
+class DisparityKey
+{
+public:
+	explicit DisparityKey(uint64_t seed = 0) : h(0xcbf29ce484222325ULL ^ seed)
+	{
+	}
+
+	void add(const void *bytes, size_t size)
+	{
+		const uchar *p = (const uchar *)bytes;
+		size_t i = 0;
+
+		for (; i + 8 <= size; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, p + i, 8);
+			mix(word);
+		}
+
+		uint64_t tail = 0;
+		memcpy(&tail, p + i, size - i);
+		mix(tail ^ ((uint64_t)size << 56));
+	}
+
+	void add(int value)
+	{
+		mix((uint64_t)(int64)value);
+	}
+
+	void add(const Rect &rect)
+	{
+		add(rect.x);
+		add(rect.y);
+		add(rect.width);
+		add(rect.height);
+	}
+
+	/* Size, type and pixels, row by row so submatrices hash like copies */
+	void add(const Mat &image)
+	{
+		add(image.rows);
+		add(image.cols);
+		add(image.type());
+
+		for (int y = 0; y < image.rows; y++)
+		{
+			add(image.ptr(y), image.cols * image.elemSize());
+		}
+	}
+
+	/* Every field, one by one: the padding of the struct is not hashed */
+	void add(const MatcherParams &params)
+	{
+		const int fields[] = {DISPARITY_CACHE_VERSION, params.matcher_type, params.block_size, params.disp_12_max_diff, params.min_disparity,
+							  params.num_disparities, params.speckle_range, params.speckle_window_size, params.pre_filter_cap,
+							  params.pre_filter_size, params.pre_filter_type, params.texture_threshold, params.uniqueness_ratio,
+							  params.p1, params.p2, params.mode, params.cost_volume, params.post_filter,
+							  params.post_filter_radius, params.post_filter_sigma, runs_on_gpu(params)};
+
+		for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+		{
+			add(fields[i]);
+		}
+	}
+
+	uint64_t value() const
+	{
+		// 0 means "not cached" to the callers
+		return h != 0 ? h : 1;
+	}
+
+private:
+	void mix(uint64_t word)
+	{
+		h = (h ^ word) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+
+	uint64_t h;
+};
+
+/* Hash of a pair of images, the first half of a disparity key */
+static uint64_t hash_pair(const Mat &left, const Mat &right)
+{
+	DisparityKey key;
+	key.add(left);
+	key.add(right);
+	return key.value();
+}
+
+/* Key of a pair matched whole in one go by compute_disparity(), as the batch
+ * mode and the sweeps do. The interface matches tiles instead, whose keys
+ * (disparity_job_key) never collide with these. */
+static uint64_t whole_pair_key(uint64_t pair_hash, const MatcherParams &params, const Rect *roi1, const Rect *roi2)
+{
+	DisparityKey key(pair_hash);
+	key.add(params);
+	key.add(-1);
+
+	if (roi1 != NULL && roi2 != NULL)
+	{
+		key.add(*roi1);
+		key.add(*roi2);
+	}
+
+	return key.value();
+}
+
+/* Disparity maps by key, least recently used first out once they take more
+ * than `max_bytes`. Maps are shared, not copied: they must not be modified
+ * once stored.
+ *
+ * With a directory, every map is also written there as a PNG named after
+ * its key, so the maps survive the process: a miss in memory looks on disk
+ * before giving up. CV_16S maps are stored as 16-bit PNG offset by 32768,
+ * CV_8U maps as they are. Safe to use from several threads. */
+class DisparityCache
+{
+public:
+	explicit DisparityCache(size_t max_bytes = DISPARITY_CACHE_MAX_BYTES) : max_bytes(max_bytes), bytes(0)
+	{
+	}
+
+	/* Enables the disk tier; an empty directory disables it */
+	bool set_directory(const string &dir)
+	{
+		lock_guard<mutex> lock(mtx);
+
+		if (!dir.empty() && !utils::fs::createDirectories(dir))
+		{
+			return false;
+		}
+
+		directory = dir;
+		return true;
+	}
+
+	bool get(uint64_t key, Mat &disparity)
+	{
+		string filename;
+
+		{
+			lock_guard<mutex> lock(mtx);
+			unordered_map<uint64_t, list<Entry>::iterator>::iterator it = index.find(key);
+
+			if (it != index.end())
+			{
+				entries.splice(entries.begin(), entries, it->second);
+				disparity = it->second->disparity;
+				return true;
+			}
+
+			if (directory.empty())
+			{
+				return false;
+			}
+
+			filename = file_for(key);
+		}
+
+		// Decoded without the lock, other threads keep using the memory tier
+		Mat stored = imread(filename, IMREAD_UNCHANGED);
+
+		if (stored.empty() || (stored.type() != CV_16UC1 && stored.type() != CV_8UC1))
+		{
+			return false;
+		}
+
+		if (stored.type() == CV_16UC1)
+		{
+			stored.convertTo(disparity, CV_16S, 1, -32768);
+		}
+		else
+		{
+			disparity = stored;
+		}
+
+		lock_guard<mutex> lock(mtx);
+		insert(key, disparity);
+		return true;
+	}
+
+	/* Cheap check, without loading anything */
+	bool contains(uint64_t key)
+	{
+		lock_guard<mutex> lock(mtx);
+		return index.count(key) > 0 || (!directory.empty() && utils::fs::exists(file_for(key)));
+	}
+
+	void put(uint64_t key, const Mat &disparity)
+	{
+		if (disparity.empty() || (disparity.type() != CV_16SC1 && disparity.type() != CV_8UC1))
+		{
+			return;
+		}
+
+		string filename;
+
+		{
+			lock_guard<mutex> lock(mtx);
+			insert(key, disparity);
+
+			if (directory.empty() || utils::fs::exists(file_for(key)))
+			{
+				return;
+			}
+
+			filename = file_for(key);
+		}
+
+		Mat stored = disparity;
+
+		if (disparity.type() == CV_16SC1)
+		{
+			disparity.convertTo(stored, CV_16U, 1, 32768);
+		}
+
+		// Written aside and renamed, so a reader never sees half a file
+		vector<int> flags;
+		flags.push_back(IMWRITE_PNG_COMPRESSION);
+		flags.push_back(1);
+		string partial;
+
+		if (!reserve_partial(filename, partial) || !imwrite(partial, stored, flags) || rename(partial.c_str(), filename.c_str()) != 0)
+		{
+			fprintf(stderr, "WARNING: could not write %s to the disparity cache\n", filename.c_str());
+			remove(partial.c_str());
+		}
+	}
+
+private:
+	struct Entry
+	{
+		uint64_t key;
+		Mat disparity;
+	};
+
+	/* Called with the lock held */
+	void insert(uint64_t key, const Mat &disparity)
+	{
+		size_t size = disparity.total() * disparity.elemSize();
+
+		if (size > max_bytes)
+		{
+			return;
+		}
+
+		unordered_map<uint64_t, list<Entry>::iterator>::iterator it = index.find(key);
+
+		if (it != index.end())
+		{
+			bytes -= it->second->disparity.total() * it->second->disparity.elemSize();
+			entries.erase(it->second);
+			index.erase(it);
+		}
+
+		Entry entry;
+		entry.key = key;
+		entry.disparity = disparity;
+		entries.push_front(entry);
+		index[key] = entries.begin();
+		bytes += size;
+
+		while (bytes > max_bytes)
+		{
+			const Entry &last = entries.back();
+			bytes -= last.disparity.total() * last.disparity.elemSize();
+			index.erase(last.key);
+			entries.pop_back();
+		}
+	}
+
+	/* Creates an empty file next to `filename` under a name no other process
+	 * or thread sharing the directory uses, for the PNG to be written to */
+	static bool reserve_partial(const string &filename, string &partial)
+	{
+		string base = filename.substr(0, filename.size() - 4);
+#ifdef _WIN32
+		// Unique to the process and the call, though not created here
+		partial = base + ".partial.XXXXXX";
+
+		if (_mktemp_s(&partial[0], partial.size() + 1) != 0)
+		{
+			return false;
+		}
+
+		partial += ".png";
+		return true;
+#else
+		partial = base + ".partial.XXXXXX.png";
+		int fd = mkstemps(&partial[0], 4);
+
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		::close(fd);
+		return true;
+#endif
+	}
+
+	string file_for(uint64_t key) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.png", (unsigned long long)key);
+		return directory + name;
+	}
+
+	size_t max_bytes;
+	mutex mtx;
+	list<Entry> entries; /* Most recently used first */
+	unordered_map<uint64_t, list<Entry>::iterator> index;
+	size_t bytes;
+	string directory;
+};
+
+#endif
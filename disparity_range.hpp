@@ -0,0 +1,185 @@
+#ifndef STEREO_TUNER_DISPARITY_RANGE_HPP
+#define STEREO_TUNER_DISPARITY_RANGE_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+#include "profiler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Keypoints detected per view. ORB on a single level is FAST corners with
+ * binary descriptors: about 5 ms on a 640x480 pair. */
+static const int RANGE_FEATURES = 1000;
+
+/* Rows a match may be off by in a rectified pair */
+static const float RANGE_ROW_TOLERANCE = 1.5f;
+
+/* Hamming distance past which two ORB descriptors are not the same corner */
+static const float RANGE_MAX_DISTANCE = 64;
+
+/* Lowe's ratio: the best candidate on the row must be clearly better than
+ * the second best */
+static const float RANGE_MATCH_RATIO = 0.8f;
+
+/* Fewer matches than this do not say anything about the scene */
+static const size_t RANGE_MIN_MATCHES = 20;
+
+/* Share of the matches ignored at each end of the range, as outliers */
+static const double RANGE_OUTLIER_RATIO = 0.02;
+
+/* Slack around the measured range: sparse corners miss the textureless
+ * parts of the scene and the block needs room at the ends */
+static const double RANGE_MARGIN_RATIO = 0.1;
+static const int RANGE_MARGIN_PX = 4;
+
+/* Range of disparities found in a rectified pair, and the tightest search
+ * range of the matchers that covers it */
+struct DisparityRange
+{
+	bool valid;
+	size_t matches;
+	float low, high; /* Measured disparities, outliers left out */
+	int min_disparity, num_disparities;
+
+	DisparityRange() : valid(false), matches(0), low(0), high(0), min_disparity(0), num_disparities(16)
+	{
+	}
+};
+
+/* Disparities of the matches go in, min_disparity and num_disparities
+ * (a multiple of 16) come out */
+static DisparityRange disparity_range_of(vector<float> disparities)
+{
+	DisparityRange range;
+	range.matches = disparities.size();
+
+	if (disparities.size() < RANGE_MIN_MATCHES)
+	{
+		return range;
+	}
+
+	size_t outliers = (size_t)(disparities.size() * RANGE_OUTLIER_RATIO);
+	nth_element(disparities.begin(), disparities.begin() + outliers, disparities.end());
+	range.low = disparities[outliers];
+	nth_element(disparities.begin(), disparities.end() - 1 - outliers, disparities.end());
+	range.high = disparities[disparities.size() - 1 - outliers];
+
+	double margin = RANGE_MARGIN_PX + (range.high - range.low) * RANGE_MARGIN_RATIO;
+	range.min_disparity = (int)floor(range.low - margin);
+	int max_disparity = (int)ceil(range.high + margin);
+	range.num_disparities = max(16, (max_disparity - range.min_disparity + 16) / 16 * 16);
+	range.valid = true;
+	return range;
+}
+
+/* Whether the sliders should take `range` over the current search range:
+ * right away when the scene left the current range, and only once it is
+ * clearly narrower otherwise, so the range does not flicker on video. */
+static bool range_worth_applying(const DisparityRange &range, int min_disparity, int num_disparities)
+{
+	if (!range.valid)
+	{
+		return false;
+	}
+
+	bool outside = range.min_disparity < min_disparity || range.min_disparity + range.num_disparities > min_disparity + num_disparities;
+	return outside || num_disparities - range.num_disparities >= 32;
+}
+
+/* Estimates the disparity range of rectified gray pairs from sparse feature
+ * matches: corners of the left view are matched to corners of the same rows
+ * of the right view, and the spread of their horizontal offsets is the
+ * range.
+ *
+ * With a history of more than one pair, as for video, the range covers the
+ * matches of the last `history` pairs given to update(), so a frame with
+ * few corners does not shrink it. */
+class DisparityRangeEstimator
+{
+public:
+	explicit DisparityRangeEstimator(int history = 1)
+		: history(max(1, history)), detector(ORB::create(RANGE_FEATURES, 1.2f, 1)), matcher(NORM_HAMMING)
+	{
+	}
+
+	DisparityRange update(const Mat &left, const Mat &right)
+	{
+		ScopedTimer timer("range");
+
+		recent.push_back(vector<float>());
+		match(left, right, recent.back());
+
+		while ((int)recent.size() > history)
+		{
+			recent.pop_front();
+		}
+
+		vector<float> disparities;
+		for (size_t i = 0; i < recent.size(); i++)
+		{
+			disparities.insert(disparities.end(), recent[i].begin(), recent[i].end());
+		}
+
+		return disparity_range_of(disparities);
+	}
+
+	void reset()
+	{
+		recent.clear();
+	}
+
+private:
+	void match(const Mat &left, const Mat &right, vector<float> &disparities)
+	{
+		vector<KeyPoint> keys_left, keys_right;
+		Mat descriptors_left, descriptors_right;
+		detector->detectAndCompute(left, noArray(), keys_left, descriptors_left);
+		detector->detectAndCompute(right, noArray(), keys_right, descriptors_right);
+
+		if (keys_left.empty() || keys_right.size() < 2)
+		{
+			return;
+		}
+
+		// Only corners of the same rows are candidates
+		Mat candidates(keys_left.size(), keys_right.size(), CV_8U);
+
+		for (size_t i = 0; i < keys_left.size(); i++)
+		{
+			uchar *row = candidates.ptr<uchar>((int)i);
+
+			for (size_t j = 0; j < keys_right.size(); j++)
+			{
+				row[j] = fabs(keys_left[i].pt.y - keys_right[j].pt.y) <= RANGE_ROW_TOLERANCE;
+			}
+		}
+
+		vector<vector<DMatch>> matches;
+		matcher.knnMatch(descriptors_left, descriptors_right, matches, 2, candidates, true);
+
+		for (size_t i = 0; i < matches.size(); i++)
+		{
+			if (matches[i].empty() || matches[i][0].distance > RANGE_MAX_DISTANCE ||
+				(matches[i].size() > 1 && matches[i][0].distance >= RANGE_MATCH_RATIO * matches[i][1].distance))
+			{
+				continue;
+			}
+
+			const DMatch &best = matches[i][0];
+			disparities.push_back(keys_left[best.queryIdx].pt.x - keys_right[best.trainIdx].pt.x);
+		}
+	}
+
+	int history;
+	Ptr<ORB> detector;
+	BFMatcher matcher;
+	deque<vector<float>> recent;
+};
+
+#endif
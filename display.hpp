@@ -0,0 +1,288 @@
+#ifndef STEREO_TUNER_DISPLAY_HPP
+#define STEREO_TUNER_DISPLAY_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+enum DisplayColormap
+{
+	DISPLAY_GRAY,
+	DISPLAY_JET,
+	DISPLAY_TURBO
+};
+
+/* Disparities mapped to the ends of the colormap */
+enum DisplayRange
+{
+	DISPLAY_RANGE_SEARCH,	 /* The search range of the matcher */
+	DISPLAY_RANGE_PERCENTILE /* 2nd to 98th percentile of the valid pixels */
+};
+
+static const double DISPLAY_PERCENTILE_LOW = 0.02;
+static const double DISPLAY_PERCENTILE_HIGH = 0.98;
+
+/* Turns disparity maps into RGB images for display, in a single pass that
+ * samples the map at the output size and reads each colour from a lookup
+ * table indexed by the raw disparity value. The table folds the
+ * normalization and the colormap together, and is only rebuilt when the
+ * range or the colormap changes. Once the first map of a given size has
+ * been rendered, rendering allocates nothing. */
+class DisparityDisplay
+{
+public:
+	DisparityDisplay() : colormap(DISPLAY_GRAY), range(DISPLAY_RANGE_SEARCH), lut_colormap(-1), lut_low(0), lut_high(0), lut_valid(0), lut_offset(0)
+	{
+	}
+
+	void setColormap(DisplayColormap value)
+	{
+		colormap = value;
+	}
+
+	DisplayColormap getColormap() const
+	{
+		return colormap;
+	}
+
+	void setRange(DisplayRange value)
+	{
+		range = value;
+	}
+
+	DisplayRange getRange() const
+	{
+		return range;
+	}
+
+	/* Renders `disparity` (CV_16S scaled by 16, or CV_8U in pixels) into the
+	 * 8-bit RGB image `rgb`, which may wrap memory it does not own (a
+	 * pixbuf). Invalid pixels are black. */
+	void render(const Mat &disparity, int min_disparity, int num_disparities, Mat &rgb)
+	{
+		CV_Assert(rgb.type() == CV_8UC3);
+
+		const Mat *source = &disparity;
+
+		if (disparity.depth() != CV_16S && disparity.depth() != CV_8U)
+		{
+			disparity.convertTo(converted, CV_16S);
+			source = &converted;
+		}
+
+		int scale = source->depth() == CV_16S ? StereoMatcher::DISP_SCALE : 1;
+		update_sampling(source->size(), rgb.size());
+
+		// Every value the matcher can produce, the invalid one included
+		int domain_low = (min_disparity - 1) * scale;
+		int domain_high = (min_disparity + num_disparities) * scale;
+		int valid = min_disparity * scale;
+		int low = valid, high = domain_high;
+
+		if (range == DISPLAY_RANGE_PERCENTILE)
+		{
+			if (source->depth() == CV_16S)
+			{
+				percentile_range<short>(*source, domain_low, domain_high, valid, low, high);
+			}
+			else
+			{
+				percentile_range<uchar>(*source, domain_low, domain_high, valid, low, high);
+			}
+		}
+
+		update_lut(domain_low, domain_high, valid, low, high);
+
+		if (source->depth() == CV_16S)
+		{
+			render_rows<short>(*source, rgb);
+		}
+		else
+		{
+			render_rows<uchar>(*source, rgb);
+		}
+	}
+
+private:
+	/* Source column of every output column, and source row of every output
+	 * row (nearest neighbour) */
+	void update_sampling(Size source, Size output)
+	{
+		if (source == sampled_source && output == sampled_output)
+		{
+			return;
+		}
+
+		x_map.resize(output.width);
+		y_map.resize(output.height);
+
+		for (int x = 0; x < output.width; x++)
+		{
+			x_map[x] = min(source.width - 1, (int)((x + 0.5) * source.width / output.width));
+		}
+
+		for (int y = 0; y < output.height; y++)
+		{
+			y_map[y] = min(source.height - 1, (int)((y + 0.5) * source.height / output.height));
+		}
+
+		sampled_source = source;
+		sampled_output = output;
+	}
+
+	/* Histogram of the valid displayed pixels, cut at the percentiles */
+	template <typename T>
+	void percentile_range(const Mat &disparity, int domain_low, int domain_high, int valid, int &low, int &high)
+	{
+		histogram.assign(domain_high - domain_low + 1, 0);
+		long count = 0;
+
+		for (size_t y = 0; y < y_map.size(); y++)
+		{
+			const T *row = disparity.ptr<T>(y_map[y]);
+
+			for (size_t x = 0; x < x_map.size(); x++)
+			{
+				int value = row[x_map[x]];
+
+				if (value >= valid && value <= domain_high)
+				{
+					histogram[value - domain_low]++;
+					count++;
+				}
+			}
+		}
+
+		if (count == 0)
+		{
+			return;
+		}
+
+		long low_rank = (long)(count * DISPLAY_PERCENTILE_LOW);
+		long high_rank = (long)(count * DISPLAY_PERCENTILE_HIGH);
+		long seen = 0;
+		bool low_found = false;
+
+		for (size_t i = 0; i < histogram.size(); i++)
+		{
+			seen += histogram[i];
+
+			if (!low_found && seen > low_rank)
+			{
+				low = domain_low + (int)i;
+				low_found = true;
+			}
+
+			if (seen > high_rank)
+			{
+				high = domain_low + (int)i;
+				break;
+			}
+		}
+	}
+
+	/* Colour of every raw value of the domain */
+	void update_lut(int domain_low, int domain_high, int valid, int low, int high)
+	{
+		if (lut_colormap == colormap && lut_offset == domain_low && (int)lut.size() == domain_high - domain_low + 1 &&
+			lut_valid == valid && lut_low == low && lut_high == high)
+		{
+			return;
+		}
+
+		Vec3b palette[256];
+		build_palette(colormap, palette);
+
+		lut.resize(domain_high - domain_low + 1);
+		double span = max(1, high - low);
+
+		for (int value = domain_low; value <= domain_high; value++)
+		{
+			if (value < valid)
+			{
+				lut[value - domain_low] = Vec3b(0, 0, 0);
+				continue;
+			}
+
+			int index = cvRound((value - low) * 255.0 / span);
+			lut[value - domain_low] = palette[min(255, max(0, index))];
+		}
+
+		lut_colormap = colormap;
+		lut_offset = domain_low;
+		lut_valid = valid;
+		lut_low = low;
+		lut_high = high;
+	}
+
+	static void build_palette(DisplayColormap colormap, Vec3b palette[256])
+	{
+		if (colormap == DISPLAY_GRAY)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				palette[i] = Vec3b(i, i, i);
+			}
+
+			return;
+		}
+
+		Mat ramp(1, 256, CV_8UC1), colors;
+
+		for (int i = 0; i < 256; i++)
+		{
+			ramp.at<uchar>(0, i) = (uchar)i;
+		}
+
+		applyColorMap(ramp, colors, colormap == DISPLAY_JET ? COLORMAP_JET : COLORMAP_TURBO);
+
+		for (int i = 0; i < 256; i++)
+		{
+			// applyColorMap gives BGR
+			Vec3b bgr = colors.at<Vec3b>(0, i);
+			palette[i] = Vec3b(bgr[2], bgr[1], bgr[0]);
+		}
+	}
+
+	template <typename T>
+	void render_rows(const Mat &disparity, Mat &rgb)
+	{
+		const Vec3b *table = &lut[0];
+		const int *columns = &x_map[0];
+		int last = (int)lut.size() - 1;
+		int offset = lut_offset;
+
+		parallel_for_(Range(0, rgb.rows), [&](const Range &rows)
+					  {
+						  for (int y = rows.start; y < rows.end; y++)
+						  {
+							  const T *source = disparity.ptr<T>(y_map[y]);
+							  Vec3b *out = rgb.ptr<Vec3b>(y);
+
+							  for (int x = 0; x < rgb.cols; x++)
+							  {
+								  int index = (int)source[columns[x]] - offset;
+								  out[x] = table[index < 0 ? 0 : (index > last ? last : index)];
+							  }
+						  } });
+	}
+
+	DisplayColormap colormap;
+	DisplayRange range;
+
+	vector<Vec3b> lut;
+	int lut_colormap, lut_low, lut_high, lut_valid, lut_offset;
+
+	vector<int> x_map, y_map;
+	Size sampled_source, sampled_output;
+
+	vector<int> histogram;
+	Mat converted;
+};
+
+#endif
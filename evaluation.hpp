@@ -0,0 +1,344 @@
+#ifndef STEREO_TUNER_EVALUATION_HPP
+#define STEREO_TUNER_EVALUATION_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "matcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Error thresholds (in pixels) of the bad-pixel rates */
+static const int EVALUATION_THRESHOLDS = 4;
+static const double EVALUATION_THRESHOLD_PX[EVALUATION_THRESHOLDS] = {0.5, 1.0, 2.0, 4.0};
+
+/* Accuracy of a disparity map against the ground truth. Rates are fractions
+ * of the pixels with known ground truth. An invalid (unmatched) pixel counts
+ * as bad at every threshold; the RMS error only covers valid pixels. */
+struct EvaluationResult
+{
+	double bad[EVALUATION_THRESHOLDS];
+	double rms;
+	double invalid_ratio;
+	double runtime_ms;
+	size_t known_pixels;
+
+	EvaluationResult() : rms(0), invalid_ratio(0), runtime_ms(0), known_pixels(0)
+	{
+		for (int i = 0; i < EVALUATION_THRESHOLDS; i++)
+		{
+			bad[i] = 0;
+		}
+	}
+};
+
+/* Loads a ground-truth disparity map as CV_32F pixels, with 0 where the
+ * disparity is unknown. PFM files (Middlebury 2014 and later) hold the
+ * disparity itself and infinity for unknown pixels; 8 and 16-bit images hold
+ * the disparity multiplied by `scale` and 0 for unknown pixels. If
+ * `target_size` differs from the file, the map is resized and its values are
+ * scaled along with the image width. */
+static bool load_ground_truth(const string &filename, double scale, Size target_size, Mat &ground_truth)
+{
+	Mat raw = imread(filename, IMREAD_UNCHANGED);
+
+	if (raw.empty() || raw.channels() != 1)
+	{
+		return false;
+	}
+
+	if (raw.depth() == CV_32F)
+	{
+		raw.copyTo(ground_truth);
+
+		for (int y = 0; y < ground_truth.rows; y++)
+		{
+			float *row = ground_truth.ptr<float>(y);
+
+			for (int x = 0; x < ground_truth.cols; x++)
+			{
+				if (!std::isfinite(row[x]))
+				{
+					row[x] = 0;
+				}
+			}
+		}
+	}
+	else
+	{
+		raw.convertTo(ground_truth, CV_32F, 1.0 / scale);
+	}
+
+	if (target_size.area() > 0 && ground_truth.size() != target_size)
+	{
+		double width_ratio = (double)target_size.width / ground_truth.cols;
+		resize(ground_truth, ground_truth, target_size, 0, 0, INTER_NEAREST);
+		ground_truth *= width_ratio;
+	}
+
+	return true;
+}
+
+/* Converts a disparity map produced by compute_disparity to CV_32F pixels.
+ * Fixed point maps (CV_16S) are divided by 16. */
+static void disparity_to_float(const Mat &disparity, Mat &disp)
+{
+	disparity.convertTo(disp, CV_32F, disparity.depth() == CV_16S ? 1.0 / 16 : 1.0);
+}
+
+/* Scores a disparity map produced by compute_disparity, within `region`
+ * (all of it when empty). Pixels below min_disparity are the ones the
+ * matcher left invalid; 8-bit maps (CUDA StereoBM) also mark them with 0. */
+static EvaluationResult evaluate_disparity(const Mat &disparity, int min_disparity, const Mat &ground_truth, Rect region = Rect())
+{
+	EvaluationResult result;
+	Mat disp;
+	disparity_to_float(disparity, disp);
+
+	CV_Assert(disp.size() == ground_truth.size());
+
+	Rect frame(0, 0, disp.cols, disp.rows);
+	region = region.area() > 0 ? region & frame : frame;
+	const float valid_from = disparity.depth() == CV_8U ? max(min_disparity, 1) : min_disparity;
+
+	size_t bad[EVALUATION_THRESHOLDS] = {0};
+	size_t known = 0, invalid = 0, valid = 0;
+	double squared_error = 0;
+
+	for (int y = region.y; y < region.y + region.height; y++)
+	{
+		const float *d = disp.ptr<float>(y);
+		const float *g = ground_truth.ptr<float>(y);
+
+		for (int x = region.x; x < region.x + region.width; x++)
+		{
+			if (!(g[x] > 0))
+			{
+				continue;
+			}
+
+			known++;
+
+			if (d[x] < valid_from)
+			{
+				invalid++;
+				continue;
+			}
+
+			double error = fabs(d[x] - g[x]);
+			squared_error += error * error;
+			valid++;
+
+			for (int i = 0; i < EVALUATION_THRESHOLDS; i++)
+			{
+				if (error > EVALUATION_THRESHOLD_PX[i])
+				{
+					bad[i]++;
+				}
+			}
+		}
+	}
+
+	result.known_pixels = known;
+
+	if (known > 0)
+	{
+		for (int i = 0; i < EVALUATION_THRESHOLDS; i++)
+		{
+			result.bad[i] = (double)(bad[i] + invalid) / known;
+		}
+		result.invalid_ratio = (double)invalid / known;
+	}
+
+	if (valid > 0)
+	{
+		result.rms = sqrt(squared_error / valid);
+	}
+
+	return result;
+}
+
+/* One line summary, used by the status bar and the headless mode */
+static string format_evaluation(const EvaluationResult &result)
+{
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "bad 0.5/1/2/4: %.1f/%.1f/%.1f/%.1f%%, RMS %.2f px, invalid %.1f%%, %.1f ms",
+			 result.bad[0] * 100, result.bad[1] * 100, result.bad[2] * 100, result.bad[3] * 100,
+			 result.rms, result.invalid_ratio * 100, result.runtime_ms);
+	return buffer;
+}
+
+/* A stereo pair with its ground truth */
+struct EvaluationScene
+{
+	string name;
+	Mat left, right, ground_truth;
+};
+
+/* Finds the scenes of a Middlebury-style directory: every subdirectory (or
+ * the directory itself) holding im0.png, im1.png and disp0GT.pfm or
+ * disp0.pfm. */
+static bool load_middlebury_scenes(const string &input, vector<EvaluationScene> &scenes)
+{
+	vector<String> left_files;
+	glob(input + "/im0.png", left_files, true);
+
+	for (size_t i = 0; i < left_files.size(); i++)
+	{
+		string dir = left_files[i].substr(0, left_files[i].find_last_of("/\\"));
+		string gt_filename = dir + "/disp0GT.pfm";
+
+		if (!utils::fs::exists(gt_filename))
+		{
+			gt_filename = dir + "/disp0.pfm";
+		}
+
+		EvaluationScene scene;
+		scene.name = dir.substr(dir.find_last_of("/\\") + 1);
+		scene.left = imread(left_files[i], IMREAD_GRAYSCALE);
+		scene.right = imread(dir + "/im1.png", IMREAD_GRAYSCALE);
+
+		if (scene.left.empty() || scene.right.empty() || !load_ground_truth(gt_filename, 1.0, scene.left.size(), scene.ground_truth))
+		{
+			fprintf(stderr, "WARNING: skipping incomplete scene %s\n", dir.c_str());
+			continue;
+		}
+
+		scenes.push_back(scene);
+	}
+
+	if (scenes.empty())
+	{
+		printf("No Middlebury scenes found in %s.\n", input.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+/* Headless mode: scores one or more parameter files on a Middlebury-style
+ * directory (-input) or on a single pair (-left, -right, -groundtruth and
+ * -gtscale), printing accuracy and wall-clock matching time per scene and the
+ * mean for each parameter file. */
+static int run_evaluation(int argc, char *argv[])
+{
+	vector<const char *> params_filenames;
+	const char *input = NULL;
+	const char *left_filename = NULL;
+	const char *right_filename = NULL;
+	const char *gt_filename = NULL;
+	double gt_scale = 1.0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-params") == 0 && i + 1 < argc)
+		{
+			params_filenames.push_back(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-input") == 0 && i + 1 < argc)
+		{
+			input = argv[++i];
+		}
+		else if (strcmp(argv[i], "-left") == 0 && i + 1 < argc)
+		{
+			left_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-right") == 0 && i + 1 < argc)
+		{
+			right_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-groundtruth") == 0 && i + 1 < argc)
+		{
+			gt_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-gtscale") == 0 && i + 1 < argc)
+		{
+			gt_scale = atof(argv[++i]);
+		}
+	}
+
+	vector<EvaluationScene> scenes;
+
+	if (input != NULL)
+	{
+		if (!load_middlebury_scenes(input, scenes))
+		{
+			return 1;
+		}
+	}
+	else if (left_filename != NULL && right_filename != NULL && gt_filename != NULL)
+	{
+		EvaluationScene scene;
+		scene.name = left_filename;
+		scene.left = imread(left_filename, IMREAD_GRAYSCALE);
+		scene.right = imread(right_filename, IMREAD_GRAYSCALE);
+
+		if (scene.left.empty() || scene.right.empty() || !load_ground_truth(gt_filename, gt_scale, scene.left.size(), scene.ground_truth))
+		{
+			printf("Could not read %s, %s or %s.\n", left_filename, right_filename, gt_filename);
+			return 1;
+		}
+
+		scenes.push_back(scene);
+	}
+
+	if (params_filenames.empty() || scenes.empty())
+	{
+		printf("Usage: %s --evaluate -params params.yml [-params other.yml ...] (-input <middlebury dir> | -left l.png -right r.png -groundtruth gt.pgm [-gtscale s])\n", argv[0]);
+		return 1;
+	}
+
+	for (size_t p = 0; p < params_filenames.size(); p++)
+	{
+		MatcherParams params;
+		FileStorage fs(params_filenames[p], FileStorage::READ);
+
+		if (!fs.isOpened() || !read_params(fs, params))
+		{
+			printf("Could not read matcher parameters from %s.\n", params_filenames[p]);
+			return 1;
+		}
+
+		printf("%s\n", params_filenames[p]);
+
+		Ptr<StereoMatcher> matcher;
+		EvaluationResult mean;
+
+		for (size_t s = 0; s < scenes.size(); s++)
+		{
+			Mat disparity;
+			configure_matcher(matcher, params, NULL, NULL);
+
+			int64 start = getTickCount();
+			compute_disparity(matcher, scenes[s].left, scenes[s].right, disparity);
+			post_filter(params, scenes[s].left, disparity);
+			double runtime_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+			EvaluationResult result = evaluate_disparity(disparity, params.min_disparity, scenes[s].ground_truth);
+			result.runtime_ms = runtime_ms;
+			printf("  %-24s %s\n", scenes[s].name.c_str(), format_evaluation(result).c_str());
+
+			for (int i = 0; i < EVALUATION_THRESHOLDS; i++)
+			{
+				mean.bad[i] += result.bad[i] / scenes.size();
+			}
+			mean.rms += result.rms / scenes.size();
+			mean.invalid_ratio += result.invalid_ratio / scenes.size();
+			mean.runtime_ms += result.runtime_ms / scenes.size();
+		}
+
+		printf("  %-24s %s\n", "mean", format_evaluation(mean).c_str());
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef STEREO_TUNER_FIXED_BM_HPP
+#define STEREO_TUNER_FIXED_BM_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <vector>
+
+/* This header is copied next to the headers exported with "Export C++" and
+ * built into other programs: it only needs OpenCV, and does not bring std or
+ * cv into the global namespace like the rest of the tuner does. */
+
+/* Fewest rows of disparities matched by one task of parallel_for_: a band
+ * sums the costs of a whole window before its first row */
+static const int FIXED_BM_MIN_BAND_ROWS = 64;
+
+/* Block matching as StereoBM does it on the CPU, with the window size and the
+ * number of disparities fixed at compile time: the costs of a pixel are a
+ * fixed-size array, so the loops over disparities and over the rows and
+ * columns of the window unroll and vectorize (build with -O3, and -march for
+ * the widest vectors of the target), and the costs stay 16-bit whenever the
+ * window allows it.
+ *
+ * Same input (gray 8-bit pairs), output (CV_16S scaled by 16, invalid pixels
+ * at (min_disparity - 1) * 16) and parameters as StereoBM: prefilter, SAD
+ * costs, texture and uniqueness checks, subpixel refinement and speckle
+ * filter. The left-right check (disp12MaxDiff) is not done. */
+template <int BlockSize, int NumDisparities>
+class FixedBlockMatcher
+{
+	static_assert(BlockSize >= 5 && BlockSize % 2 == 1, "The block size must be odd and at least 5");
+	static_assert(NumDisparities > 0 && NumDisparities % 16 == 0, "The number of disparities must be a positive multiple of 16");
+
+	/* Prefiltered pixels are within [0, 2 * 63] */
+	typedef typename std::conditional<BlockSize * BlockSize * 126 <= 0xffff, uint16_t, uint32_t>::type cost_t;
+
+public:
+	static const int radius = BlockSize / 2;
+
+	int min_disparity;
+	int pre_filter_type; /* StereoBM::PREFILTER_NORMALIZED_RESPONSE or PREFILTER_XSOBEL */
+	int pre_filter_size;
+	int pre_filter_cap; /* 1 to 63 */
+	int texture_threshold;
+	int uniqueness_ratio;
+	int speckle_window_size;
+	int speckle_range; /* In the map's 1/16 px, as StereoBM hands it to filterSpeckles */
+
+	/* StereoBM's defaults */
+	FixedBlockMatcher()
+		: min_disparity(0), pre_filter_type(cv::StereoBM::PREFILTER_XSOBEL), pre_filter_size(9), pre_filter_cap(31),
+		  texture_threshold(10), uniqueness_ratio(15), speckle_window_size(0), speckle_range(0)
+	{
+	}
+
+	void compute(const cv::Mat &left, const cv::Mat &right, cv::Mat &disparity) const
+	{
+		CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+		CV_Assert(pre_filter_cap >= 1 && pre_filter_cap <= 63);
+
+		cv::Mat filtered_left, filtered_right;
+		prefilter(left, filtered_left);
+		prefilter(right, filtered_right);
+
+		const short invalid = (short)((min_disparity - 1) * cv::StereoMatcher::DISP_SCALE);
+		disparity.create(left.size(), CV_16S);
+		disparity.setTo(invalid);
+
+		int rows = left.rows - 2 * radius;
+
+		if (rows <= 0)
+		{
+			return;
+		}
+
+		// One band per thread
+		int bands = std::max(1, std::min(cv::getNumThreads(), rows / FIXED_BM_MIN_BAND_ROWS));
+		cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range &range)
+						  {
+							  for (int b = range.start; b < range.end; b++)
+							  {
+								  match_rows(filtered_left, filtered_right, radius + rows * b / bands, radius + rows * (b + 1) / bands, disparity);
+							  }
+						  });
+
+		if (speckle_range >= 0 && speckle_window_size > 0)
+		{
+			cv::filterSpeckles(disparity, invalid, speckle_window_size, speckle_range);
+		}
+	}
+
+private:
+	/* StereoBM's prefilters, with the response clipped to [-cap, cap] and
+	 * shifted to [0, 2 * cap] */
+	void prefilter(const cv::Mat &src, cv::Mat &dst) const
+	{
+		const int cap = pre_filter_cap;
+		dst.create(src.size(), CV_8U);
+
+		if (pre_filter_type == cv::StereoBM::PREFILTER_NORMALIZED_RESPONSE)
+		{
+			// Centre-weighted pixel minus the window mean, in 10-bit fixed point
+			const int size = std::max(5, pre_filter_size | 1);
+			const int scale_s = (1024 + size * size / 8) / (size * size / 8 * 2);
+			const int scale_g = size * size / 8 * scale_s;
+			cv::Mat sum;
+			cv::boxFilter(src, sum, CV_32S, cv::Size(size, size), cv::Point(-1, -1), false, cv::BORDER_REPLICATE);
+
+			cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range)
+							  {
+								  for (int y = range.start; y < range.end; y++)
+								  {
+									  const uchar *prev = src.ptr<uchar>(std::max(y - 1, 0));
+									  const uchar *curr = src.ptr<uchar>(y);
+									  const uchar *next = src.ptr<uchar>(std::min(y + 1, src.rows - 1));
+									  const int *box = sum.ptr<int>(y);
+									  uchar *out = dst.ptr<uchar>(y);
+
+									  for (int x = 0; x < src.cols; x++)
+									  {
+										  int l = curr[std::max(x - 1, 0)], r = curr[std::min(x + 1, src.cols - 1)];
+										  int v = ((curr[x] * 4 + l + r + prev[x] + next[x]) * scale_g - box[x] * scale_s) >> 10;
+										  out[x] = (uchar)(std::min(std::max(v, -cap), cap) + cap);
+									  }
+								  }
+							  });
+			return;
+		}
+
+		cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range)
+						  {
+							  for (int y = range.start; y < range.end; y++)
+							  {
+								  const uchar *prev = src.ptr<uchar>(std::max(y - 1, 0));
+								  const uchar *curr = src.ptr<uchar>(y);
+								  const uchar *next = src.ptr<uchar>(std::min(y + 1, src.rows - 1));
+								  uchar *out = dst.ptr<uchar>(y);
+								  out[0] = out[src.cols - 1] = (uchar)cap;
+
+								  for (int x = 1; x < src.cols - 1; x++)
+								  {
+									  int v = (curr[x + 1] - curr[x - 1]) * 2 + prev[x + 1] - prev[x - 1] + next[x + 1] - next[x - 1];
+									  out[x] = (uchar)(std::min(std::max(v, -cap), cap) + cap);
+								  }
+							  }
+						  });
+	}
+
+	/* Adds the costs of one row of the prefiltered images to the column sums.
+	 * Cost k of column x compares left pixel x with right pixel
+	 * x - min_disparity - (NumDisparities - 1) + k, so index k is disparity
+	 * min_disparity + NumDisparities - 1 - k, as in StereoBM. */
+	void add_row(const uchar *left, const uchar *right, int x_begin, int x_end, int cap, cost_t *columns, int *texture) const
+	{
+		for (int x = x_begin; x < x_end; x++)
+		{
+			const int l = left[x];
+			const uchar *r = right + x - min_disparity - (NumDisparities - 1);
+			cost_t *c = columns + (size_t)x * NumDisparities;
+
+			for (int k = 0; k < NumDisparities; k++)
+			{
+				c[k] = (cost_t)(c[k] + std::abs(l - (int)r[k]));
+			}
+
+			texture[x] += std::abs(l - cap);
+		}
+	}
+
+	/* Moves the column sums down a row in one pass: adds the costs of the
+	 * row entering the window and removes those of the row leaving it */
+	void slide_rows(const uchar *left_in, const uchar *right_in, const uchar *left_out, const uchar *right_out, int x_begin, int x_end, int cap,
+					cost_t *columns, int *texture) const
+	{
+		const int offset = min_disparity + NumDisparities - 1;
+
+		for (int x = x_begin; x < x_end; x++)
+		{
+			const int l_in = left_in[x], l_out = left_out[x];
+			const uchar *r_in = right_in + x - offset;
+			const uchar *r_out = right_out + x - offset;
+			cost_t *c = columns + (size_t)x * NumDisparities;
+
+			for (int k = 0; k < NumDisparities; k++)
+			{
+				c[k] = (cost_t)(c[k] + std::abs(l_in - (int)r_in[k]) - std::abs(l_out - (int)r_out[k]));
+			}
+
+			texture[x] += std::abs(l_in - cap) - std::abs(l_out - cap);
+		}
+	}
+
+	/* Matches output rows [first, last), all with full windows */
+	void match_rows(const cv::Mat &left, const cv::Mat &right, int first, int last, cv::Mat &disparity) const
+	{
+		const int width = left.cols;
+		const int cap = pre_filter_cap;
+
+		// Columns with their whole range of right pixels in the image
+		const int x_begin = std::max(0, min_disparity + NumDisparities - 1);
+		const int x_end = std::min(width, width + min_disparity);
+
+		if (x_end - x_begin < BlockSize)
+		{
+			return;
+		}
+
+		std::vector<cost_t> columns((size_t)width * NumDisparities, 0);
+		std::vector<int> texture(width, 0);
+
+		for (int y = first - radius; y <= first + radius; y++)
+		{
+			add_row(left.ptr<uchar>(y), right.ptr<uchar>(y), x_begin, x_end, cap, &columns[0], &texture[0]);
+		}
+
+		for (int y = first; y < last; y++)
+		{
+			if (y > first)
+			{
+				slide_rows(left.ptr<uchar>(y + radius), right.ptr<uchar>(y + radius), left.ptr<uchar>(y - radius - 1), right.ptr<uchar>(y - radius - 1),
+						   x_begin, x_end, cap, &columns[0], &texture[0]);
+			}
+
+			match_row(&columns[0], &texture[0], x_begin, x_end, disparity.ptr<short>(y));
+		}
+	}
+
+	/* Slides the window along a row of column sums and picks the winners */
+	void match_row(const cost_t *columns, const int *texture, int x_begin, int x_end, short *out) const
+	{
+		cost_t sad[NumDisparities];
+		int texture_sum = 0;
+
+		for (int k = 0; k < NumDisparities; k++)
+		{
+			sad[k] = 0;
+		}
+
+		for (int x = x_begin; x < x_begin + BlockSize; x++)
+		{
+			const cost_t *c = columns + (size_t)x * NumDisparities;
+
+			for (int k = 0; k < NumDisparities; k++)
+			{
+				sad[k] = (cost_t)(sad[k] + c[k]);
+			}
+
+			texture_sum += texture[x];
+		}
+
+		int best_sad = sad[0];
+
+		for (int k = 1; k < NumDisparities; k++)
+		{
+			best_sad = std::min(best_sad, (int)sad[k]);
+		}
+
+		for (int x = x_begin + radius;; x++)
+		{
+			out[x] = winner(sad, best_sad, texture_sum);
+
+			if (x + radius + 1 >= x_end)
+			{
+				break;
+			}
+
+			const cost_t *entering = columns + (size_t)(x + radius + 1) * NumDisparities;
+			const cost_t *leaving = columns + (size_t)(x - radius) * NumDisparities;
+
+			// The lowest cost is found on the way
+			best_sad = INT_MAX;
+
+			for (int k = 0; k < NumDisparities; k++)
+			{
+				sad[k] = (cost_t)(sad[k] + entering[k] - leaving[k]);
+				best_sad = std::min(best_sad, (int)sad[k]);
+			}
+
+			texture_sum += texture[x + radius + 1] - texture[x - radius];
+		}
+	}
+
+	short winner(const cost_t *sad, int best_sad, int texture_sum) const
+	{
+		const short invalid = (short)((min_disparity - 1) * cv::StereoMatcher::DISP_SCALE);
+
+		if (texture_sum < texture_threshold)
+		{
+			return invalid;
+		}
+
+		// A reduction rather than an argmin loop, so it vectorizes too
+		int best = NumDisparities;
+
+		for (int k = 0; k < NumDisparities; k++)
+		{
+			best = std::min(best, (int)sad[k] == best_sad ? k : NumDisparities);
+		}
+
+		if (uniqueness_ratio > 0)
+		{
+			// No other disparity than the winner and its neighbours may come close
+			const int threshold = best_sad + best_sad * uniqueness_ratio / 100;
+			int close = 0;
+
+			for (int k = 0; k < NumDisparities; k++)
+			{
+				close += (int)sad[k] <= threshold;
+			}
+
+			for (int k = std::max(best - 1, 0); k <= std::min(best + 1, NumDisparities - 1); k++)
+			{
+				close -= (int)sad[k] <= threshold;
+			}
+
+			if (close > 0)
+			{
+				return invalid;
+			}
+		}
+
+		// Vertex of the parabola through the neighbours, mirrored at the ends
+		int p = sad[best + 1 < NumDisparities ? best + 1 : best - 1];
+		int n = sad[best > 0 ? best - 1 : best + 1];
+		int d = p + n - 2 * best_sad + std::abs(p - n);
+		int disparity = min_disparity + NumDisparities - 1 - best;
+		return (short)((disparity * 256 + (d != 0 ? (p - n) * 256 / d : 0) + 15) >> 4);
+	}
+};
+
+#endif
@@ -4,365 +4,815 @@
 #include <opencv2/features2d.hpp>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/imgproc.hpp>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
 #include <iostream>
 
-#ifdef WITH_CUDA
-#include <opencv2/cudastereo.hpp>
-#endif
+#include "compare.hpp"
+#include "cpp_export.hpp"
+#include "depth_probe.hpp"
+#include "disparity_cache.hpp"
+#include "disparity_range.hpp"
+#include "display.hpp"
+#include "evaluation.hpp"
+#include "loader.hpp"
+#include "matcher.hpp"
+#include "pointcloud.hpp"
+#include "profiler.hpp"
+#include "pyramid.hpp"
+#include "stream.hpp"
+#include "sweep.hpp"
+#include "worker.hpp"
 
 using namespace std;
 using namespace cv;
 
-static void compute_depth_estimate_pix(int focal_px, int baseline, int disparity, double &depth)
-{
-	if (disparity >= 0)
-	{
-		depth = (double)focal_px * (double)baseline / (double)disparity;
-	}
-}
-
-static void compute_depth_estimate(int focal_length, int image_width, int sensor_width, int baseline, int disparity, double &depth)
-{
-	// fprintf(stderr, "compute_depth_estimate\n");
-	// fprintf(stderr, "focal_length: %f", focal_length);
-	// fprintf(stderr, "image_width: %f", image_width);
-	// fprintf(stderr, "sensor_width: %f", sensor_width);
-	double focal_px = (double)focal_length * (double)image_width / (double)sensor_width;
-	if (disparity >= 0)
-	{
-		depth = (double)focal_px * (double)baseline / (double)disparity;
-	}
-}
-
-static void get_pixel(GdkPixbuf *pixbuf, int x, int y, guchar &red, guchar &green, guchar &blue, guchar &alpha)
-{
-	int width, height, rowstride, n_channels;
-	guchar *pixels, *p;
-
-	rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-	pixels = gdk_pixbuf_get_pixels(pixbuf);
-	n_channels = gdk_pixbuf_get_n_channels(pixbuf);
-
-	p = pixels + y * rowstride + x * n_channels;
-	red = p[0];
-	green = p[1];
-	blue = p[2];
-	alpha = p[3];
-}
+/* Largest size the images are shown at; larger pairs are matched at native
+ * resolution and scaled down for display only */
+static const int DISPLAY_MAX_WIDTH = 640;
+static const int DISPLAY_MAX_HEIGHT = 480;
 
-static void put_pixel(GdkPixbuf *pixbuf, int x, int y, guchar red, guchar green, guchar blue, guchar alpha)
-{
-	int width, height, rowstride, n_channels;
-	guchar *pixels, *p;
-
-	rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-	pixels = gdk_pixbuf_get_pixels(pixbuf);
-	n_channels = gdk_pixbuf_get_n_channels(pixbuf);
-
-	p = pixels + y * rowstride + x * n_channels;
-	p[0] = red;
-	p[1] = green;
-	p[2] = blue;
-	p[3] = alpha;
-}
+/* Quiet time after the last parameter change before the full resolution
+ * disparity replaces the preview */
+static const guint FULL_RESOLUTION_DELAY_MS = 250;
 
-static string convertToString(const char *a, int size)
+static Size fit_display_size(Size size)
 {
-	int i;
-	string s = "";
-	for (i = 0; i < size; i++)
-	{
-		s = s + a[i];
-	}
-	return s;
+	double scale = min(1.0, min((double)DISPLAY_MAX_WIDTH / size.width, (double)DISPLAY_MAX_HEIGHT / size.height));
+	return Size(max(1, cvRound(size.width * scale)), max(1, cvRound(size.height * scale)));
 }
 
-/* Matcher type */
-typedef enum
-{
-	BM,
-	SGBM
-} MatcherType;
-
 /* Main data structure definition */
-struct ChData
+struct ChData : MatcherParams
 {
 	/* Widgets */
 	GtkWidget *main_window; /* Main application window */
 	GtkImage *image_left;
 	GtkImage *image_right;
 	GtkImage *image_depth;
-	GtkWidget *rb_bm, *rb_sgbm;
+	GtkWidget *rb_bm, *rb_sgbm, *rb_census;
 	GtkWidget *pix_rabiobutton, *mm_rabiobutton;
 	GtkWidget *sc_block_size, *sc_min_disparity, *sc_num_disparities,
 		*sc_disp_max_diff, *sc_speckle_range, *sc_speckle_window_size,
 		*sc_p1, *sc_p2, *sc_pre_filter_cap, *sc_pre_filter_size,
 		*sc_uniqueness_ratio, *sc_texture_threshold,
-		*rb_pre_filter_normalized, *rb_pre_filter_xsobel, *chk_full_dp;
+		*rb_pre_filter_normalized, *rb_pre_filter_xsobel, *chk_full_dp,
+		*chk_cost_volume, *cb_post_filter, *sc_post_filter_radius, *sc_post_filter_sigma;
 	GtkAdjustment *adj_block_size, *adj_min_disparity, *adj_num_disparities,
 		*adj_disp_max_diff, *adj_speckle_range, *adj_speckle_window_size,
 		*adj_p1, *adj_p2, *adj_pre_filter_cap, *adj_pre_filter_size,
-		*adj_uniqueness_ratio, *adj_texture_threshold;
+		*adj_uniqueness_ratio, *adj_texture_threshold, *adj_post_filter_radius,
+		*adj_post_filter_sigma;
 	GtkWidget *status_bar;
 	GtkWidget *pixel_bar;
 	GtkWidget *img_width_bar;
+	GtkWidget *profile_bar;
 	GtkWidget *image_disparity_container;
+	GtkWidget *cb_colormap, *cb_display_range;
+	GtkWidget *chk_compare, *btn_pin_a, *btn_swap_ab;
+	GtkWidget *chk_auto_range, *chk_temporal;
+	GtkWidget *sweep_window, *cb_sweep_parameter, *sweep_tiles;
+	GtkAdjustment *adj_sweep_from, *adj_sweep_to, *adj_sweep_steps;
 	GtkEntry *baseline_value;
 	GtkEntry *sensor_width_value;
 	GtkEntry *focallength_value;
 	gint status_bar_context;
 	gint pixel_bar_context;
 	gint img_width_bar_context;
-	int baseline = 0;
+	gint profile_bar_context;
+	double baseline = 0;
 	int coord_x = 0;
 	int coord_y = 0;
-	int intensity_value = 0;
-	int sensor_width = 0;
+	double sensor_width = 0;
 	int image_width = 0;
-	int focal_length = 0;
+	double focal_length = 0;
 	bool use_fl_pix = true;
+	DepthLut depth_lut;
 
 	/* OpenCV */
-	Ptr<StereoMatcher> stereo_matcher;
-	Mat cv_image_left, cv_image_right, cv_image_disparity,
-		cv_image_disparity_normalized, cv_color_image;
-	MatcherType matcher_type;
-	int block_size;
-	int disp_12_max_diff;
-	int min_disparity;
-	int num_disparities;
-	int speckle_range;
-	int speckle_window_size;
-	int pre_filter_cap;
-	int pre_filter_size;
-	int pre_filter_type;
-	int texture_threshold;
-	int uniqueness_ratio;
-	int p1;
-	int p2;
-	int mode;
+	Mat cv_image_left, cv_image_right, cv_image_disparity;
+	Mat cv_image_left_color; /* Rectified left image, colours the point clouds */
+	Mat cv_image_right_color;
+	Mat cv_image_ground_truth; /* CV_32F, empty when not available */
 
 	Rect *roi1, *roi2;
 
+	/* Reprojection matrix of the calibration, empty without one */
+	Mat q;
+	PointCloudExporter cloud_exporter;
+
+	/* Pyramids of cv_image_left/right, level 0 first, down to the preview
+	 * level (0 when the pair is small enough to skip previews) */
+	vector<Mat> pyramid_left, pyramid_right;
+	int preview_level;
+	guint full_resolution_timer;
+
+	/* Size the images are shown at */
+	Size display_size;
+
+	/* Each image owns one pixbuf, rendered in place on every update */
+	DisparityDisplay display;
+	GdkPixbuf *disparity_pixbuf, *left_pixbuf, *right_pixbuf;
+	Mat display_scratch;
+	int displayed_min_disparity, displayed_num_disparities;
+
+	/* Part of the disparity map being tuned, empty for the whole image. Set
+	 * by dragging on the disparity image. */
+	Rect selection;
+	Point selection_start;
+
+	/* Background disparity computation: the worker for a still pair, the
+	 * pipeline when playing a video (the other one is NULL) */
+	ComputeWorker *worker;
+	StreamPipeline *stream;
+
+	/* Frames the pipeline matched per second, measured over windows of about
+	 * a second starting at `rate_ticks` */
+	int64 rate_ticks;
+	unsigned long rate_frames;
+	double matched_fps;
+
+	/* Ring the full resolution disparity maps are published on, NULL
+	 * without -shm-out */
+	ShmRingWriter *egress;
+
+	/* Disparity maps of the still pair already computed, shared by the
+	 * workers. `input_hash` is the hash_pair() of the pair, 0 when playing a
+	 * video. */
+	DisparityCache cache;
+	uint64_t input_hash;
+
+	/* A/B comparison of still pairs: the sliders set B, A is a pinned copy.
+	 * A has its own worker, so both sets are matched at the same time and
+	 * each keeps its matchers warm. The results of the latest jobs of each
+	 * side are paired by id. */
+	bool compare;
+	MatcherParams compare_params;
+	ComputeWorker *compare_worker;
+	DisparityDisplay compare_display;
+	unsigned long compare_ids[2];
+	DisparityResult compare_results[2];
+	Mat compare_diff;
+
+	/* Parameter sweep: the values being matched and the range of disparities
+	 * their thumbnails are drawn over, shared so the colours compare */
+	SweepRunner *sweep;
+	SweepParameter sweep_parameter;
+	vector<int> sweep_values;
+	int sweep_min_disparity, sweep_num_disparities;
+	DisparityDisplay sweep_display;
+
+	/* Startup: the pair is loaded in the background while the window shows
+	 * placeholders. The times to the first drawing of the window and to the
+	 * first disparity map are measured from `startup_ticks`. */
+	PairLoader *loader;
+	int64 startup_ticks;
+	bool first_disparity_shown;
+
+	/* Search range set from feature matches: once for a still pair, every
+	 * few frames by the pipeline for a stream */
+	bool auto_range;
+	DisparityRangeEstimator range_estimator;
+
 	bool live_update;
 
-	/* Defalt values */
-	static const int DEFAULT_BLOCK_SIZE = 5;
-	static const int DEFAULT_DISP_12_MAX_DIFF = -1;
-	static const int DEFAULT_MIN_DISPARITY = 0;
-	static const int DEFAULT_NUM_DISPARITIES = 64;
-	static const int DEFAULT_SPECKLE_RANGE = 0;
-	static const int DEFAULT_SPECKLE_WINDOW_SIZE = 0;
-	static const int DEFAULT_PRE_FILTER_CAP = 1;
-	static const int DEFAULT_PRE_FILTER_SIZE = 5;
-	static const int DEFAULT_PRE_FILTER_TYPE =
-		StereoBM::PREFILTER_NORMALIZED_RESPONSE;
-	static const int DEFAULT_TEXTURE_THRESHOLD = 0;
-	static const int DEFAULT_UNIQUENESS_RATIO = 0;
-	static const int DEFAULT_P1 = 0;
-	static const int DEFAULT_P2 = 0;
-	static const int DEFAULT_MODE = StereoSGBM::MODE_SGBM;
-
-	ChData() : matcher_type(BM), block_size(DEFAULT_BLOCK_SIZE), disp_12_max_diff(DEFAULT_DISP_12_MAX_DIFF), min_disparity(DEFAULT_MIN_DISPARITY),
-			   num_disparities(DEFAULT_NUM_DISPARITIES), speckle_range(DEFAULT_SPECKLE_RANGE),
-			   speckle_window_size(DEFAULT_SPECKLE_WINDOW_SIZE), pre_filter_cap(DEFAULT_PRE_FILTER_CAP),
-			   pre_filter_size(DEFAULT_PRE_FILTER_SIZE), pre_filter_type(DEFAULT_PRE_FILTER_TYPE),
-			   texture_threshold(DEFAULT_TEXTURE_THRESHOLD),
-			   uniqueness_ratio(DEFAULT_UNIQUENESS_RATIO), p1(DEFAULT_P1), p2(DEFAULT_P2),
-			   mode(DEFAULT_MODE), roi1(NULL), roi2(NULL), live_update(true)
+	ChData() : roi1(NULL), roi2(NULL), preview_level(0), full_resolution_timer(0), disparity_pixbuf(NULL), left_pixbuf(NULL),
+			   right_pixbuf(NULL), displayed_min_disparity(0), displayed_num_disparities(0), worker(NULL), stream(NULL),
+			   rate_ticks(0), rate_frames(0), matched_fps(0), egress(NULL), input_hash(0), compare(false), compare_worker(NULL), sweep(NULL), sweep_parameter(SWEEP_BLOCK_SIZE), sweep_min_disparity(0),
+			   sweep_num_disparities(0), loader(NULL), startup_ticks(getTickCount()), first_disparity_shown(false), auto_range(false), live_update(true)
+	{
+		compare_ids[0] = compare_ids[1] = 0;
+	}
+
+	/* Image coordinates of a point of the displayed images */
+	Point display_to_image(double x, double y) const
 	{
+		if (display_size.area() == 0)
+		{
+			return Point(cvRound(x), cvRound(y));
+		}
+
+		return Point(cvRound(x * cv_image_left.cols / display_size.width),
+					 cvRound(y * cv_image_left.rows / display_size.height));
 	}
 };
 
+/* Enables the widgets that make sense for the selected matcher */
+void update_sensitivity(ChData *data)
+{
+	switch (data->matcher_type)
+	{
+	case BM:
+		gtk_widget_set_sensitive(data->sc_block_size, true);
+		gtk_widget_set_sensitive(data->sc_min_disparity, true);
+		gtk_widget_set_sensitive(data->sc_num_disparities, true);
+		gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
+		gtk_widget_set_sensitive(data->sc_speckle_range, true);
+		gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
+		gtk_widget_set_sensitive(data->sc_p1, false);
+		gtk_widget_set_sensitive(data->sc_p2, false);
+		gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
+		gtk_widget_set_sensitive(data->sc_pre_filter_size, true);
+		gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
+		gtk_widget_set_sensitive(data->sc_texture_threshold, true);
+		gtk_widget_set_sensitive(data->rb_pre_filter_normalized, true);
+		gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, true);
+		gtk_widget_set_sensitive(data->chk_full_dp, false);
+		gtk_widget_set_sensitive(data->chk_cost_volume, true);
+		break;
+
+	case SGBM:
+		gtk_widget_set_sensitive(data->sc_block_size, true);
+		gtk_widget_set_sensitive(data->sc_min_disparity, true);
+		gtk_widget_set_sensitive(data->sc_num_disparities, true);
+		gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
+		gtk_widget_set_sensitive(data->sc_speckle_range, true);
+		gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
+		gtk_widget_set_sensitive(data->sc_p1, true);
+		gtk_widget_set_sensitive(data->sc_p2, true);
+		gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
+		gtk_widget_set_sensitive(data->sc_pre_filter_size, false);
+		gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
+		gtk_widget_set_sensitive(data->sc_texture_threshold, false);
+		gtk_widget_set_sensitive(data->rb_pre_filter_normalized, false);
+		gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, false);
+		gtk_widget_set_sensitive(data->chk_full_dp, true);
+		gtk_widget_set_sensitive(data->chk_cost_volume, false);
+		break;
+
+	case CENSUS:
+		gtk_widget_set_sensitive(data->sc_block_size, true);
+		gtk_widget_set_sensitive(data->sc_min_disparity, true);
+		gtk_widget_set_sensitive(data->sc_num_disparities, true);
+		gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
+		gtk_widget_set_sensitive(data->sc_speckle_range, true);
+		gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
+		gtk_widget_set_sensitive(data->sc_p1, false);
+		gtk_widget_set_sensitive(data->sc_p2, false);
+		gtk_widget_set_sensitive(data->sc_pre_filter_cap, false);
+		gtk_widget_set_sensitive(data->sc_pre_filter_size, false);
+		gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
+		gtk_widget_set_sensitive(data->sc_texture_threshold, false);
+		gtk_widget_set_sensitive(data->rb_pre_filter_normalized, false);
+		gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, false);
+		gtk_widget_set_sensitive(data->chk_full_dp, false);
+		// The census matcher always reuses its cost volume
+		gtk_widget_set_sensitive(data->chk_cost_volume, false);
+		break;
+	}
+
+	// The estimated range holds the range sliders
+	if (data->auto_range)
+	{
+		gtk_widget_set_sensitive(data->sc_min_disparity, false);
+		gtk_widget_set_sensitive(data->sc_num_disparities, false);
+	}
+
+	// The post filter runs after any matcher
+	gtk_widget_set_sensitive(data->sc_post_filter_radius, data->post_filter != POST_FILTER_NONE);
+	gtk_widget_set_sensitive(data->sc_post_filter_sigma, data->post_filter != POST_FILTER_NONE);
+}
+
+/* Hands the current parameters over to the compute thread, to be matched at
+ * the given pyramid level */
+static DisparityJob current_job(ChData *data)
+{
+	DisparityJob job;
+	job.params = *data;
+	job.full_size = data->cv_image_left.size();
+	job.region = data->selection;
+
+	if (data->roi1 != NULL && data->roi2 != NULL)
+	{
+		job.use_roi = true;
+		job.roi1 = *data->roi1;
+		job.roi2 = *data->roi2;
+	}
+
+	return job;
+}
+
+static void submit_disparity_job(ChData *data, int level)
+{
+	DisparityJob job = current_job(data);
+	job.level = max(0, min(level, (int)data->pyramid_left.size() - 1));
+	job.left = job.level > 0 ? data->pyramid_left[job.level] : data->cv_image_left;
+	job.right = job.level > 0 ? data->pyramid_right[job.level] : data->cv_image_right;
+	job.input_hash = data->input_hash;
+	data->compare_ids[1] = data->worker->submit(job);
+
+	if (data->compare)
+	{
+		job.params = data->compare_params;
+		data->compare_ids[0] = data->compare_worker->submit(job);
+	}
+}
+
+static gboolean on_full_resolution_timeout(gpointer user_data)
+{
+	ChData *data = (ChData *)user_data;
+	data->full_resolution_timer = 0;
+	submit_disparity_job(data, 0);
+	return G_SOURCE_REMOVE;
+}
+
+/* Requests the disparity map for the current parameters. The result is
+ * displayed by on_disparity_ready once it is available.
+ *
+ * Large pairs are first matched at a pyramid level, so dragging a slider
+ * shows a coarse map right away; the full resolution map is computed once
+ * the parameters have not changed for FULL_RESOLUTION_DELAY_MS, unless it is
+ * cached already. When playing a video the parameters apply from the next
+ * frame on. */
 void update_matcher(ChData *data)
 {
+	if (!data->live_update)
+	{
+		return;
+	}
 
-	try
+	if (data->stream != NULL)
 	{
-		/* code */
+		data->stream->set_job(current_job(data));
+		return;
+	}
 
-		if (!data->live_update)
+	if (data->worker == NULL)
+	{
+		return;
+	}
+
+	if (data->full_resolution_timer != 0)
+	{
+		g_source_remove(data->full_resolution_timer);
+		data->full_resolution_timer = 0;
+	}
+
+	DisparityJob full = current_job(data);
+	full.input_hash = data->input_hash;
+
+	if (data->preview_level == 0 || data->cache.contains(disparity_job_key(full)))
+	{
+		submit_disparity_job(data, 0);
+		return;
+	}
+
+	submit_disparity_job(data, data->preview_level);
+	data->full_resolution_timer = g_timeout_add(FULL_RESOLUTION_DELAY_MS, on_full_resolution_timeout, data);
+}
+
+/* An RGB pixbuf of the given size, reused when it already has that size.
+ * Returns a Mat sharing its pixels. */
+static Mat pixbuf_mat(GdkPixbuf *&pixbuf, Size size)
+{
+	if (pixbuf == NULL || gdk_pixbuf_get_width(pixbuf) != size.width || gdk_pixbuf_get_height(pixbuf) != size.height)
+	{
+		if (pixbuf != NULL)
 		{
-			return;
+			g_object_unref(pixbuf);
 		}
 
-#ifdef WITH_CUDA
-		Ptr<cuda::StereoBM> stereo_bm;
-		Ptr<cuda::StereoSGM> stereo_sgbm;
-#else
-		Ptr<StereoBM> stereo_bm;
-		Ptr<StereoSGBM> stereo_sgbm;
-#endif
+		pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, false, 8, size.width, size.height);
+	}
+
+	return Mat(size, CV_8UC3, gdk_pixbuf_get_pixels(pixbuf), gdk_pixbuf_get_rowstride(pixbuf));
+}
+
+/* Shows a BGR image at the display size */
+static void show_image(ChData *data, GtkImage *image, GdkPixbuf *&pixbuf, const Mat &bgr)
+{
+	Size size = data->display_size.area() > 0 ? data->display_size : bgr.size();
+	Mat rgb = pixbuf_mat(pixbuf, size);
+	ScopedTimer timer("resize");
+
+	// Gray sources (shared memory) are shown as they are
+	resize(bgr, data->display_scratch, size, 0, 0, INTER_AREA);
+	cvtColor(data->display_scratch, rgb, bgr.channels() == 1 ? COLOR_GRAY2RGB : COLOR_BGR2RGB);
+
+	// Setting the same pixbuf again drops the image's cached rendering
+	gtk_image_set_from_pixbuf(image, pixbuf);
+}
+
+/* Renders cv_image_disparity into the disparity pixbuf, which is only
+ * allocated again when the display size changes */
+static void show_disparity(ChData *data)
+{
+	if (data->cv_image_disparity.empty())
+	{
+		return;
+	}
+
+	Size size = data->display_size.area() > 0 ? data->display_size : data->cv_image_disparity.size();
+	Mat rgb = pixbuf_mat(data->disparity_pixbuf, size);
+	ScopedTimer timer("render");
+	data->display.render(data->cv_image_disparity, data->displayed_min_disparity, data->displayed_num_disparities, rgb);
+	gtk_image_set_from_pixbuf(data->image_depth, data->disparity_pixbuf);
+}
+
+/* Focal length in pixels from the focal length entry, converted with the
+ * sensor and image widths when it is given in mm. 0 when unknown. */
+static double camera_focal_px(ChData *data)
+{
+	if (data->use_fl_pix)
+	{
+		return data->focal_length;
+	}
+
+	return data->sensor_width > 0 ? data->focal_length * data->image_width / data->sensor_width : 0;
+}
+
+/* Reads the camera entries, which may have a fractional part (with a dot,
+ * whatever the locale). The depth table is only rebuilt when the focal
+ * length or the baseline it is built from changed. */
+static void update_camera(ChData *data)
+{
+	data->baseline = g_ascii_strtod(gtk_entry_get_text(GTK_ENTRY(data->baseline_value)), NULL);
+	data->sensor_width = g_ascii_strtod(gtk_entry_get_text(GTK_ENTRY(data->sensor_width_value)), NULL);
+	data->focal_length = g_ascii_strtod(gtk_entry_get_text(GTK_ENTRY(data->focallength_value)), NULL);
+	data->depth_lut.update(camera_focal_px(data), data->baseline);
+}
+
+static void show_image_width(ChData *data)
+{
+	if (data->image_width == data->cv_image_disparity.cols)
+	{
+		return;
+	}
+
+	data->image_width = data->cv_image_disparity.cols;
+	gchar *img_pixel = g_strdup_printf("%d", data->image_width);
+	gtk_statusbar_pop(GTK_STATUSBAR(data->img_width_bar), data->img_width_bar_context);
+	gtk_statusbar_push(GTK_STATUSBAR(data->img_width_bar), data->img_width_bar_context, img_pixel);
+	g_free(img_pixel);
+	update_camera(data);
+}
+
+/* Shows the depth under a point of the disparity image. A table read on the
+ * disparity map on screen, cheap enough to follow the pointer. */
+static void probe_depth(ChData *data, double x, double y)
+{
+	Point p = data->display_to_image(x, y);
+	data->coord_x = p.x;
+	data->coord_y = p.y;
+
+	int raw;
+	gchar *coords_message;
+
+	if (disparity_at(data->cv_image_disparity, p, data->displayed_min_disparity, raw))
+	{
+		float depth = data->depth_lut.depth(raw);
+		coords_message = g_strdup_printf("%f @ (x: %d, y: %d), disparity: %.2f px, baseline: %g mm", depth, p.x, p.y,
+										 (double)raw / StereoMatcher::DISP_SCALE, data->baseline);
+	}
+	else
+	{
+		coords_message = g_strdup_printf("No disparity @ (x: %d, y: %d)", p.x, p.y);
+	}
+
+	const DisparityResult &a = data->compare_results[0];
+
+	if (data->compare && disparity_at(a.disparity, p, a.params.min_disparity, raw))
+	{
+		gchar *with_a = g_strdup_printf("%s, A: %.2f px", coords_message, (double)raw / StereoMatcher::DISP_SCALE);
+		g_free(coords_message);
+		coords_message = with_a;
+	}
+
+	gtk_statusbar_pop(GTK_STATUSBAR(data->pixel_bar), data->pixel_bar_context);
+	gtk_statusbar_push(GTK_STATUSBAR(data->pixel_bar), data->pixel_bar_context, coords_message);
+	g_free(coords_message);
+}
+
+/* Shows A on the left, the difference map on the right (B stays in the
+ * disparity image) and the timing of both sides, once the latest jobs of
+ * both have been matched */
+static void show_comparison(ChData *data)
+{
+	DisparityResult &a = data->compare_results[0], &b = data->compare_results[1];
+
+	if (!data->compare || a.disparity.empty() || b.disparity.empty() || a.id != data->compare_ids[0] || b.id != data->compare_ids[1])
+	{
+		return;
+	}
+
+	Size size = data->display_size.area() > 0 ? data->display_size : a.disparity.size();
+	Mat rgb = pixbuf_mat(data->left_pixbuf, size);
+	data->compare_display.render(a.disparity, a.params.min_disparity, a.params.num_disparities, rgb);
+	gtk_image_set_from_pixbuf(data->image_left, data->left_pixbuf);
+
+	ComparisonStats stats = compare_disparities(a.disparity, a.params.min_disparity, b.disparity, b.params.min_disparity, data->compare_diff);
+	show_image(data, data->image_right, data->right_pixbuf, data->compare_diff);
+
+	gchar *preview_message = b.level > 0 ? g_strdup_printf("Preview at 1/%d resolution: ", 1 << b.level) : g_strdup("");
+	gchar *status_message = g_strdup_printf("%sA %.1f ms, B %.1f ms; |A-B| %.2f px mean, %.1f%% over 1 px; valid A %.1f%%, B %.1f%%",
+											preview_message, a.elapsed_ms, b.elapsed_ms, stats.mean_abs_diff, stats.over_1px * 100,
+											stats.valid_a * 100, stats.valid_b * 100);
+	gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->status_bar_context);
+	gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->status_bar_context, status_message);
+	g_free(status_message);
+	g_free(preview_message);
+}
 
-		switch (data->matcher_type)
+/* Runs on the GTK main loop when the A side of a comparison is matched */
+static gboolean on_compare_ready(gpointer user_data)
+{
+	ChData *data = (ChData *)user_data;
+	DisparityResult result;
+
+	if (data->compare_worker->take_result(result))
+	{
+		data->compare_results[0] = result;
+
+		try
 		{
-		case BM:
-#ifdef WITH_CUDA
-			stereo_bm = data->stereo_matcher.dynamicCast<cuda::StereoBM>();
-#else
-			stereo_bm = data->stereo_matcher.dynamicCast<StereoBM>();
-#endif
+			show_comparison(data);
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << e.what() << '\n';
+		}
+	}
 
-			// If we have the wrong type of matcher, let's create a new one:
-			if (!stereo_bm)
-			{
-#ifdef WITH_CUDA
-				data->stereo_matcher = stereo_bm = cuda::createStereoBM(16, 1);
-#else
-				data->stereo_matcher = stereo_bm = StereoBM::create(16, 1);
-#endif
-				gtk_widget_set_sensitive(data->sc_block_size, true);
-				gtk_widget_set_sensitive(data->sc_min_disparity, true);
-				gtk_widget_set_sensitive(data->sc_num_disparities, true);
-				gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
-				gtk_widget_set_sensitive(data->sc_speckle_range, true);
-				gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
-				gtk_widget_set_sensitive(data->sc_p1, false);
-				gtk_widget_set_sensitive(data->sc_p2, false);
-				gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
-				gtk_widget_set_sensitive(data->sc_pre_filter_size, true);
-				gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
-				gtk_widget_set_sensitive(data->sc_texture_threshold, true);
-				gtk_widget_set_sensitive(data->rb_pre_filter_normalized, true);
-				gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, true);
-				gtk_widget_set_sensitive(data->chk_full_dp, false);
-			}
+	return G_SOURCE_REMOVE;
+}
 
-			stereo_bm->setBlockSize(data->block_size);
-			stereo_bm->setDisp12MaxDiff(data->disp_12_max_diff);
-			stereo_bm->setMinDisparity(data->min_disparity);
-			stereo_bm->setNumDisparities(data->num_disparities);
-			stereo_bm->setSpeckleRange(data->speckle_range);
-			stereo_bm->setSpeckleWindowSize(data->speckle_window_size);
-			stereo_bm->setPreFilterCap(data->pre_filter_cap);
-			stereo_bm->setPreFilterSize(data->pre_filter_size);
-			stereo_bm->setPreFilterType(data->pre_filter_type);
-			stereo_bm->setTextureThreshold(data->texture_threshold);
-			stereo_bm->setUniquenessRatio(data->uniqueness_ratio);
-
-			if (data->roi1 != NULL && data->roi2 != NULL)
-			{
-				stereo_bm->setROI1(*data->roi1);
-				stereo_bm->setROI2(*data->roi2);
-			}
-			break;
+/* Records a startup milestone as a span from the start of the program, and
+ * prints it */
+static void report_startup(ChData *data, const char *milestone)
+{
+	int64 now = getTickCount();
+	Profiler::instance().record(milestone, data->startup_ticks, now);
+	printf("Time %s: %.0f ms\n", milestone, (now - data->startup_ticks) * 1000.0 / getTickFrequency());
+}
 
-		case SGBM:
-#ifdef WITH_CUDA
-			stereo_sgbm = data->stereo_matcher.dynamicCast<cuda::StereoSGM>();
-#else
-			stereo_sgbm = data->stereo_matcher.dynamicCast<StereoSGBM>();
-#endif
+/* Shows the rolling wall-clock statistics of every stage timed so far */
+static void show_profile(ChData *data)
+{
+	string summary = Profiler::instance().summary();
+	gtk_statusbar_pop(GTK_STATUSBAR(data->profile_bar), data->profile_bar_context);
+	gtk_statusbar_push(GTK_STATUSBAR(data->profile_bar), data->profile_bar_context, summary.c_str());
+}
 
-			// If we have the wrong type of matcher, let's create a new one:
-			if (!stereo_sgbm)
-			{
-#ifdef WITH_CUDA
-				data->stereo_matcher = stereo_sgbm = cuda::createStereoSGM(
-					ChData::DEFAULT_MIN_DISPARITY,
-					ChData::DEFAULT_NUM_DISPARITIES, ChData::DEFAULT_BLOCK_SIZE);
-#else
-				data->stereo_matcher = stereo_sgbm = StereoSGBM::create(
-					ChData::DEFAULT_MIN_DISPARITY,
-					ChData::DEFAULT_NUM_DISPARITIES, ChData::DEFAULT_BLOCK_SIZE,
-					ChData::DEFAULT_P1, ChData::DEFAULT_P2,
-					ChData::DEFAULT_DISP_12_MAX_DIFF,
-					ChData::DEFAULT_PRE_FILTER_CAP,
-					ChData::DEFAULT_UNIQUENESS_RATIO,
-					ChData::DEFAULT_SPECKLE_WINDOW_SIZE,
-					ChData::DEFAULT_SPECKLE_RANGE, ChData::DEFAULT_MODE);
-#endif
+/* Runs on the GTK main loop when the compute thread has a new disparity map */
+static gboolean on_disparity_ready(gpointer user_data)
+{
+	ChData *data = (ChData *)user_data;
+	DisparityResult result;
 
-				gtk_widget_set_sensitive(data->sc_block_size, true);
-				gtk_widget_set_sensitive(data->sc_min_disparity, true);
-				gtk_widget_set_sensitive(data->sc_num_disparities, true);
-				gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
-				gtk_widget_set_sensitive(data->sc_speckle_range, true);
-				gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
-				gtk_widget_set_sensitive(data->sc_p1, true);
-				gtk_widget_set_sensitive(data->sc_p2, true);
-				gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
-				gtk_widget_set_sensitive(data->sc_pre_filter_size, false);
-				gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
-				gtk_widget_set_sensitive(data->sc_texture_threshold, false);
-				gtk_widget_set_sensitive(data->rb_pre_filter_normalized, false);
-				gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, false);
-				gtk_widget_set_sensitive(data->chk_full_dp, true);
-			}
+	if (!data->worker->take_result(result))
+	{
+		return G_SOURCE_REMOVE;
+	}
 
-			stereo_sgbm->setBlockSize(data->block_size);
-			stereo_sgbm->setDisp12MaxDiff(data->disp_12_max_diff);
-			stereo_sgbm->setMinDisparity(data->min_disparity);
-#ifdef WITH_CUDA
-			stereo_sgbm->setMode(cv::cuda::StereoSGM::MODE_HH);
-			if (data->num_disparities % 64 == 0)
-				stereo_sgbm->setNumDisparities(data->num_disparities);
-#else
-			stereo_sgbm->setMode(data->mode);
-			stereo_sgbm->setNumDisparities(data->num_disparities);
-#endif
-			stereo_sgbm->setP1(data->p1);
-			stereo_sgbm->setP2(data->p2);
-			stereo_sgbm->setPreFilterCap(data->pre_filter_cap);
-			stereo_sgbm->setSpeckleRange(data->speckle_range);
-			stereo_sgbm->setSpeckleWindowSize(data->speckle_window_size);
-			stereo_sgbm->setUniquenessRatio(data->uniqueness_ratio);
+	try
+	{
+		data->cv_image_disparity = result.disparity;
 
-			break;
+		if (data->egress != NULL && result.level == 0)
+		{
+			publish_disparity(*data->egress, result.disparity, result.id, shm_ring_now_ns());
 		}
 
-		clock_t t;
-		t = clock();
+		gchar *status_message;
+		gchar *preview_message = result.level > 0 ? g_strdup_printf("Preview at 1/%d resolution: ", 1 << result.level) : g_strdup("");
 
+		if (!data->cv_image_ground_truth.empty())
+		{
+			// Pixels outside a dragged rectangle were not matched
+			EvaluationResult evaluation = evaluate_disparity(data->cv_image_disparity, result.params.min_disparity, data->cv_image_ground_truth, result.region);
+			evaluation.runtime_ms = result.elapsed_ms;
+			status_message = g_strdup_printf("%s%s%s", preview_message, format_evaluation(evaluation).c_str(), result.cached ? " (from the cache)" : "");
+		}
+		else if (result.cached)
+		{
+			status_message = g_strdup_printf("%sDisparity taken from the cache in %lf milliseconds", preview_message, result.elapsed_ms);
+		}
+		else if (result.volume_reused)
+		{
+			status_message = g_strdup_printf("%sDisparity post-processing took %lf milliseconds (cost volume reused)", preview_message, result.elapsed_ms);
+		}
+		else
+		{
 #ifdef WITH_CUDA
-		cuda::GpuMat cuda_left, cuda_right, cuda_disp, cuda_disp_filtered;
-		int nDisp = 64;
-		int radius = 3;
-		int iters = 1;
-		Ptr<cuda::DisparityBilateralFilter> pCudaBilFilter = cuda::createDisparityBilateralFilter(nDisp, radius, iters);
-		cuda_left.upload(data->cv_image_left);
-		cuda_right.upload(data->cv_image_right);
-		data->stereo_matcher->compute(cuda_left, cuda_right,
-									  cuda_disp);
-		pCudaBilFilter->apply(cuda_disp, cuda_left, cuda_disp_filtered);
-		cuda_disp_filtered.download(data->cv_image_disparity);
-#else
-		data->stereo_matcher->compute(data->cv_image_left, data->cv_image_right,
-									  data->cv_image_disparity);
-#endif
-		t = clock() - t;
-#ifdef WITH_CUDA
-		gchar *status_message = g_strdup_printf("Disparity computation took %lf milliseconds with CUDA", ((double)t * 1000) / CLOCKS_PER_SEC);
+			status_message = g_strdup_printf("%sDisparity computation took %lf milliseconds with CUDA", preview_message, result.elapsed_ms);
 #else
-		gchar *status_message = g_strdup_printf("Disparity computation took %lf milliseconds", ((double)t * 1000) / CLOCKS_PER_SEC);
+			status_message = g_strdup_printf("%sDisparity computation took %lf milliseconds", preview_message, result.elapsed_ms);
 #endif
+		}
+
+		g_free(preview_message);
+
 		gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->status_bar_context);
 		gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->status_bar_context, status_message);
 		g_free(status_message);
 
-		normalize(data->cv_image_disparity, data->cv_image_disparity_normalized, 0,
-				  255, NORM_MINMAX, CV_8UC1);
-		cvtColor(data->cv_image_disparity_normalized, data->cv_color_image,
-				 COLOR_GRAY2RGB);
-		GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
-			(guchar *)data->cv_color_image.data, GDK_COLORSPACE_RGB, false,
-			8, data->cv_color_image.cols,
-			data->cv_color_image.rows, data->cv_color_image.step,
-			NULL, NULL);
-		gtk_image_set_from_pixbuf(data->image_depth, pixbuf);
-		data->image_width = data->cv_color_image.cols;
-		gchar *img_pixel = g_strdup_printf("%d", data->image_width);
-		gtk_statusbar_pop(GTK_STATUSBAR(data->img_width_bar), data->img_width_bar_context);
-		gtk_statusbar_push(GTK_STATUSBAR(data->img_width_bar), data->img_width_bar_context, img_pixel);
-		g_free(img_pixel);
+		data->displayed_min_disparity = result.params.min_disparity;
+		data->displayed_num_disparities = result.params.num_disparities;
+		show_disparity(data);
+		show_image_width(data);
+
+		if (!data->first_disparity_shown)
+		{
+			data->first_disparity_shown = true;
+			report_startup(data, "to first disparity");
+		}
+
+		show_profile(data);
+
+		if (data->compare)
+		{
+			data->compare_results[1] = result;
+			show_comparison(data);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << '\n';
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Puts an estimated range on the range sliders, within their bounds, and
+ * requests a map with it */
+static void apply_disparity_range(ChData *data, const DisparityRange &range)
+{
+	// A range starting below the slider still has to reach as far
+	int lowest = (int)gtk_adjustment_get_lower(data->adj_min_disparity);
+	int highest = (int)gtk_adjustment_get_upper(data->adj_min_disparity);
+	int min_disparity = max(lowest, min(range.min_disparity, highest));
+	int num_disparities = max(16, (range.min_disparity + range.num_disparities - min_disparity + 15) / 16 * 16);
+
+	data->live_update = false;
+	gtk_adjustment_set_value(data->adj_min_disparity, min_disparity);
+	gtk_adjustment_set_value(data->adj_num_disparities, num_disparities);
+	data->live_update = true;
+	update_matcher(data);
+}
+
+/* Runs on the GTK main loop when the streaming pipeline has matched frames.
+ * Only the newest one is shown. */
+static gboolean on_stream_frame(gpointer user_data)
+{
+	ChData *data = (ChData *)user_data;
+	StreamResult latest;
+
+	if (!data->stream->take_latest(latest))
+	{
+		return G_SOURCE_REMOVE;
+	}
+
+	try
+	{
+		data->cv_image_left = latest.frame.gray_left;
+		data->cv_image_right = latest.frame.gray_right;
+		data->cv_image_left_color = latest.frame.left;
+		data->cv_image_disparity = latest.disparity.disparity;
+		data->displayed_min_disparity = latest.disparity.params.min_disparity;
+		data->displayed_num_disparities = latest.disparity.params.num_disparities;
+
+		show_image(data, data->image_left, data->left_pixbuf, latest.frame.left);
+		show_image(data, data->image_right, data->right_pixbuf, latest.frame.right);
+		show_disparity(data);
+		show_image_width(data);
+
+		if (!data->first_disparity_shown)
+		{
+			data->first_disparity_shown = true;
+			report_startup(data, "to first disparity");
+		}
+
+		show_profile(data);
+
+		DisparityRange range;
+
+		if (data->auto_range && data->stream->take_range(range) &&
+			range_worth_applying(range, data->min_disparity, data->num_disparities))
+		{
+			apply_disparity_range(data, range);
+		}
+
+		int64 now = getTickCount();
+		double window_s = (now - data->rate_ticks) / getTickFrequency();
+
+		if (window_s >= 1.0)
+		{
+			unsigned long matched = data->stream->matched_frames();
+			data->matched_fps = (matched - data->rate_frames) / window_s;
+			data->rate_frames = matched;
+			data->rate_ticks = now;
+		}
+
+		gchar *search_message = latest.disparity.search_ratio < 1.0 ? g_strdup_printf(" over %.0f%% of the range", latest.disparity.search_ratio * 100) : g_strdup("");
+		gchar *status_message = g_strdup_printf("Frame %lu at %.1f fps: disparity computation took %lf milliseconds%s, %lu frames dropped",
+												latest.frame.index, data->matched_fps, latest.disparity.elapsed_ms, search_message, data->stream->dropped_frames());
+		g_free(search_message);
+		gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->status_bar_context);
+		gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->status_bar_context, status_message);
+		g_free(status_message);
 	}
 	catch (const std::exception &e)
 	{
 		std::cerr << e.what() << '\n';
 	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Gray images of the size the pair is going to be shown at, until it is
+ * loaded. The size is read from the header of `filename`; nothing is shown
+ * when it cannot be (streams, formats GdkPixbuf does not know). */
+static void show_placeholders(ChData *data, const char *filename, bool side_by_side)
+{
+	int width, height;
+
+	if (filename == NULL || gdk_pixbuf_get_file_info(filename, &width, &height) == NULL)
+	{
+		return;
+	}
+
+	data->display_size = fit_display_size(Size(side_by_side ? width / 2 : width, height));
+
+	GtkImage *images[3] = {data->image_left, data->image_right, data->image_depth};
+	GdkPixbuf **pixbufs[3] = {&data->left_pixbuf, &data->right_pixbuf, &data->disparity_pixbuf};
+
+	for (int i = 0; i < 3; i++)
+	{
+		pixbuf_mat(*pixbufs[i], data->display_size).setTo(Scalar::all(48));
+		gtk_image_set_from_pixbuf(images[i], *pixbufs[i]);
+	}
+}
+
+/* The window is on screen: its first drawing is the time to window */
+static gboolean on_first_draw(GtkWidget *widget, cairo_t *cr, gpointer user_data)
+{
+	ChData *data = (ChData *)user_data;
+	g_signal_handlers_disconnect_by_func(widget, (gpointer)on_first_draw, user_data);
+	report_startup(data, "to window");
+	return FALSE;
+}
+
+/* Runs on the GTK main loop once the PairLoader is done: takes the pair,
+ * shows it, enables the controls and starts matching */
+static gboolean on_pair_loaded(gpointer user_data)
+{
+	ChData *data = (ChData *)user_data;
+	PairLoader *loader = data->loader;
+	loader->join();
+
+	// The reason was printed by the loader
+	if (loader->failed)
+	{
+		exit(1);
+	}
+
+	if (loader->rectified)
+	{
+		data->roi1 = new Rect(loader->rect.roi1);
+		data->roi2 = new Rect(loader->rect.roi2);
+		data->q = loader->rect.q;
+	}
+
+	data->cv_image_left = loader->gray[0];
+	data->cv_image_right = loader->gray[1];
+	data->cv_image_left_color = loader->color[0];
+	data->cv_image_right_color = loader->color[1];
+	data->cv_image_ground_truth = loader->ground_truth;
+	data->preview_level = loader->preview_level;
+	data->pyramid_left = loader->pyramid_left;
+	data->pyramid_right = loader->pyramid_right;
+	data->input_hash = loader->input_hash;
+	data->display_size = fit_display_size(data->cv_image_left.size());
+
+	show_image(data, data->image_left, data->left_pixbuf, data->cv_image_left_color);
+	show_image(data, data->image_right, data->right_pixbuf, data->cv_image_right_color);
+
+	gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->status_bar_context);
+	gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->status_bar_context, "Computing the disparity map...");
+
+	if (loader->is_stream())
+	{
+		data->stream = new StreamPipeline(&loader->source, loader->rectified ? &loader->rect : NULL, loader->stream_loop, on_stream_frame, data);
+		data->stream->set_egress(data->egress);
+		data->rate_ticks = getTickCount();
+	}
+	else
+	{
+		data->worker = new ComputeWorker(on_disparity_ready, data, &data->cache);
+	}
+
+	gtk_widget_set_sensitive(gtk_bin_get_child(GTK_BIN(data->main_window)), TRUE);
+	update_matcher(data);
+
+	if (data->stream != NULL)
+	{
+		data->stream->start();
+	}
+
+	show_profile(data);
+	return G_SOURCE_REMOVE;
 }
 
 void update_interface(ChData *data)
@@ -374,10 +824,14 @@ void update_interface(ChData *data)
 	{
 		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_bm), true);
 	}
-	else
+	else if (data->matcher_type == SGBM)
 	{
 		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_sgbm), true);
 	}
+	else
+	{
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_census), true);
+	}
 
 	gtk_adjustment_set_value(data->adj_block_size, data->block_size);
 	gtk_adjustment_set_value(data->adj_min_disparity, data->min_disparity);
@@ -392,6 +846,10 @@ void update_interface(ChData *data)
 	gtk_adjustment_set_value(data->adj_uniqueness_ratio, data->uniqueness_ratio);
 	gtk_adjustment_set_value(data->adj_texture_threshold, data->texture_threshold);
 	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->chk_full_dp), data->mode == StereoSGBM::MODE_HH);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->chk_cost_volume), data->cost_volume);
+	gtk_combo_box_set_active(GTK_COMBO_BOX(data->cb_post_filter), data->post_filter);
+	gtk_adjustment_set_value(data->adj_post_filter_radius, data->post_filter_radius);
+	gtk_adjustment_set_value(data->adj_post_filter_sigma, data->post_filter_sigma);
 
 	if (data->pre_filter_type == StereoBM::PREFILTER_NORMALIZED_RESPONSE)
 	{
@@ -406,6 +864,92 @@ void update_interface(ChData *data)
 	update_matcher(data);
 }
 
+/* Suggests a range around the current value of the selected parameter */
+static void sweep_suggest_range(ChData *data)
+{
+	data->sweep_parameter = (SweepParameter)gtk_combo_box_get_active(GTK_COMBO_BOX(data->cb_sweep_parameter));
+	int value = sweep_field(*data, data->sweep_parameter);
+	gtk_adjustment_set_value(data->adj_sweep_from, value / 2);
+	gtk_adjustment_set_value(data->adj_sweep_to, max(2 * value, value + 16));
+}
+
+/* Keeps the thumbnails in the order of the values, whatever order they
+ * finish in */
+static gint sweep_tile_order(GtkFlowBoxChild *a, GtkFlowBoxChild *b, gpointer user_data)
+{
+	return GPOINTER_TO_INT(g_object_get_data(G_OBJECT(gtk_bin_get_child(GTK_BIN(a))), "sweep-index")) -
+		   GPOINTER_TO_INT(g_object_get_data(G_OBJECT(gtk_bin_get_child(GTK_BIN(b))), "sweep-index"));
+}
+
+/* Clicking a thumbnail puts its value on the sliders */
+static void on_sweep_tile_clicked(GtkButton *button, ChData *data)
+{
+	int index = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(button), "sweep-index"));
+	sweep_field(*data, data->sweep_parameter) = data->sweep_values[index];
+	update_interface(data);
+}
+
+/* Runs on the GTK main loop when configurations of the sweep are matched:
+ * adds a thumbnail with its value, runtime and error for each */
+static gboolean on_sweep_tile(gpointer user_data)
+{
+	ChData *data = (ChData *)user_data;
+	vector<SweepTile> tiles;
+
+	if (!data->sweep->take_tiles(tiles))
+	{
+		return G_SOURCE_REMOVE;
+	}
+
+	const gchar *name = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(data->cb_sweep_parameter));
+
+	for (size_t i = 0; i < tiles.size(); i++)
+	{
+		GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+		gchar *caption;
+
+		if (tiles[i].failed)
+		{
+			caption = g_strdup_printf("%s = %d\nrejected by the matcher", name, tiles[i].value);
+		}
+		else
+		{
+			GdkPixbuf *pixbuf = NULL;
+			Mat rgb = pixbuf_mat(pixbuf, tiles[i].thumbnail.size());
+			data->sweep_display.render(tiles[i].thumbnail, data->sweep_min_disparity, data->sweep_num_disparities, rgb);
+			gtk_box_pack_start(GTK_BOX(box), gtk_image_new_from_pixbuf(pixbuf), FALSE, FALSE, 0);
+			g_object_unref(pixbuf);
+
+			gchar *runtime = tiles[i].cached ? g_strdup("cached") : g_strdup_printf("%.1f ms", tiles[i].runtime_ms);
+
+			if (tiles[i].bad_2px >= 0)
+			{
+				caption = g_strdup_printf("%s = %d\n%s, bad 2px %.2f%%", name, tiles[i].value, runtime, tiles[i].bad_2px * 100);
+			}
+			else
+			{
+				caption = g_strdup_printf("%s = %d\n%s", name, tiles[i].value, runtime);
+			}
+
+			g_free(runtime);
+		}
+
+		gtk_box_pack_start(GTK_BOX(box), gtk_label_new(caption), FALSE, FALSE, 0);
+		g_free(caption);
+
+		GtkWidget *button = gtk_button_new();
+		gtk_container_add(GTK_CONTAINER(button), box);
+		gtk_widget_set_sensitive(button, !tiles[i].failed);
+		g_object_set_data(G_OBJECT(button), "sweep-index", GINT_TO_POINTER(tiles[i].index));
+		g_signal_connect(button, "clicked", G_CALLBACK(on_sweep_tile_clicked), data);
+		gtk_widget_show_all(button);
+		gtk_flow_box_insert(GTK_FLOW_BOX(data->sweep_tiles), button, -1);
+	}
+
+	g_free((gchar *)name);
+	return G_SOURCE_REMOVE;
+}
+
 extern "C"
 {
 	G_MODULE_EXPORT void on_adj_block_size_value_changed(GtkAdjustment *adjustment,
@@ -637,11 +1181,31 @@ extern "C"
 		update_matcher(data);
 	}
 
+	G_MODULE_EXPORT void on_adj_post_filter_radius_value_changed(GtkAdjustment *adjustment, ChData *data)
+	{
+		data->post_filter_radius = (gint)gtk_adjustment_get_value(adjustment);
+		update_matcher(data);
+	}
+
+	G_MODULE_EXPORT void on_adj_post_filter_sigma_value_changed(GtkAdjustment *adjustment, ChData *data)
+	{
+		data->post_filter_sigma = (gint)gtk_adjustment_get_value(adjustment);
+		update_matcher(data);
+	}
+
+	G_MODULE_EXPORT void on_cb_post_filter_changed(GtkComboBox *combo, ChData *data)
+	{
+		data->post_filter = (PostFilterType)gtk_combo_box_get_active(combo);
+		update_sensitivity(data);
+		update_matcher(data);
+	}
+
 	G_MODULE_EXPORT void on_algo_ssgbm_clicked(GtkButton *b, ChData *data)
 	{
 		if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(b)))
 		{
 			data->matcher_type = SGBM;
+			update_sensitivity(data);
 			update_matcher(data);
 		}
 	}
@@ -651,62 +1215,186 @@ extern "C"
 		if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(b)))
 		{
 			data->matcher_type = BM;
+			update_sensitivity(data);
+			update_matcher(data);
+		}
+	}
+
+	G_MODULE_EXPORT void on_algo_census_clicked(GtkButton *b, ChData *data)
+	{
+		if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(b)))
+		{
+			data->matcher_type = CENSUS;
+			update_sensitivity(data);
 			update_matcher(data);
 		}
 	}
 
 	G_MODULE_EXPORT void disparity_on_click(GtkWidget *widget, GdkEventButton *event, ChData *data)
 	{
-		// Update baseline map
+		// A right click goes back to the whole image
+		if (event->button == 3)
+		{
+			data->selection = Rect();
+			update_matcher(data);
+			return;
+		}
+
+		data->selection_start = data->display_to_image(event->x, event->y);
+		probe_depth(data, event->x, event->y);
+	}
+
+	G_MODULE_EXPORT gboolean on_disparity_motion(GtkWidget *widget, GdkEventMotion *event, ChData *data)
+	{
+		probe_depth(data, event->x, event->y);
+		return FALSE;
+	}
+
+	/* Dragging on the disparity image selects the region to compute */
+	G_MODULE_EXPORT void on_disparity_button_release(GtkWidget *widget, GdkEventButton *event, ChData *data)
+	{
+		const int min_drag = 8;
+		Point end = data->display_to_image(event->x, event->y);
+
+		if (event->button != 1 || (abs(end.x - data->selection_start.x) < min_drag && abs(end.y - data->selection_start.y) < min_drag))
+		{
+			return;
+		}
+
+		Rect frame(0, 0, data->cv_image_left.cols, data->cv_image_left.rows);
+		Rect selection(Point(min(end.x, data->selection_start.x), min(end.y, data->selection_start.y)),
+					   Point(max(end.x, data->selection_start.x), max(end.y, data->selection_start.y)));
+		data->selection = selection & frame;
+
+		gchar *message = g_strdup_printf("Computing %dx%d pixels at (%d, %d), right click for the whole image",
+										 data->selection.width, data->selection.height, data->selection.x, data->selection.y);
+		gtk_statusbar_pop(GTK_STATUSBAR(data->pixel_bar), data->pixel_bar_context);
+		gtk_statusbar_push(GTK_STATUSBAR(data->pixel_bar), data->pixel_bar_context, message);
+		g_free(message);
+
 		update_matcher(data);
-		// Get baseline from GUI
-		const char *bsl_text = gtk_entry_get_text(GTK_ENTRY(data->baseline_value));
-		string bsl_text_str = convertToString(bsl_text, strlen(bsl_text));
-		data->baseline = stoi(bsl_text_str);
-
-		// Get sensor width from GUI
-		const char *swd_text = gtk_entry_get_text(GTK_ENTRY(data->sensor_width_value));
-		string swd_text_str = convertToString(swd_text, strlen(swd_text));
-		data->sensor_width = stoi(swd_text_str);
-		// Get focal length
-		const char *fcl_text = gtk_entry_get_text(GTK_ENTRY(data->focallength_value));
-		string fcl_text_str = convertToString(fcl_text, strlen(fcl_text));
-		data->focal_length = stoi(fcl_text_str);
-		// Get pixel buffer
-		GdkPixbuf *pix_buffer = gtk_image_get_pixbuf(GTK_IMAGE(data->image_depth));
-		// Get clicked point coords
-		data->coord_x = event->x;
-		data->coord_y = event->y;
-		// Get image intensity at point (?)
-		guchar r, g, b, a;
-		get_pixel(pix_buffer, data->coord_x, data->coord_y, r, g, b, a);
-		// fprintf(stderr, "Got values: \t r: %d g: %d b: %d a: %d\n", r, g, b, a);
-		data->intensity_value = a;
-
-		// Compute depth value at pixel
-		double depth = -1.0;
-		if (data->use_fl_pix)
-		{
-			compute_depth_estimate_pix(data->focal_length, data->baseline, data->intensity_value, depth);
+	}
+
+	G_MODULE_EXPORT void on_cb_colormap_changed(GtkComboBox *combo, ChData *data)
+	{
+		data->display.setColormap((DisplayColormap)gtk_combo_box_get_active(combo));
+		data->compare_display.setColormap((DisplayColormap)gtk_combo_box_get_active(combo));
+		show_disparity(data);
+		show_comparison(data);
+	}
+
+	G_MODULE_EXPORT void on_cb_display_range_changed(GtkComboBox *combo, ChData *data)
+	{
+		data->display.setRange((DisplayRange)gtk_combo_box_get_active(combo));
+		data->compare_display.setRange((DisplayRange)gtk_combo_box_get_active(combo));
+		show_disparity(data);
+		show_comparison(data);
+	}
+
+	/* Starting a comparison pins the current parameters as A */
+	G_MODULE_EXPORT void on_chk_compare_toggled(GtkToggleButton *b, ChData *data)
+	{
+		data->compare = gtk_toggle_button_get_active(b);
+		gtk_widget_set_sensitive(data->btn_pin_a, data->compare);
+		gtk_widget_set_sensitive(data->btn_swap_ab, data->compare);
+		data->compare_results[0] = DisparityResult();
+		data->compare_results[1] = DisparityResult();
+
+		if (data->compare)
+		{
+			data->compare_params = *data;
+
+			if (data->compare_worker == NULL)
+			{
+				data->compare_worker = new ComputeWorker(on_compare_ready, data, &data->cache);
+			}
+
+			update_matcher(data);
+		}
+		else
+		{
+			show_image(data, data->image_left, data->left_pixbuf, data->cv_image_left_color);
+			show_image(data, data->image_right, data->right_pixbuf, data->cv_image_right_color);
+		}
+	}
+
+	/* Sets the search range from feature matches, and keeps it set on video */
+	G_MODULE_EXPORT void on_chk_auto_range_toggled(GtkToggleButton *b, ChData *data)
+	{
+		data->auto_range = gtk_toggle_button_get_active(b);
+		update_sensitivity(data);
+
+		if (data->stream != NULL)
+		{
+			data->stream->set_range_estimation(data->auto_range);
+			return;
+		}
+
+		if (!data->auto_range)
+		{
+			return;
+		}
+
+		DisparityRange range = data->range_estimator.update(data->cv_image_left, data->cv_image_right);
+		gchar *message;
+
+		if (range.valid)
+		{
+			message = g_strdup_printf("%zu matches between %.1f and %.1f px of disparity: searching %d to %d",
+									  range.matches, range.low, range.high, range.min_disparity, range.min_disparity + range.num_disparities);
 		}
 		else
 		{
-			compute_depth_estimate(data->focal_length, data->image_width, data->sensor_width, data->baseline, data->intensity_value, depth);
+			message = g_strdup_printf("Only %zu feature matches, too few to estimate the disparity range", range.matches);
 		}
 
-		gchar *coords_message = g_strdup_printf("%f @ (x: %d, y: %d), baseline: %d mm", depth, data->coord_x, data->coord_y, data->baseline);
 		gtk_statusbar_pop(GTK_STATUSBAR(data->pixel_bar), data->pixel_bar_context);
-		gtk_statusbar_push(GTK_STATUSBAR(data->pixel_bar), data->pixel_bar_context, coords_message);
-		g_free(coords_message);
+		gtk_statusbar_push(GTK_STATUSBAR(data->pixel_bar), data->pixel_bar_context, message);
+		g_free(message);
+
+		if (range.valid)
+		{
+			apply_disparity_range(data, range);
+		}
+	}
+
+	/* Video only: each tile searches around the previous frame's disparities */
+	G_MODULE_EXPORT void on_chk_temporal_toggled(GtkToggleButton *b, ChData *data)
+	{
+		if (data->stream != NULL)
+		{
+			data->stream->set_temporal(gtk_toggle_button_get_active(b));
+		}
+	}
+
+	G_MODULE_EXPORT void on_btn_pin_a_clicked(GtkButton *b, ChData *data)
+	{
+		data->compare_params = *data;
+		update_matcher(data);
 	}
 
+	/* Puts A on the sliders and keeps the current parameters as A */
+	G_MODULE_EXPORT void on_btn_swap_ab_clicked(GtkButton *b, ChData *data)
+	{
+		MatcherParams current = *data;
+		(MatcherParams &)*data = data->compare_params;
+		data->compare_params = current;
+		update_interface(data);
+	}
+
+	/* Camera entries: digits and a single decimal point */
 	G_MODULE_EXPORT void on_baseline_value_insert_text(GtkEditable *editable, const gchar *text, gint length, gint *position, ChData *data)
 	{
 		int i;
+		bool point = strchr(gtk_entry_get_text(GTK_ENTRY(editable)), '.') != NULL;
 
 		for (i = 0; i < length; i++)
 		{
-			if (!isdigit(text[i]))
+			if (text[i] == '.' && !point)
+			{
+				point = true;
+			}
+			else if (!isdigit(text[i]))
 			{
 				g_signal_stop_emission_by_name(G_OBJECT(editable), "insert-text");
 				return;
@@ -714,11 +1402,17 @@ extern "C"
 		}
 	}
 
+	G_MODULE_EXPORT void on_camera_value_changed(GtkEditable *editable, ChData *data)
+	{
+		update_camera(data);
+	}
+
 	G_MODULE_EXPORT void on_pix_rabiobutton_clicked(GtkButton *b, ChData *data)
 	{
 		if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(b)))
 		{
 			data->use_fl_pix = true;
+			update_camera(data);
 		}
 	}
 
@@ -727,6 +1421,7 @@ extern "C"
 		if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(b)))
 		{
 			data->use_fl_pix = false;
+			update_camera(data);
 		}
 	}
 
@@ -761,6 +1456,12 @@ extern "C"
 		update_matcher(data);
 	}
 
+	G_MODULE_EXPORT void on_chk_cost_volume_clicked(GtkButton *b, ChData *data)
+	{
+		data->cost_volume = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(b));
+		update_matcher(data);
+	}
+
 	G_MODULE_EXPORT void on_btn_save_clicked(GtkButton *b, ChData *data)
 	{
 		GtkWidget *dialog;
@@ -796,21 +1497,7 @@ extern "C"
 			if (!strcmp(filename + len - 4, ".yml") || !strcmp(filename + len - 4, ".xml"))
 			{
 				FileStorage fs(filename, FileStorage::WRITE);
-
-				switch (data->matcher_type)
-				{
-				case BM:
-					fs << "name"
-					   << "StereoMatcher.BM"
-					   << "blockSize" << data->block_size << "minDisparity" << data->min_disparity << "numDisparities" << data->num_disparities << "disp12MaxDiff" << data->disp_12_max_diff << "speckleRange" << data->speckle_range << "speckleWindowSize" << data->speckle_window_size << "preFilterCap" << data->pre_filter_cap << "preFilterSize" << data->pre_filter_size << "uniquenessRatio" << data->uniqueness_ratio << "textureThreshold" << data->texture_threshold << "preFilterType" << data->pre_filter_type;
-					break;
-
-				case SGBM:
-					fs << "name"
-					   << "StereoMatcher.SGBM"
-					   << "blockSize" << data->block_size << "minDisparity" << data->min_disparity << "numDisparities" << data->num_disparities << "disp12MaxDiff" << data->disp_12_max_diff << "speckleRange" << data->speckle_range << "speckleWindowSize" << data->speckle_window_size << "P1" << data->p1 << "P2" << data->p2 << "preFilterCap" << data->pre_filter_cap << "uniquenessRatio" << data->uniqueness_ratio << "mode" << data->mode;
-					break;
-				}
+				write_params(fs, *data);
 				fs.release();
 
 				GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Parameters saved successfully");
@@ -828,6 +1515,191 @@ extern "C"
 		}
 	}
 
+	/* Writes the current parameters as a C++ header for deployment, with the
+	 * block matching kernel specialised for them */
+	G_MODULE_EXPORT void on_btn_export_cpp_clicked(GtkButton *b, ChData *data)
+	{
+		GtkWidget *dialog = gtk_file_chooser_dialog_new("Export C++ Header", GTK_WINDOW(data->main_window), GTK_FILE_CHOOSER_ACTION_SAVE, "Cancel", GTK_RESPONSE_CANCEL, "Save", GTK_RESPONSE_ACCEPT, NULL);
+		GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
+		gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
+		gtk_file_chooser_set_current_name(chooser, "tuned_matcher.hpp");
+
+		GtkFileFilter *filter_hpp = gtk_file_filter_new();
+		gtk_file_filter_set_name(filter_hpp, "C++ header (*.hpp, *.h)");
+		gtk_file_filter_add_pattern(filter_hpp, "*.hpp");
+		gtk_file_filter_add_pattern(filter_hpp, "*.h");
+		gtk_file_chooser_add_filter(chooser, filter_hpp);
+
+		gint res = gtk_dialog_run(GTK_DIALOG(dialog));
+		char *filename = gtk_file_chooser_get_filename(chooser);
+		gtk_widget_destroy(GTK_WIDGET(dialog));
+
+		if (res != GTK_RESPONSE_ACCEPT)
+		{
+			g_free(filename);
+			return;
+		}
+
+		string error;
+		GtkWidget *message;
+
+		if (!export_cpp_header(filename, *data, error))
+		{
+			message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "%s", error.c_str());
+		}
+		else if (data->matcher_type == BM)
+		{
+			message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Parameters exported, with the specialised matcher in %s next to them.", CPP_EXPORT_KERNEL);
+		}
+		else
+		{
+			message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Parameters exported.");
+		}
+
+		gtk_dialog_run(GTK_DIALOG(message));
+		gtk_widget_destroy(GTK_WIDGET(message));
+		g_free(filename);
+	}
+
+	G_MODULE_EXPORT void on_btn_sweep_clicked(GtkButton *b, ChData *data)
+	{
+		if (data->sweep == NULL)
+		{
+			data->sweep = new SweepRunner(on_sweep_tile, data, &data->cache);
+			gtk_flow_box_set_sort_func(GTK_FLOW_BOX(data->sweep_tiles), sweep_tile_order, NULL, NULL);
+			sweep_suggest_range(data);
+		}
+
+		gtk_window_present(GTK_WINDOW(data->sweep_window));
+	}
+
+	G_MODULE_EXPORT void on_cb_sweep_parameter_changed(GtkComboBox *combo, ChData *data)
+	{
+		sweep_suggest_range(data);
+	}
+
+	/* Matches every value of the sweep on the current pair, in parallel */
+	G_MODULE_EXPORT void on_btn_sweep_run_clicked(GtkButton *b, ChData *data)
+	{
+		GList *children = gtk_container_get_children(GTK_CONTAINER(data->sweep_tiles));
+		for (GList *child = children; child != NULL; child = child->next)
+		{
+			gtk_widget_destroy(GTK_WIDGET(child->data));
+		}
+		g_list_free(children);
+
+		data->sweep_parameter = (SweepParameter)gtk_combo_box_get_active(GTK_COMBO_BOX(data->cb_sweep_parameter));
+		data->sweep_values = sweep_values(data->sweep_parameter, (int)gtk_adjustment_get_value(data->adj_sweep_from),
+										  (int)gtk_adjustment_get_value(data->adj_sweep_to), (int)gtk_adjustment_get_value(data->adj_sweep_steps));
+
+		// One disparity range for all the thumbnails, so equal colours are equal disparities
+		int lowest = INT_MAX, highest = INT_MIN;
+		for (size_t i = 0; i < data->sweep_values.size(); i++)
+		{
+			MatcherParams params = *data;
+			sweep_field(params, data->sweep_parameter) = data->sweep_values[i];
+			lowest = min(lowest, params.min_disparity);
+			highest = max(highest, params.min_disparity + params.num_disparities);
+		}
+
+		data->sweep_min_disparity = lowest;
+		data->sweep_num_disparities = highest - lowest;
+		data->sweep_display.setColormap((DisplayColormap)gtk_combo_box_get_active(GTK_COMBO_BOX(data->cb_colormap)));
+		data->sweep_display.setRange(DISPLAY_RANGE_SEARCH);
+
+		data->sweep->start(*data, data->sweep_parameter, data->sweep_values, data->cv_image_left, data->cv_image_right,
+						   data->input_hash, data->cv_image_ground_truth, data->roi1, data->roi2);
+	}
+
+	G_MODULE_EXPORT gboolean on_sweep_window_delete_event(GtkWidget *widget, GdkEvent *event, ChData *data)
+	{
+		data->sweep->cancel();
+		gtk_widget_hide(widget);
+		return TRUE;
+	}
+
+	/* Writes the disparity map on screen as a point cloud. Without a
+	 * calibration, Q is built from the focal length and baseline entries. */
+	G_MODULE_EXPORT void on_btn_export_cloud_clicked(GtkButton *b, ChData *data)
+	{
+		if (data->cv_image_disparity.empty())
+		{
+			return;
+		}
+
+		Mat q = data->q;
+
+		if (q.empty())
+		{
+			update_camera(data);
+			double focal_px = camera_focal_px(data);
+
+			if (focal_px <= 0 || data->baseline <= 0)
+			{
+				GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Point clouds need calibration files, or the focal length and baseline.");
+				gtk_dialog_run(GTK_DIALOG(message));
+				gtk_widget_destroy(GTK_WIDGET(message));
+				return;
+			}
+
+			q = reprojection_matrix(focal_px, data->baseline, data->cv_image_disparity.size());
+		}
+
+		GtkWidget *dialog = gtk_file_chooser_dialog_new("Export Point Cloud", GTK_WINDOW(data->main_window), GTK_FILE_CHOOSER_ACTION_SAVE, "Cancel", GTK_RESPONSE_CANCEL, "Save", GTK_RESPONSE_ACCEPT, NULL);
+		GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
+		gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
+		gtk_file_chooser_set_current_name(chooser, "cloud.ply");
+
+		GtkFileFilter *filter_ply = gtk_file_filter_new();
+		gtk_file_filter_set_name(filter_ply, "Binary PLY (*.ply)");
+		gtk_file_filter_add_pattern(filter_ply, "*.ply");
+
+		GtkFileFilter *filter_raw = gtk_file_filter_new();
+		gtk_file_filter_set_name(filter_raw, "Raw float32 (*.xyz, *.xyzrgb)");
+		gtk_file_filter_add_pattern(filter_raw, "*.xyz");
+		gtk_file_filter_add_pattern(filter_raw, "*.xyzrgb");
+
+		gtk_file_chooser_add_filter(chooser, filter_ply);
+		gtk_file_chooser_add_filter(chooser, filter_raw);
+
+		gint res = gtk_dialog_run(GTK_DIALOG(dialog));
+		char *filename = gtk_file_chooser_get_filename(chooser);
+		gtk_widget_destroy(GTK_WIDGET(dialog));
+
+		if (res != GTK_RESPONSE_ACCEPT)
+		{
+			g_free(filename);
+			return;
+		}
+
+		PointCloudFormat format;
+		GtkWidget *message;
+
+		if (!cloud_format_from_filename(filename, format))
+		{
+			message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "The supported formats are .ply, .xyz and .xyzrgb.");
+		}
+		else
+		{
+			const Mat &color = data->cv_image_left_color.type() == CV_8UC3 && data->cv_image_left_color.size() == data->cv_image_disparity.size() ? data->cv_image_left_color : Mat();
+			int64 start = getTickCount();
+
+			if (data->cloud_exporter.write(filename, format, data->cv_image_disparity, color, q, data->displayed_min_disparity))
+			{
+				double ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+				message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Exported %zu points in %.1f ms.", data->cloud_exporter.point_count(), ms);
+			}
+			else
+			{
+				message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Could not write %s.", filename);
+			}
+		}
+
+		gtk_dialog_run(GTK_DIALOG(message));
+		gtk_widget_destroy(GTK_WIDGET(message));
+		g_free(filename);
+	}
+
 	G_MODULE_EXPORT void on_btn_load_clicked(GtkButton *b, ChData *data)
 	{
 		GtkWidget *dialog;
@@ -866,43 +1738,8 @@ extern "C"
 				}
 				else
 				{
-					string name;
-					fs["name"] >> name;
-
-					if (name == "StereoMatcher.BM")
-					{
-						data->matcher_type = BM;
-						fs["blockSize"] >> data->block_size;
-						fs["minDisparity"] >> data->min_disparity;
-						fs["numDisparities"] >> data->num_disparities;
-						fs["disp12MaxDiff"] >> data->disp_12_max_diff;
-						fs["speckleRange"] >> data->speckle_range;
-						fs["speckleWindowSize"] >> data->speckle_window_size;
-						fs["preFilterCap"] >> data->pre_filter_cap;
-						fs["preFilterSize"] >> data->pre_filter_size;
-						fs["uniquenessRatio"] >> data->uniqueness_ratio;
-						fs["textureThreshold"] >> data->texture_threshold;
-						fs["preFilterType"] >> data->pre_filter_type;
-						update_interface(data);
-
-						GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Parameters loaded successfully.");
-						gtk_dialog_run(GTK_DIALOG(message));
-						gtk_widget_destroy(GTK_WIDGET(message));
-					}
-					else if (name == "StereoMatcher.SGBM")
+					if (read_params(fs, *data))
 					{
-						data->matcher_type = SGBM;
-						fs["blockSize"] >> data->block_size;
-						fs["minDisparity"] >> data->min_disparity;
-						fs["numDisparities"] >> data->num_disparities;
-						fs["disp12MaxDiff"] >> data->disp_12_max_diff;
-						fs["speckleRange"] >> data->speckle_range;
-						fs["speckleWindowSize"] >> data->speckle_window_size;
-						fs["P1"] >> data->p1;
-						fs["P2"] >> data->p2;
-						fs["preFilterCap"] >> data->pre_filter_cap;
-						fs["uniquenessRatio"] >> data->uniqueness_ratio;
-						fs["mode"] >> data->mode;
 						update_interface(data);
 
 						GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Parameters loaded successfully.");
@@ -947,6 +1784,9 @@ extern "C"
 		data->p1 = ChData::DEFAULT_P1;
 		data->p2 = ChData::DEFAULT_P2;
 		data->mode = ChData::DEFAULT_MODE;
+		data->post_filter = ChData::DEFAULT_POST_FILTER;
+		data->post_filter_radius = ChData::DEFAULT_POST_FILTER_RADIUS;
+		data->post_filter_sigma = ChData::DEFAULT_POST_FILTER_SIGMA;
 		update_interface(data);
 	}
 }
@@ -0,0 +1,233 @@
+#ifndef STEREO_TUNER_LOADER_HPP
+#define STEREO_TUNER_LOADER_HPP
+
+#include <glib.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "disparity_cache.hpp"
+#include "evaluation.hpp"
+#include "profiler.hpp"
+#include "pyramid.hpp"
+#include "rectify.hpp"
+#include "stream.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Loads the pair the interface starts with on a thread of its own, so the
+ * window is built and shown while the images are decoded: a still pair (two
+ * files or one side-by-side image) or the first frame of a stream (videos,
+ * cameras or a shared memory ring), with its calibration and ground truth.
+ *
+ * Each view goes through decoding, rectification and conversion to gray on
+ * its own thread. The rectification maps are built (or mapped from their
+ * cache) by whichever view gets there first, once the image size is known.
+ * Errors are printed as they happen; on_loaded is scheduled with g_idle_add
+ * either way and checks `failed` after join(). */
+struct PairLoader
+{
+	/* Inputs, set before start() */
+	const char *left_filename, *right_filename;
+	const char *left_stream, *right_stream;
+	const char *shm_name;
+	bool side_by_side;
+	double stream_fps;
+	bool stream_loop;
+	const char *intrinsics_filename, *extrinsics_filename;
+	const char *ground_truth_filename;
+	double ground_truth_scale;
+
+	/* Outputs. `color` and `gray` are the left and right views, rectified
+	 * when `rectified` is set. */
+	bool failed;
+	StereoSource source; /* Past the first frame when streaming */
+	bool rectified;
+	Rectification rect;
+	Mat color[2], gray[2];
+	Mat ground_truth; /* CV_32F, empty when not available */
+	int preview_level;
+	vector<Mat> pyramid_left, pyramid_right;
+	uint64_t input_hash; /* 0 when streaming */
+
+	PairLoader()
+		: left_filename(NULL), right_filename(NULL), left_stream(NULL), right_stream(NULL), shm_name(NULL),
+		  side_by_side(false),
+		  stream_fps(0), stream_loop(false), intrinsics_filename(NULL), extrinsics_filename(NULL),
+		  ground_truth_filename(NULL), ground_truth_scale(1.0), failed(false), rectified(false), preview_level(0),
+		  input_hash(0), maps_failed(false)
+	{
+	}
+
+	~PairLoader()
+	{
+		join();
+	}
+
+	void start(GSourceFunc on_loaded, gpointer user_data)
+	{
+		thread = std::thread(&PairLoader::run, this, on_loaded, user_data);
+	}
+
+	void join()
+	{
+		if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
+
+	bool is_stream() const
+	{
+		return left_stream != NULL || shm_name != NULL;
+	}
+
+private:
+	void run(GSourceFunc on_loaded, gpointer user_data)
+	{
+		failed = !load();
+		g_idle_add(on_loaded, user_data);
+	}
+
+	bool load()
+	{
+		rectified = intrinsics_filename != NULL && extrinsics_filename != NULL;
+
+		// Two files are decoded by their view's thread, a frame holding both views here
+		bool decode_views = !is_stream() && !side_by_side;
+
+		if (is_stream())
+		{
+			ScopedTimer timer("load");
+			bool opened;
+
+			if (shm_name != NULL)
+			{
+				opened = source.open_shm(shm_name);
+			}
+			else
+			{
+				opened = side_by_side ? source.open_side_by_side(left_stream, stream_fps) : source.open(left_stream, right_stream, stream_fps);
+			}
+
+			if (!opened)
+			{
+				return false;
+			}
+
+			if (!source.read(color[0], color[1]))
+			{
+				printf("Could not read the first frame of %s.\n", shm_name != NULL ? shm_name : left_stream);
+				return false;
+			}
+		}
+		else if (side_by_side)
+		{
+			ScopedTimer timer("load");
+			Mat frame = imread(left_filename, 1);
+
+			if (frame.empty())
+			{
+				printf("Could not read side-by-side image %s.\n", left_filename);
+				return false;
+			}
+
+			split_side_by_side(frame, color[0], color[1]);
+		}
+
+		std::thread right_view(&PairLoader::load_view, this, 1, decode_views);
+		load_view(0, decode_views);
+		right_view.join();
+
+		// Unreadable views and calibration files have been reported already
+		if (color[0].empty() || color[1].empty() || maps_failed)
+		{
+			return false;
+		}
+
+		if (color[0].size() != color[1].size())
+		{
+			printf("Left and right images have different sizes.\n");
+			return false;
+		}
+
+		if (rectified)
+		{
+			printf("Using provided calibration files to undistort and rectify images.\n");
+		}
+
+		if (ground_truth_filename != NULL && !load_ground_truth(ground_truth_filename, ground_truth_scale, gray[0].size(), ground_truth))
+		{
+			printf("Could not read ground truth %s.\n", ground_truth_filename);
+			return false;
+		}
+
+		/* Matching runs at native resolution; previews use a pyramid level.
+		 * A stream matches every frame in full, there is nothing to preview. */
+		preview_level = is_stream() ? 0 : ::preview_level(gray[0].size());
+		{
+			ScopedTimer timer("pyramid");
+			buildPyramid(gray[0], pyramid_left, preview_level);
+			buildPyramid(gray[1], pyramid_right, preview_level);
+		}
+
+		// Maps of the still pair are cached by the hash of its rectified images
+		if (!is_stream())
+		{
+			ScopedTimer timer("hash");
+			input_hash = hash_pair(gray[0], gray[1]);
+		}
+
+		return true;
+	}
+
+	/* Decodes (when asked to), converts and rectifies one view. A view that
+	 * cannot be read is left empty. */
+	void load_view(int view, bool decode)
+	{
+		if (decode)
+		{
+			ScopedTimer timer("load");
+			const char *filename = view == 0 ? left_filename : right_filename;
+			color[view] = imread(filename, 1);
+
+			if (color[view].empty())
+			{
+				printf("Could not read %s image %s.\n", view == 0 ? "left" : "right", filename);
+				return;
+			}
+		}
+
+		if (!rectified)
+		{
+			gray_view(color[view], gray[view]);
+			return;
+		}
+
+		call_once(maps_once, [this, view]()
+				  { maps_failed = !load_rectification(intrinsics_filename, extrinsics_filename, color[view].size(), rect); });
+
+		// A view of another size is reported once both are loaded
+		if (maps_failed || color[view].size() != rect.map11.size())
+		{
+			return;
+		}
+
+		ScopedTimer timer("rectify");
+		const Mat &map1 = view == 0 ? rect.map11 : rect.map21;
+		const Mat &map2 = view == 0 ? rect.map12 : rect.map22;
+		rectify_view(color[view], map1, map2, color[view], gray[view]);
+	}
+
+	std::thread thread;
+	once_flag maps_once;
+	atomic<bool> maps_failed;
+};
+
+#endif
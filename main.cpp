@@ -1,4 +1,9 @@
 #include "interface.hpp"
+#include "autotune.hpp"
+#include "batch.hpp"
+#include "bench.hpp"
+#include "evaluation.hpp"
+#include "shm_producer.hpp"
 
 using namespace std;
 using namespace cv;
@@ -11,11 +16,47 @@ int main(int argc, char *argv[])
 	char *right_filename = default_right_filename;
 	char *extrinsics_filename = NULL;
 	char *intrinsics_filename = NULL;
+	char *ground_truth_filename = NULL;
+	double ground_truth_scale = 1.0;
+	char *left_stream = NULL;
+	char *right_stream = NULL;
+	double stream_fps = 0;
+	bool stream_loop = false;
+	bool side_by_side = false;
+	char *trace_filename = NULL;
+	char *cache_dir = NULL;
+	char *shm_name = NULL;
+	char *shm_out = NULL;
 
 	GtkBuilder *builder;
 	GError *error = NULL;
 	ChData *data;
 
+	/* Headless modes run without initializing GTK */
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--batch") == 0)
+		{
+			return run_batch(argc, argv);
+		}
+		else if (strcmp(argv[i], "--evaluate") == 0)
+		{
+			return run_evaluation(argc, argv);
+		}
+		else if (strcmp(argv[i], "--autotune") == 0)
+		{
+			return run_autotune(argc, argv);
+		}
+		else if (strcmp(argv[i], "--bench") == 0)
+		{
+			return run_benchmark(argc, argv);
+		}
+		else if (strcmp(argv[i], "--shm-producer") == 0)
+		{
+			return run_shm_producer(argc, argv);
+		}
+	}
+
 	/* Parse arguments to find left and right filenames */
 	// TODO: we should use some library to parse the command line arguments if we
 	// are going to use lots of them.
@@ -41,100 +82,128 @@ int main(int argc, char *argv[])
 			i++;
 			intrinsics_filename = argv[i];
 		}
+		else if (strcmp(argv[i], "-groundtruth") == 0)
+		{
+			i++;
+			ground_truth_filename = argv[i];
+		}
+		else if (strcmp(argv[i], "-gtscale") == 0)
+		{
+			i++;
+			ground_truth_scale = atof(argv[i]);
+		}
+		else if (strcmp(argv[i], "-leftstream") == 0)
+		{
+			i++;
+			left_stream = argv[i];
+		}
+		else if (strcmp(argv[i], "-rightstream") == 0)
+		{
+			i++;
+			right_stream = argv[i];
+		}
+		else if (strcmp(argv[i], "-fps") == 0)
+		{
+			i++;
+			stream_fps = atof(argv[i]);
+		}
+		else if (strcmp(argv[i], "-loop") == 0)
+		{
+			stream_loop = true;
+		}
+		else if (strcmp(argv[i], "-sbs") == 0)
+		{
+			side_by_side = true;
+		}
+		else if (strcmp(argv[i], "-trace") == 0)
+		{
+			i++;
+			trace_filename = argv[i];
+		}
+		else if (strcmp(argv[i], "-cache") == 0)
+		{
+			i++;
+			cache_dir = argv[i];
+		}
+		else if (strcmp(argv[i], "-shm") == 0)
+		{
+			i++;
+			shm_name = argv[i];
+		}
+		else if (strcmp(argv[i], "-shm-out") == 0)
+		{
+			i++;
+			shm_out = argv[i];
+		}
 	}
 
-	Mat left_image = imread(left_filename, 1);
-
-	if (left_image.empty())
+	// With -sbs, -left or -leftstream holds both views
+	if (side_by_side && (right_stream != NULL || right_filename != default_right_filename))
 	{
-		printf("Could not read left image %s.\n", left_filename);
+		printf("-sbs reads both views from -left or -leftstream, -right and -rightstream cannot be used with it.\n");
 		exit(1);
 	}
 
-	Mat right_image = imread(right_filename, 1);
-
-	if (right_image.empty())
+	if (side_by_side && left_stream == NULL && left_filename == default_left_filename)
 	{
-		printf("Could not read right image %s.\n", right_filename);
+		printf("-sbs needs a side-by-side image (-left) or video (-leftstream).\n");
 		exit(1);
 	}
 
-	if (left_image.size() != right_image.size())
+	if (!side_by_side && (left_stream == NULL) != (right_stream == NULL))
 	{
-		printf("Left and right images have different sizes.\n");
+		printf("-leftstream and -rightstream must be given together.\n");
 		exit(1);
 	}
 
-	int down_width = 640;
-	int down_height = 480;
-	Mat resized_down;
-	// resize down
-	resize(left_image, left_image, Size(down_width, down_height), INTER_LINEAR);
-	resize(right_image, right_image, Size(down_width, down_height), INTER_LINEAR);
-
-	Mat gray_left, gray_right;
-	cvtColor(left_image, gray_left, COLOR_BGR2GRAY);
-	cvtColor(right_image, gray_right, COLOR_BGR2GRAY);
-
-	/* Create data */
-	data = new ChData();
+	// A shared memory ring stands for a stream
+	bool streaming = left_stream != NULL || shm_name != NULL;
 
-	if (intrinsics_filename != NULL && extrinsics_filename != NULL)
+	// Frames are not cached: only the still pair is
+	if (streaming && cache_dir != NULL)
 	{
-		FileStorage intrinsicsFs(intrinsics_filename, FileStorage::READ);
-
-		if (!intrinsicsFs.isOpened())
-		{
-			printf("Could not open intrinsic parameters file %s.\n", intrinsics_filename);
-			exit(1);
-		}
-
-		Mat m1, d1, m2, d2;
-		intrinsicsFs["M1"] >> m1;
-		intrinsicsFs["D1"] >> d1;
-		intrinsicsFs["M2"] >> m2;
-		intrinsicsFs["D2"] >> d2;
-
-		FileStorage extrinsicsFs(extrinsics_filename, FileStorage::READ);
-
-		if (!extrinsicsFs.isOpened())
-		{
-			printf("Could not open extrinsic parameters file %s.\n", extrinsics_filename);
-			exit(1);
-		}
-
-		printf("Using provided calibration files to undistort and rectify images.\n");
-
-		Mat r, t;
-		extrinsicsFs["R"] >> r;
-		extrinsicsFs["T"] >> t;
-
-		Mat r1, p1, r2, p2, q;
-		data->roi1 = new Rect();
-		data->roi2 = new Rect();
-		stereoRectify(m1, d1, m2, d2, left_image.size(), r, t, r1, r2, p1, p2, q, CALIB_ZERO_DISPARITY, -1, left_image.size(), data->roi1, data->roi2);
-
-		Mat map11, map12, map21, map22;
-		initUndistortRectifyMap(m1, d1, r1, p1, left_image.size(), CV_16SC2, map11, map12);
-		initUndistortRectifyMap(m2, d2, r2, p2, right_image.size(), CV_16SC2, map21, map22);
+		printf("-cache only applies to still pairs, not to -leftstream or -shm.\n");
+		exit(1);
+	}
 
-		Mat remapped_left, remapped_right;
-		remap(gray_left, remapped_left, map11, map12, INTER_LINEAR);
-		remap(gray_right, remapped_right, map21, map22, INTER_LINEAR);
+	// The bundled ground truth is scaled by 16 for the col3/col4 pair. The
+	// default right image is col5, twice the baseline, hence a scale of 8.
+	char default_ground_truth_filename[] = "tsukuba/truedisp.row3.col3.pgm";
+	if (ground_truth_filename == NULL && !streaming && !side_by_side && left_filename == default_left_filename && right_filename == default_right_filename)
+	{
+		ground_truth_filename = default_ground_truth_filename;
+		ground_truth_scale = 8.0;
+	}
 
-		data->cv_image_left = remapped_left;
-		data->cv_image_right = remapped_right;
+	/* The pair is loaded on its own thread while the window is built and
+	 * shown. A stream starts from its first frame, loaded like a still pair. */
+	Profiler::instance().set_tracing(trace_filename != NULL);
 
-		Mat color_remapped_left, color_remapped_right;
-		remap(left_image, color_remapped_left, map11, map12, INTER_LINEAR);
-		remap(right_image, color_remapped_right, map21, map22, INTER_LINEAR);
-		left_image = color_remapped_left;
-		right_image = color_remapped_right;
+	data = new ChData();
+	data->loader = new PairLoader();
+	data->loader->left_filename = left_filename;
+	data->loader->right_filename = right_filename;
+	data->loader->left_stream = left_stream;
+	data->loader->right_stream = right_stream;
+	data->loader->shm_name = shm_name;
+	data->loader->side_by_side = side_by_side;
+	data->loader->stream_fps = stream_fps;
+	data->loader->stream_loop = stream_loop;
+	data->loader->intrinsics_filename = intrinsics_filename;
+	data->loader->extrinsics_filename = extrinsics_filename;
+	data->loader->ground_truth_filename = ground_truth_filename;
+	data->loader->ground_truth_scale = ground_truth_scale;
+	data->loader->start(on_pair_loaded, data);
+
+	if (shm_out != NULL)
+	{
+		data->egress = new ShmRingWriter(shm_out);
 	}
-	else
+
+	if (cache_dir != NULL && !data->cache.set_directory(cache_dir))
 	{
-		data->cv_image_left = gray_left;
-		data->cv_image_right = gray_right;
+		printf("Could not create cache directory %s.\n", cache_dir);
+		exit(1);
 	}
 
 	/* Init GTK+ */
@@ -173,12 +242,31 @@ int main(int argc, char *argv[])
 	data->rb_pre_filter_normalized = GTK_WIDGET(gtk_builder_get_object(builder, "rb_pre_filter_normalized"));
 	data->rb_pre_filter_xsobel = GTK_WIDGET(gtk_builder_get_object(builder, "rb_pre_filter_xsobel"));
 	data->chk_full_dp = GTK_WIDGET(gtk_builder_get_object(builder, "chk_full_dp"));
+	data->chk_cost_volume = GTK_WIDGET(gtk_builder_get_object(builder, "chk_cost_volume"));
+	data->cb_post_filter = GTK_WIDGET(gtk_builder_get_object(builder, "cb_post_filter"));
+	data->sc_post_filter_radius = GTK_WIDGET(gtk_builder_get_object(builder, "sc_post_filter_radius"));
+	data->sc_post_filter_sigma = GTK_WIDGET(gtk_builder_get_object(builder, "sc_post_filter_sigma"));
 	data->status_bar = GTK_WIDGET(gtk_builder_get_object(builder, "status_bar"));
 	data->pixel_bar = GTK_WIDGET(gtk_builder_get_object(builder, "pixel_bar"));
 	data->img_width_bar = GTK_WIDGET(gtk_builder_get_object(builder, "img_width_bar"));
+	data->profile_bar = GTK_WIDGET(gtk_builder_get_object(builder, "profile_bar"));
 	data->image_disparity_container = GTK_WIDGET(gtk_builder_get_object(builder, "image_disparity_container"));
+	data->cb_colormap = GTK_WIDGET(gtk_builder_get_object(builder, "cb_colormap"));
+	data->cb_display_range = GTK_WIDGET(gtk_builder_get_object(builder, "cb_display_range"));
+	data->chk_compare = GTK_WIDGET(gtk_builder_get_object(builder, "chk_compare"));
+	data->btn_pin_a = GTK_WIDGET(gtk_builder_get_object(builder, "btn_pin_a"));
+	data->btn_swap_ab = GTK_WIDGET(gtk_builder_get_object(builder, "btn_swap_ab"));
+	data->chk_auto_range = GTK_WIDGET(gtk_builder_get_object(builder, "chk_auto_range"));
+	data->chk_temporal = GTK_WIDGET(gtk_builder_get_object(builder, "chk_temporal"));
+	data->sweep_window = GTK_WIDGET(gtk_builder_get_object(builder, "sweep_window"));
+	data->cb_sweep_parameter = GTK_WIDGET(gtk_builder_get_object(builder, "cb_sweep_parameter"));
+	data->sweep_tiles = GTK_WIDGET(gtk_builder_get_object(builder, "sweep_tiles"));
+	data->adj_sweep_from = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_sweep_from"));
+	data->adj_sweep_to = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_sweep_to"));
+	data->adj_sweep_steps = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_sweep_steps"));
 	data->rb_bm = GTK_WIDGET(gtk_builder_get_object(builder, "algo_sbm"));
 	data->rb_sgbm = GTK_WIDGET(gtk_builder_get_object(builder, "algo_ssgbm"));
+	data->rb_census = GTK_WIDGET(gtk_builder_get_object(builder, "algo_census"));
 	data->adj_block_size = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_block_size"));
 	data->adj_min_disparity = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_min_disparity"));
 	data->adj_num_disparities = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_num_disparities"));
@@ -191,38 +279,38 @@ int main(int argc, char *argv[])
 	data->adj_pre_filter_size = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_pre_filter_size"));
 	data->adj_uniqueness_ratio = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_uniqueness_ratio"));
 	data->adj_texture_threshold = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_texture_threshold"));
+	data->adj_post_filter_radius = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_post_filter_radius"));
+	data->adj_post_filter_sigma = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_post_filter_sigma"));
 	data->baseline_value = GTK_ENTRY(gtk_builder_get_object(builder, "baseline_value"));
 	data->sensor_width_value = GTK_ENTRY(gtk_builder_get_object(builder, "sensor_width_value"));
 	data->focallength_value = GTK_ENTRY(gtk_builder_get_object(builder, "focallength_value"));
 	data->status_bar_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(data->status_bar), "Statusbar context");
 	data->pixel_bar_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(data->pixel_bar), "Pixelbar context");
 	data->img_width_bar_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(data->img_width_bar), "img_width_bar context");
+	data->profile_bar_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(data->profile_bar), "profile_bar context");
 	data->pix_rabiobutton = GTK_WIDGET(gtk_builder_get_object(builder, "pix_rabiobutton"));
 	data->mm_rabiobutton = GTK_WIDGET(gtk_builder_get_object(builder, "mm_rabiobutton"));
-	// Put images in place:
-	// gtk_image_set_from_file(data->image_left, left_filename);
-	// gtk_image_set_from_file(data->image_right, right_filename);
-
-	Mat leftRGB, rightRGB;
-	cvtColor(left_image, leftRGB,
-			 COLOR_BGR2RGB);
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
-		(guchar *)leftRGB.data, GDK_COLORSPACE_RGB, false,
-		8, leftRGB.cols,
-		leftRGB.rows, leftRGB.step,
-		NULL, NULL);
-	gtk_image_set_from_pixbuf(data->image_left, pixbuf);
-
-	cvtColor(right_image, rightRGB,
-			 COLOR_BGR2RGB);
-	pixbuf = gdk_pixbuf_new_from_data(
-		(guchar *)rightRGB.data, GDK_COLORSPACE_RGB, false,
-		8, rightRGB.cols,
-		rightRGB.rows, rightRGB.step,
-		NULL, NULL);
-	gtk_image_set_from_pixbuf(data->image_right, pixbuf);
-
-	update_matcher(data);
+	// Put placeholders in place until the pair is loaded:
+	show_placeholders(data, !streaming ? left_filename : NULL, side_by_side);
+	gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->status_bar_context, "Loading the images...");
+
+	// Every frame of a stream is matched once, with the current parameters
+	if (streaming)
+	{
+		gtk_widget_set_sensitive(data->chk_compare, false);
+	}
+	else
+	{
+		gtk_widget_set_sensitive(data->chk_temporal, false);
+	}
+
+	update_sensitivity(data);
+	update_camera(data);
+
+	/* Nothing to tune until the pair is there: on_pair_loaded enables the
+	 * controls, starts the compute thread (or the streaming pipeline) and
+	 * requests the first disparity map */
+	gtk_widget_set_sensitive(gtk_bin_get_child(GTK_BIN(data->main_window)), FALSE);
 
 	/* Connect signals */
 	gtk_builder_connect_signals(builder, data);
@@ -231,10 +319,39 @@ int main(int argc, char *argv[])
 	g_object_unref(G_OBJECT(builder));
 
 	/* Show window. All other widgets are automatically shown by GtkBuilder */
+	g_signal_connect(data->main_window, "draw", G_CALLBACK(on_first_draw), data);
 	gtk_widget_show(data->main_window);
 
 	/* Start main loop */
 	gtk_main();
 
+	delete data->worker;
+	delete data->compare_worker;
+	delete data->sweep;
+	delete data->stream;
+	delete data->egress;
+	delete data->loader;
+
+	if (trace_filename != NULL)
+	{
+		if (Profiler::instance().write_trace(trace_filename))
+		{
+			printf("Trace written to %s, open it in chrome://tracing or ui.perfetto.dev.\n", trace_filename);
+		}
+		else
+		{
+			printf("Could not write trace %s.\n", trace_filename);
+		}
+	}
+
+	GdkPixbuf *pixbufs[3] = {data->disparity_pixbuf, data->left_pixbuf, data->right_pixbuf};
+	for (int i = 0; i < 3; i++)
+	{
+		if (pixbufs[i] != NULL)
+		{
+			g_object_unref(pixbufs[i]);
+		}
+	}
+
 	return (0);
 }
@@ -0,0 +1,410 @@
+#ifndef STEREO_TUNER_MATCHER_HPP
+#define STEREO_TUNER_MATCHER_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+#ifdef WITH_CUDA
+#include <opencv2/cudastereo.hpp>
+#endif
+
+#include "census.hpp"
+#include "cost_volume.hpp"
+#include "postfilter.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Matcher type */
+typedef enum
+{
+	BM,
+	SGBM,
+	CENSUS
+} MatcherType;
+
+static const char *matcher_type_name(MatcherType type)
+{
+	switch (type)
+	{
+	case BM:
+		return "BM";
+	case SGBM:
+		return "SGBM";
+	default:
+		return "CENSUS";
+	}
+}
+
+/* Matcher parameters. They are kept apart from the widgets so a snapshot can
+ * be handed over to the compute thread. */
+struct MatcherParams
+{
+	MatcherType matcher_type;
+	int block_size;
+	int disp_12_max_diff;
+	int min_disparity;
+	int num_disparities;
+	int speckle_range;
+	int speckle_window_size;
+	int pre_filter_cap;
+	int pre_filter_size;
+	int pre_filter_type;
+	int texture_threshold;
+	int uniqueness_ratio;
+	int p1;
+	int p2;
+	int mode;
+	bool cost_volume; /* BM only: use CostVolumeBM on the CPU */
+	PostFilterType post_filter;
+	int post_filter_radius;
+	int post_filter_sigma; /* Guide intensity difference at which a neighbour weighs e^-1/2 */
+
+	/* Defalt values */
+	static const int DEFAULT_BLOCK_SIZE = 5;
+	static const int DEFAULT_DISP_12_MAX_DIFF = -1;
+	static const int DEFAULT_MIN_DISPARITY = 0;
+	static const int DEFAULT_NUM_DISPARITIES = 64;
+	static const int DEFAULT_SPECKLE_RANGE = 0;
+	static const int DEFAULT_SPECKLE_WINDOW_SIZE = 0;
+	static const int DEFAULT_PRE_FILTER_CAP = 1;
+	static const int DEFAULT_PRE_FILTER_SIZE = 5;
+	static const int DEFAULT_PRE_FILTER_TYPE =
+		StereoBM::PREFILTER_NORMALIZED_RESPONSE;
+	static const int DEFAULT_TEXTURE_THRESHOLD = 0;
+	static const int DEFAULT_UNIQUENESS_RATIO = 0;
+	static const int DEFAULT_P1 = 0;
+	static const int DEFAULT_P2 = 0;
+	static const int DEFAULT_MODE = StereoSGBM::MODE_SGBM;
+	static const bool DEFAULT_COST_VOLUME = false;
+	static const PostFilterType DEFAULT_POST_FILTER = POST_FILTER_NONE;
+	static const int DEFAULT_POST_FILTER_RADIUS = 3;
+	static const int DEFAULT_POST_FILTER_SIGMA = 10;
+
+	MatcherParams() : matcher_type(BM), block_size(DEFAULT_BLOCK_SIZE), disp_12_max_diff(DEFAULT_DISP_12_MAX_DIFF), min_disparity(DEFAULT_MIN_DISPARITY),
+					  num_disparities(DEFAULT_NUM_DISPARITIES), speckle_range(DEFAULT_SPECKLE_RANGE),
+					  speckle_window_size(DEFAULT_SPECKLE_WINDOW_SIZE), pre_filter_cap(DEFAULT_PRE_FILTER_CAP),
+					  pre_filter_size(DEFAULT_PRE_FILTER_SIZE), pre_filter_type(DEFAULT_PRE_FILTER_TYPE),
+					  texture_threshold(DEFAULT_TEXTURE_THRESHOLD),
+					  uniqueness_ratio(DEFAULT_UNIQUENESS_RATIO), p1(DEFAULT_P1), p2(DEFAULT_P2),
+					  mode(DEFAULT_MODE), cost_volume(DEFAULT_COST_VOLUME), post_filter(DEFAULT_POST_FILTER),
+					  post_filter_radius(DEFAULT_POST_FILTER_RADIUS), post_filter_sigma(DEFAULT_POST_FILTER_SIGMA)
+	{
+	}
+};
+
+/* Whether configure_matcher creates a CUDA matcher for these parameters */
+static bool runs_on_gpu(const MatcherParams &params)
+{
+#ifdef WITH_CUDA
+	return params.matcher_type == SGBM || (params.matcher_type == BM && !params.cost_volume);
+#else
+	return false;
+#endif
+}
+
+/* Makes sure the matcher is of the requested type and applies the parameters
+ * to it. The ROIs are optional. */
+static void configure_matcher(Ptr<StereoMatcher> &matcher, const MatcherParams &params, const Rect *roi1, const Rect *roi2)
+{
+#ifdef WITH_CUDA
+	Ptr<cuda::StereoBM> stereo_bm;
+	Ptr<cuda::StereoSGM> stereo_sgbm;
+#else
+	Ptr<StereoBM> stereo_bm;
+	Ptr<StereoSGBM> stereo_sgbm;
+#endif
+	Ptr<CostVolumeBM> cost_volume_bm;
+	Ptr<CensusMatcher> census;
+
+	switch (params.matcher_type)
+	{
+	case BM:
+		if (params.cost_volume)
+		{
+			cost_volume_bm = matcher.dynamicCast<CostVolumeBM>();
+
+			if (!cost_volume_bm)
+			{
+				matcher = cost_volume_bm = CostVolumeBM::create();
+			}
+
+			cost_volume_bm->setBlockSize(params.block_size);
+			cost_volume_bm->setDisp12MaxDiff(params.disp_12_max_diff);
+			cost_volume_bm->setMinDisparity(params.min_disparity);
+			cost_volume_bm->setNumDisparities(params.num_disparities);
+			cost_volume_bm->setSpeckleRange(params.speckle_range);
+			cost_volume_bm->setSpeckleWindowSize(params.speckle_window_size);
+			cost_volume_bm->setPreFilterCap(params.pre_filter_cap);
+			cost_volume_bm->setPreFilterSize(params.pre_filter_size);
+			cost_volume_bm->setPreFilterType(params.pre_filter_type);
+			cost_volume_bm->setTextureThreshold(params.texture_threshold);
+			cost_volume_bm->setUniquenessRatio(params.uniqueness_ratio);
+
+			if (roi1 != NULL && roi2 != NULL)
+			{
+				cost_volume_bm->setROI1(*roi1);
+				cost_volume_bm->setROI2(*roi2);
+			}
+			break;
+		}
+
+#ifdef WITH_CUDA
+		stereo_bm = matcher.dynamicCast<cuda::StereoBM>();
+#else
+		stereo_bm = matcher.dynamicCast<StereoBM>();
+#endif
+
+		// If we have the wrong type of matcher, let's create a new one:
+		if (!stereo_bm)
+		{
+#ifdef WITH_CUDA
+			matcher = stereo_bm = cuda::createStereoBM(16, 1);
+#else
+			matcher = stereo_bm = StereoBM::create(16, 1);
+#endif
+		}
+
+		stereo_bm->setBlockSize(params.block_size);
+		stereo_bm->setDisp12MaxDiff(params.disp_12_max_diff);
+		stereo_bm->setMinDisparity(params.min_disparity);
+		stereo_bm->setNumDisparities(params.num_disparities);
+		stereo_bm->setSpeckleRange(params.speckle_range);
+		stereo_bm->setSpeckleWindowSize(params.speckle_window_size);
+		stereo_bm->setPreFilterCap(params.pre_filter_cap);
+		stereo_bm->setPreFilterSize(params.pre_filter_size);
+		stereo_bm->setPreFilterType(params.pre_filter_type);
+		stereo_bm->setTextureThreshold(params.texture_threshold);
+		stereo_bm->setUniquenessRatio(params.uniqueness_ratio);
+
+		if (roi1 != NULL && roi2 != NULL)
+		{
+			stereo_bm->setROI1(*roi1);
+			stereo_bm->setROI2(*roi2);
+		}
+		break;
+
+	case SGBM:
+#ifdef WITH_CUDA
+		stereo_sgbm = matcher.dynamicCast<cuda::StereoSGM>();
+#else
+		stereo_sgbm = matcher.dynamicCast<StereoSGBM>();
+#endif
+
+		// If we have the wrong type of matcher, let's create a new one:
+		if (!stereo_sgbm)
+		{
+#ifdef WITH_CUDA
+			matcher = stereo_sgbm = cuda::createStereoSGM(
+				MatcherParams::DEFAULT_MIN_DISPARITY,
+				MatcherParams::DEFAULT_NUM_DISPARITIES, MatcherParams::DEFAULT_BLOCK_SIZE);
+#else
+			matcher = stereo_sgbm = StereoSGBM::create(
+				MatcherParams::DEFAULT_MIN_DISPARITY,
+				MatcherParams::DEFAULT_NUM_DISPARITIES, MatcherParams::DEFAULT_BLOCK_SIZE,
+				MatcherParams::DEFAULT_P1, MatcherParams::DEFAULT_P2,
+				MatcherParams::DEFAULT_DISP_12_MAX_DIFF,
+				MatcherParams::DEFAULT_PRE_FILTER_CAP,
+				MatcherParams::DEFAULT_UNIQUENESS_RATIO,
+				MatcherParams::DEFAULT_SPECKLE_WINDOW_SIZE,
+				MatcherParams::DEFAULT_SPECKLE_RANGE, MatcherParams::DEFAULT_MODE);
+#endif
+		}
+
+		stereo_sgbm->setBlockSize(params.block_size);
+		stereo_sgbm->setDisp12MaxDiff(params.disp_12_max_diff);
+		stereo_sgbm->setMinDisparity(params.min_disparity);
+#ifdef WITH_CUDA
+		stereo_sgbm->setMode(cv::cuda::StereoSGM::MODE_HH);
+		if (params.num_disparities % 64 == 0)
+			stereo_sgbm->setNumDisparities(params.num_disparities);
+#else
+		stereo_sgbm->setMode(params.mode);
+		stereo_sgbm->setNumDisparities(params.num_disparities);
+#endif
+		stereo_sgbm->setP1(params.p1);
+		stereo_sgbm->setP2(params.p2);
+		stereo_sgbm->setPreFilterCap(params.pre_filter_cap);
+		stereo_sgbm->setSpeckleRange(params.speckle_range);
+		stereo_sgbm->setSpeckleWindowSize(params.speckle_window_size);
+		stereo_sgbm->setUniquenessRatio(params.uniqueness_ratio);
+
+		break;
+
+	case CENSUS:
+		census = matcher.dynamicCast<CensusMatcher>();
+
+		// If we have the wrong type of matcher, let's create a new one:
+		if (!census)
+		{
+			matcher = census = CensusMatcher::create();
+		}
+
+		census->setBlockSize(params.block_size);
+		census->setDisp12MaxDiff(params.disp_12_max_diff);
+		census->setMinDisparity(params.min_disparity);
+		census->setNumDisparities(params.num_disparities);
+		census->setSpeckleRange(params.speckle_range);
+		census->setSpeckleWindowSize(params.speckle_window_size);
+		census->setUniquenessRatio(params.uniqueness_ratio);
+
+		if (roi1 != NULL && roi2 != NULL)
+		{
+			census->setROI1(*roi1);
+			census->setROI2(*roi2);
+		}
+		break;
+	}
+}
+
+/* Runs the matcher on a pair of gray images. The output is the fixed point
+ * (4 fractional bits) disparity map produced by OpenCV. */
+static void compute_disparity(const Ptr<StereoMatcher> &matcher, const Mat &left, const Mat &right, Mat &disparity)
+{
+	// CostVolumeBM and CensusMatcher always run on the CPU
+	if (matcher.dynamicCast<CostVolumeMatcher>())
+	{
+		matcher->compute(left, right, disparity);
+		return;
+	}
+
+#ifdef WITH_CUDA
+	cuda::GpuMat cuda_left, cuda_right, cuda_disp;
+	{
+		ScopedTimer timer("upload");
+		cuda_left.upload(left);
+		cuda_right.upload(right);
+	}
+	{
+		ScopedTimer timer("cost");
+		matcher->compute(cuda_left, cuda_right, cuda_disp);
+	}
+	ScopedTimer timer("download");
+	cuda_disp.download(disparity);
+#else
+	ScopedTimer timer("cost");
+	matcher->compute(left, right, disparity);
+#endif
+}
+
+/* Writes the parameters in the format read by the `read` method of StereoBM
+ * and StereoSGBM. CENSUS uses the same keys under its own name. */
+static void write_params(FileStorage &fs, const MatcherParams &params)
+{
+	switch (params.matcher_type)
+	{
+	case BM:
+		fs << "name"
+		   << "StereoMatcher.BM"
+		   << "blockSize" << params.block_size << "minDisparity" << params.min_disparity << "numDisparities" << params.num_disparities << "disp12MaxDiff" << params.disp_12_max_diff << "speckleRange" << params.speckle_range << "speckleWindowSize" << params.speckle_window_size << "preFilterCap" << params.pre_filter_cap << "preFilterSize" << params.pre_filter_size << "uniquenessRatio" << params.uniqueness_ratio << "textureThreshold" << params.texture_threshold << "preFilterType" << params.pre_filter_type << "costVolume" << (int)params.cost_volume;
+		break;
+
+	case SGBM:
+		fs << "name"
+		   << "StereoMatcher.SGBM"
+		   << "blockSize" << params.block_size << "minDisparity" << params.min_disparity << "numDisparities" << params.num_disparities << "disp12MaxDiff" << params.disp_12_max_diff << "speckleRange" << params.speckle_range << "speckleWindowSize" << params.speckle_window_size << "P1" << params.p1 << "P2" << params.p2 << "preFilterCap" << params.pre_filter_cap << "uniquenessRatio" << params.uniqueness_ratio << "mode" << params.mode;
+		break;
+
+	case CENSUS:
+		fs << "name"
+		   << "StereoMatcher.CENSUS"
+		   << "blockSize" << params.block_size << "minDisparity" << params.min_disparity << "numDisparities" << params.num_disparities << "disp12MaxDiff" << params.disp_12_max_diff << "speckleRange" << params.speckle_range << "speckleWindowSize" << params.speckle_window_size << "uniquenessRatio" << params.uniqueness_ratio;
+		break;
+	}
+
+	fs << "postFilter" << (int)params.post_filter << "postFilterRadius" << params.post_filter_radius << "postFilterSigma" << params.post_filter_sigma;
+}
+
+/* Post-filter keys, absent from files written by OpenCV. The filter type is
+ * checked by read_params beforehand. */
+static void read_post_filter(const FileStorage &fs, MatcherParams &params)
+{
+	params.post_filter = (PostFilterType)(int)fs["postFilter"];
+	params.post_filter_radius = fs["postFilterRadius"].empty() ? MatcherParams::DEFAULT_POST_FILTER_RADIUS : (int)fs["postFilterRadius"];
+	params.post_filter_sigma = fs["postFilterSigma"].empty() ? MatcherParams::DEFAULT_POST_FILTER_SIGMA : (int)fs["postFilterSigma"];
+}
+
+/* Applies the post-filter of the parameters to a disparity map computed by
+ * compute_disparity from `left`, within `region` (all of it when empty) */
+static void post_filter(const MatcherParams &params, const Mat &left, Mat &disparity, Rect region = Rect())
+{
+	if (params.post_filter == POST_FILTER_NONE)
+	{
+		return;
+	}
+
+	ScopedTimer timer("postfilter");
+	post_filter_disparity(left, disparity, region, params.post_filter, params.post_filter_radius, params.post_filter_sigma, params.min_disparity);
+}
+
+/* Reads the parameters written by write_params. Returns false if the file
+ * does not describe a known matcher and post-filter, in which case params is
+ * left untouched. */
+static bool read_params(const FileStorage &fs, MatcherParams &params)
+{
+	string name;
+	fs["name"] >> name;
+	int post_filter = (int)fs["postFilter"];
+
+	if (post_filter < POST_FILTER_NONE || post_filter > POST_FILTER_BILATERAL)
+	{
+		return false;
+	}
+
+	if (name == "StereoMatcher.BM")
+	{
+		params.matcher_type = BM;
+		fs["blockSize"] >> params.block_size;
+		fs["minDisparity"] >> params.min_disparity;
+		fs["numDisparities"] >> params.num_disparities;
+		fs["disp12MaxDiff"] >> params.disp_12_max_diff;
+		fs["speckleRange"] >> params.speckle_range;
+		fs["speckleWindowSize"] >> params.speckle_window_size;
+		fs["preFilterCap"] >> params.pre_filter_cap;
+		fs["preFilterSize"] >> params.pre_filter_size;
+		fs["uniquenessRatio"] >> params.uniqueness_ratio;
+		fs["textureThreshold"] >> params.texture_threshold;
+		fs["preFilterType"] >> params.pre_filter_type;
+
+		// Absent from files written by StereoBM itself
+		int cost_volume = 0;
+		fs["costVolume"] >> cost_volume;
+		params.cost_volume = cost_volume != 0;
+		read_post_filter(fs, params);
+		return true;
+	}
+	else if (name == "StereoMatcher.SGBM")
+	{
+		params.matcher_type = SGBM;
+		fs["blockSize"] >> params.block_size;
+		fs["minDisparity"] >> params.min_disparity;
+		fs["numDisparities"] >> params.num_disparities;
+		fs["disp12MaxDiff"] >> params.disp_12_max_diff;
+		fs["speckleRange"] >> params.speckle_range;
+		fs["speckleWindowSize"] >> params.speckle_window_size;
+		fs["P1"] >> params.p1;
+		fs["P2"] >> params.p2;
+		fs["preFilterCap"] >> params.pre_filter_cap;
+		fs["uniquenessRatio"] >> params.uniqueness_ratio;
+		fs["mode"] >> params.mode;
+		read_post_filter(fs, params);
+		return true;
+	}
+	else if (name == "StereoMatcher.CENSUS")
+	{
+		params.matcher_type = CENSUS;
+		fs["blockSize"] >> params.block_size;
+		fs["minDisparity"] >> params.min_disparity;
+		fs["numDisparities"] >> params.num_disparities;
+		fs["disp12MaxDiff"] >> params.disp_12_max_diff;
+		fs["speckleRange"] >> params.speckle_range;
+		fs["speckleWindowSize"] >> params.speckle_window_size;
+		fs["uniquenessRatio"] >> params.uniqueness_ratio;
+		read_post_filter(fs, params);
+		return true;
+	}
+
+	return false;
+}
+
+#endif
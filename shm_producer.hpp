@@ -0,0 +1,249 @@
+#ifndef STEREO_TUNER_SHM_PRODUCER_HPP
+#define STEREO_TUNER_SHM_PRODUCER_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "shm_ring.hpp"
+#include "stream.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Name of the rings when none is given */
+static const char SHM_DEFAULT_INPUT[] = "/stereo_tuner_in";
+
+static atomic<bool> shm_producer_running(true);
+
+static void stop_shm_producer(int)
+{
+	shm_producer_running = false;
+}
+
+/* Disparity maps read back from the output ring, and how long after their
+ * pair was published they came out */
+struct EgressStats
+{
+	mutex mtx;
+	size_t maps;
+	double latency_sum_ms, latency_max_ms;
+
+	EgressStats() : maps(0), latency_sum_ms(0), latency_max_ms(0)
+	{
+	}
+};
+
+/* Reads the output ring of the tuner until the producer stops. The ring
+ * appears with the first map, it is looked for until then. */
+static void read_egress(const string &name, ShmRingReader *ring, EgressStats *stats)
+{
+	while (shm_producer_running && !ring->open(name, true))
+	{
+		this_thread::sleep_for(chrono::milliseconds(100));
+	}
+
+	Mat disparity;
+
+	while (shm_producer_running && ring->read(disparity))
+	{
+		double latency_ms = (shm_ring_now_ns() - ring->timestamp_ns()) / 1e6;
+		disparity.release();
+
+		lock_guard<mutex> lock(stats->mtx);
+		stats->maps++;
+		stats->latency_sum_ms += latency_ms;
+		stats->latency_max_ms = max(stats->latency_max_ms, latency_ms);
+	}
+}
+
+/* Stand-in for a perception process: publishes a still pair, or a video
+ * pair, on a shared memory ring at a fixed rate, for the tuner to read with
+ * -shm. The pair is published as it is (it should be rectified already),
+ * in colour or, with -gray, in gray. With -shm-out, the disparity maps the
+ * tuner publishes are read back and their latency from the publication of
+ * their pair is reported every second. Runs until interrupted, or until a
+ * video ends without -loop. */
+static int run_shm_producer(int argc, char *argv[])
+{
+	const char *left_filename = NULL;
+	const char *right_filename = NULL;
+	const char *left_stream = NULL;
+	const char *right_stream = NULL;
+	const char *ring_name = SHM_DEFAULT_INPUT;
+	const char *egress_name = NULL;
+	double fps = STREAM_DEFAULT_FPS;
+	int slots = SHM_RING_DEFAULT_SLOTS;
+	bool gray = false;
+	bool loop = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-left") == 0 && i + 1 < argc)
+		{
+			left_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-right") == 0 && i + 1 < argc)
+		{
+			right_filename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-leftstream") == 0 && i + 1 < argc)
+		{
+			left_stream = argv[++i];
+		}
+		else if (strcmp(argv[i], "-rightstream") == 0 && i + 1 < argc)
+		{
+			right_stream = argv[++i];
+		}
+		else if (strcmp(argv[i], "-shm") == 0 && i + 1 < argc)
+		{
+			ring_name = argv[++i];
+		}
+		else if (strcmp(argv[i], "-shm-out") == 0 && i + 1 < argc)
+		{
+			egress_name = argv[++i];
+		}
+		else if (strcmp(argv[i], "-fps") == 0 && i + 1 < argc)
+		{
+			fps = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-slots") == 0 && i + 1 < argc)
+		{
+			slots = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-gray") == 0)
+		{
+			gray = true;
+		}
+		else if (strcmp(argv[i], "-loop") == 0)
+		{
+			loop = true;
+		}
+	}
+
+	bool still = left_filename != NULL && right_filename != NULL;
+
+	if (!still && (left_stream == NULL || right_stream == NULL))
+	{
+		printf("Usage: %s --shm-producer (-left img -right img | -leftstream video -rightstream video [-loop]) [-shm name] [-shm-out name] [-fps n] [-slots n] [-gray]\n", argv[0]);
+		return 1;
+	}
+
+	StereoSource source;
+	Mat views[2];
+
+	if (still)
+	{
+		views[0] = imread(left_filename, IMREAD_COLOR);
+		views[1] = imread(right_filename, IMREAD_COLOR);
+
+		if (views[0].empty() || views[1].empty() || views[0].size() != views[1].size())
+		{
+			printf("Could not read a pair of images of the same size from %s and %s.\n", left_filename, right_filename);
+			return 1;
+		}
+	}
+	else if (!source.open(left_stream, right_stream, fps))
+	{
+		return 1;
+	}
+
+	if (gray && still)
+	{
+		cvtColor(views[0], views[0], COLOR_BGR2GRAY);
+		cvtColor(views[1], views[1], COLOR_BGR2GRAY);
+	}
+
+	signal(SIGINT, stop_shm_producer);
+	signal(SIGTERM, stop_shm_producer);
+
+	ShmRingWriter ring(ring_name, slots);
+	ShmRingReader egress;
+	EgressStats stats;
+	std::thread egress_reader;
+
+	if (egress_name != NULL)
+	{
+		egress_reader = std::thread(read_egress, string(egress_name), &egress, &stats);
+	}
+
+	printf("Publishing on %s at %.1f fps, Ctrl+C to stop.\n", ring_name, fps);
+
+	chrono::duration<double> period(1.0 / (fps > 0 ? fps : STREAM_DEFAULT_FPS));
+	chrono::steady_clock::time_point next = chrono::steady_clock::now();
+	chrono::steady_clock::time_point report = next + chrono::seconds(1);
+	uint64_t sequence = 0;
+	size_t published = 0, dropped = 0;
+
+	while (shm_producer_running)
+	{
+		if (!still)
+		{
+			if (!source.read(views[0], views[1]))
+			{
+				if (loop && source.rewind())
+				{
+					continue;
+				}
+
+				break;
+			}
+
+			if (gray)
+			{
+				cvtColor(views[0], views[0], COLOR_BGR2GRAY);
+				cvtColor(views[1], views[1], COLOR_BGR2GRAY);
+			}
+		}
+
+		if (ring.publish(views, 2, ++sequence, shm_ring_now_ns()))
+		{
+			published++;
+		}
+		else
+		{
+			dropped++;
+		}
+
+		next += chrono::duration_cast<chrono::steady_clock::duration>(period);
+		this_thread::sleep_until(next);
+
+		if (chrono::steady_clock::now() >= report)
+		{
+			report += chrono::seconds(1);
+			printf("%zu pairs published, %zu dropped (slots held by the reader)", published, dropped);
+
+			if (egress_name != NULL)
+			{
+				lock_guard<mutex> lock(stats.mtx);
+				printf(", %zu disparity maps back, latency %.1f ms mean, %.1f ms max", stats.maps,
+					   stats.maps > 0 ? stats.latency_sum_ms / stats.maps : 0.0, stats.latency_max_ms);
+				stats.maps = 0;
+				stats.latency_sum_ms = stats.latency_max_ms = 0;
+			}
+
+			printf("\n");
+			published = dropped = 0;
+		}
+	}
+
+	shm_producer_running = false;
+	egress.interrupt();
+
+	if (egress_reader.joinable())
+	{
+		egress_reader.join();
+	}
+
+	return 0;
+}
+
+#endif
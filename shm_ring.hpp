@@ -0,0 +1,550 @@
+#ifndef STEREO_TUNER_SHM_RING_HPP
+#define STEREO_TUNER_SHM_RING_HPP
+
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+/* Slots of a ring. The producer never writes a slot the reader still holds,
+ * so a ring needs a few more slots than the frames the reader keeps in
+ * flight (about ten in the stream pipeline, queues and display included). */
+static const int SHM_RING_DEFAULT_SLOTS = 16;
+static const int SHM_RING_MAX_SLOTS = 64;
+
+static const char SHM_RING_MAGIC[8] = {'S', 'T', 'S', 'H', 'R', 'I', 'N', 'G'};
+static const size_t SHM_RING_ALIGN = 64;
+
+/* Polls of an idle reader between checks that its ring was not replaced,
+ * and after the ring was closed before giving up on a new one (about 100 ms
+ * each once polling has slowed down) */
+static const int SHM_RING_REOPEN_POLLS = 200;
+
+/* The counters are shared between processes: they must not hide a lock */
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64-bit atomics must be lock-free");
+
+/* One frame of a ring */
+struct ShmSlotHeader
+{
+	atomic<uint64_t> sequence; /* 0 while the producer writes the slot */
+	int64_t timestamp_ns;	   /* Producer's steady clock when the frame was taken */
+};
+
+/* Layout of a ring: this header, then `slots` slots of `slot_bytes` each,
+ * starting on SHM_RING_ALIGN boundaries. A slot holds `views` images of
+ * `height` rows of `width` pixels of `type`, one after the other, rows
+ * packed. `latest` is the sequence of the newest complete slot shifted left
+ * by 8, or'ed with its index; 0 before the first frame. The single reader
+ * marks the slots it maps in `claimed`. */
+struct ShmRingHeader
+{
+	char magic[8];
+	int32_t width, height, type, views, slots;
+	uint64_t slot_bytes;
+	atomic<uint64_t> latest;
+	atomic<uint64_t> claimed;
+	atomic<uint32_t> closed; /* Set by the producer when it leaves */
+	ShmSlotHeader slot[SHM_RING_MAX_SLOTS];
+};
+
+static size_t shm_ring_align(size_t offset)
+{
+	return (offset + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN * SHM_RING_ALIGN;
+}
+
+/* Clock of the slot timestamps, shared by the processes of a machine */
+static int64_t shm_ring_now_ns()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Producer side of a ring, named like a POSIX shared memory object
+ * ("/stereo_in"). The ring is created on the first publish() and created
+ * again when the frames change size or type; it is unlinked on destruction.
+ * A frame whose slots are all held by the reader is dropped. */
+class ShmRingWriter
+{
+public:
+	explicit ShmRingWriter(const string &name, int slots = SHM_RING_DEFAULT_SLOTS)
+		: name(name), slots(max(3, min(slots, SHM_RING_MAX_SLOTS))), header(NULL), length(0), last_slot(-1)
+	{
+	}
+
+	~ShmRingWriter()
+	{
+		close_ring();
+	}
+
+	/* Copies `count` images of one size and type into the next free slot.
+	 * Returns false when the frame was dropped, or when the views differ or
+	 * the ring cannot be created (after printing why). */
+	bool publish(const Mat *views, int count, uint64_t sequence, int64_t timestamp_ns)
+	{
+#ifdef _WIN32
+		return false;
+#else
+		// The slot layout comes from the first view: the others must match it
+		for (int v = 1; v < count; v++)
+		{
+			if (views[v].size() != views[0].size() || views[v].type() != views[0].type())
+			{
+				printf("The views published on %s differ in size or type.\n", name.c_str());
+				return false;
+			}
+		}
+
+		if (header == NULL || header->width != views[0].cols || header->height != views[0].rows ||
+			header->type != views[0].type() || header->views != count)
+		{
+			close_ring();
+
+			if (!create_ring(views[0].cols, views[0].rows, views[0].type(), count))
+			{
+				return false;
+			}
+		}
+
+		for (int tries = 0; tries < slots; tries++)
+		{
+			int k = (last_slot + 1 + tries) % slots;
+			uint64_t bit = 1ULL << k;
+
+			// Marked as being written before looking at the claims, the
+			// reader checks the other way round: one of the two backs off
+			uint64_t previous = header->slot[k].sequence.exchange(0);
+
+			if (header->claimed.load() & bit)
+			{
+				header->slot[k].sequence.store(previous);
+				continue;
+			}
+
+			uchar *data = slot_data(k);
+			size_t row_bytes = views[0].cols * views[0].elemSize();
+
+			for (int v = 0; v < count; v++)
+			{
+				for (int y = 0; y < views[v].rows; y++, data += row_bytes)
+				{
+					memcpy(data, views[v].ptr(y), row_bytes);
+				}
+			}
+
+			header->slot[k].timestamp_ns = timestamp_ns;
+			header->slot[k].sequence.store(sequence);
+			header->latest.store(sequence << 8 | (uint64_t)k);
+			last_slot = k;
+			return true;
+		}
+
+		return false;
+#endif
+	}
+
+private:
+#ifndef _WIN32
+	bool create_ring(int width, int height, int type, int views)
+	{
+		size_t slot_bytes = shm_ring_align((size_t)views * height * width * CV_ELEM_SIZE(type));
+		length = shm_ring_align(sizeof(ShmRingHeader)) + slots * slot_bytes;
+
+		// A ring left behind by a crashed producer is replaced
+		shm_unlink(name.c_str());
+		int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+
+		if (fd < 0 || ftruncate(fd, length) != 0)
+		{
+			printf("Could not create shared memory ring %s.\n", name.c_str());
+
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+
+			return false;
+		}
+
+		void *address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (address == MAP_FAILED)
+		{
+			printf("Could not map shared memory ring %s.\n", name.c_str());
+			return false;
+		}
+
+		// A fresh object reads as zeros: counters at 0, no frame yet
+		header = (ShmRingHeader *)address;
+		header->width = width;
+		header->height = height;
+		header->type = type;
+		header->views = views;
+		header->slots = slots;
+		header->slot_bytes = slot_bytes;
+		atomic_thread_fence(memory_order_release);
+		memcpy(header->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+		last_slot = -1;
+		return true;
+	}
+
+	uchar *slot_data(int k)
+	{
+		return (uchar *)header + shm_ring_align(sizeof(ShmRingHeader)) + k * header->slot_bytes;
+	}
+#endif
+
+	void close_ring()
+	{
+#ifndef _WIN32
+		if (header != NULL)
+		{
+			header->closed.store(1);
+			munmap(header, length);
+			shm_unlink(name.c_str());
+			header = NULL;
+		}
+#endif
+	}
+
+	string name;
+	int slots;
+	ShmRingHeader *header;
+	size_t length;
+	int last_slot;
+};
+
+/* Consumer side of a ring, for a single reader. Frames are handed out
+ * without copies: the Mat returned by read() points into the shared memory,
+ * and its slot stays claimed (the producer skips it) until the last Mat
+ * sharing it is released. The views are row ranges of that Mat. The reader
+ * must outlive the frames.
+ *
+ * When the producer creates the ring again (new frame size, or a restart),
+ * the name points to another object: read() maps the new one. The previous
+ * mapping is kept until no frame uses it any more. */
+class ShmRingReader
+{
+public:
+	ShmRingReader() : header(NULL), length(0), inode(0), last_sequence(0), last_timestamp(0), interrupted(false)
+	{
+		for (int k = 0; k < SHM_RING_MAX_SLOTS; k++)
+		{
+			allocators[k].reader = this;
+			allocators[k].slot = k;
+		}
+	}
+
+	~ShmRingReader()
+	{
+#ifndef _WIN32
+		if (header != NULL)
+		{
+			munmap(header, length);
+		}
+
+		for (size_t i = 0; i < retired.size(); i++)
+		{
+			munmap(retired[i].first, retired[i].second);
+		}
+#endif
+	}
+
+	bool is_open() const
+	{
+		return header != NULL;
+	}
+
+	/* Maps an existing ring. Returns false, after printing why unless
+	 * `quiet`, when there is none or it is not one. */
+	bool open(const string &ring_name, bool quiet = false)
+	{
+#ifdef _WIN32
+		printf("Shared memory rings are not available on this platform.\n");
+		return false;
+#else
+		name = ring_name;
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		struct stat st;
+
+		if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmRingHeader))
+		{
+			if (!quiet)
+			{
+				printf("Could not open shared memory ring %s, is the producer running?\n", name.c_str());
+			}
+
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+
+			return false;
+		}
+
+		length = st.st_size;
+		inode = st.st_ino;
+		void *address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (address == MAP_FAILED)
+		{
+			printf("Could not map shared memory ring %s.\n", name.c_str());
+			return false;
+		}
+
+		header = (ShmRingHeader *)address;
+
+		if (memcmp(header->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC)) != 0 || header->slots < 1 ||
+			header->slots > SHM_RING_MAX_SLOTS || shm_ring_align(sizeof(ShmRingHeader)) + header->slots * header->slot_bytes > length)
+		{
+			// Possibly still being set up by its producer
+			if (!quiet)
+			{
+				printf("%s is not a stereo frame ring.\n", name.c_str());
+			}
+
+			munmap(header, length);
+			header = NULL;
+			return false;
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+
+		// Claims of a previous reader that did not clean up
+		header->claimed.store(0);
+		return true;
+#endif
+	}
+
+	/* Waits for a frame newer than the last one read. Returns false when
+	 * the producer closed the ring without creating it again, or when
+	 * interrupt() was called. */
+	bool read(Mat &frame)
+	{
+#ifdef _WIN32
+		return false;
+#else
+		for (int idle = 0, closed_at = -1; !interrupted; idle++)
+		{
+			uint64_t latest = header->latest.load();
+			uint64_t sequence = latest >> 8;
+			int k = (int)(latest & 0xff);
+
+			if (sequence == 0 || sequence == last_sequence)
+			{
+				bool closed = header->closed.load() != 0;
+
+				if ((closed || idle % SHM_RING_REOPEN_POLLS == SHM_RING_REOPEN_POLLS - 1) && reopen())
+				{
+					idle = 0;
+					closed_at = -1;
+					continue;
+				}
+
+				if (closed)
+				{
+					// A producer changing frame size creates the ring again right away
+					if (closed_at < 0)
+					{
+						closed_at = idle;
+					}
+					else if (idle - closed_at >= SHM_RING_REOPEN_POLLS)
+					{
+						return false;
+					}
+				}
+
+				// Frames come at camera rates: poll gently
+				if (idle < 100)
+				{
+					this_thread::yield();
+				}
+				else
+				{
+					this_thread::sleep_for(chrono::microseconds(500));
+				}
+
+				continue;
+			}
+
+			uint64_t bit = 1ULL << k;
+			header->claimed.fetch_or(bit);
+
+			// Overwritten meanwhile: the producer did not see the claim
+			if (header->slot[k].sequence.load() != sequence)
+			{
+				header->claimed.fetch_and(~bit);
+				continue;
+			}
+
+			last_sequence = sequence;
+			last_timestamp = header->slot[k].timestamp_ns;
+
+			// The slot's allocator releases the claim with the last Mat
+			frame.release();
+			frame.allocator = &allocators[k];
+			frame.create(header->height * header->views, header->width, header->type);
+			frame.allocator = NULL;
+			return true;
+		}
+
+		return false;
+#endif
+	}
+
+	/* Makes a waiting read() give up, from another thread */
+	void interrupt()
+	{
+		interrupted = true;
+	}
+
+	int views() const
+	{
+		return header != NULL ? header->views : 0;
+	}
+
+	/* Of the last frame read */
+	uint64_t sequence() const
+	{
+		return last_sequence;
+	}
+
+	int64_t timestamp_ns() const
+	{
+		return last_timestamp;
+	}
+
+private:
+	/* Hands out the memory of one slot and releases its claim once no Mat
+	 * uses it any more */
+	class SlotAllocator : public MatAllocator
+	{
+	public:
+		UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, AccessFlag flags, UMatUsageFlags usage) const CV_OVERRIDE
+		{
+			size_t total = CV_ELEM_SIZE(type);
+
+			for (int i = dims - 1; i >= 0; i--)
+			{
+				if (step != NULL)
+				{
+					step[i] = total;
+				}
+
+				total *= sizes[i];
+			}
+
+			// The claim is released on this mapping even if the ring was replaced since
+			UMatData *u = new UMatData(this);
+			u->data = u->origdata = reader->slot_data(slot);
+			u->size = total;
+			u->userdata = reader->header;
+			return u;
+		}
+
+		bool allocate(UMatData *u, AccessFlag flags, UMatUsageFlags usage) const CV_OVERRIDE
+		{
+			return u != NULL;
+		}
+
+		void deallocate(UMatData *u) const CV_OVERRIDE
+		{
+			((ShmRingHeader *)u->userdata)->claimed.fetch_and(~(1ULL << slot));
+			delete u;
+		}
+
+		ShmRingReader *reader;
+		int slot;
+	};
+
+	uchar *slot_data(int k)
+	{
+		return (uchar *)header + shm_ring_align(sizeof(ShmRingHeader)) + k * header->slot_bytes;
+	}
+
+#ifndef _WIN32
+	/* Maps the ring again if its name now points to another object. Returns
+	 * false, keeping the current mapping, when it does not or the new ring
+	 * is not ready yet. */
+	bool reopen()
+	{
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		struct stat st;
+		bool replaced = fd >= 0 && fstat(fd, &st) == 0 && st.st_ino != inode;
+
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+
+		if (!replaced)
+		{
+			return false;
+		}
+
+		ShmRingHeader *previous = header;
+		size_t previous_length = length;
+		ino_t previous_inode = inode;
+		header = NULL;
+
+		if (!open(name, true))
+		{
+			header = previous;
+			length = previous_length;
+			inode = previous_inode;
+			return false;
+		}
+
+		retired.push_back(make_pair(previous, previous_length));
+		last_sequence = 0;
+
+		// Earlier rings no frame holds a slot of any more
+		for (size_t i = 0; i < retired.size();)
+		{
+			if (retired[i].first->claimed.load() == 0)
+			{
+				munmap(retired[i].first, retired[i].second);
+				retired.erase(retired.begin() + i);
+			}
+			else
+			{
+				i++;
+			}
+		}
+
+		return true;
+	}
+#endif
+
+	string name;
+	ShmRingHeader *header;
+	size_t length;
+#ifndef _WIN32
+	ino_t inode;
+#else
+	unsigned long inode;
+#endif
+	vector<pair<ShmRingHeader *, size_t>> retired;
+	uint64_t last_sequence;
+	int64_t last_timestamp;
+	atomic<bool> interrupted;
+	SlotAllocator allocators[SHM_RING_MAX_SLOTS];
+};
+
+#endif
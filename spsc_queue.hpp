@@ -0,0 +1,103 @@
+#ifndef STEREO_TUNER_SPSC_QUEUE_HPP
+#define STEREO_TUNER_SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Bounded lock-free queue between exactly one producer thread and one
+ * consumer thread. Neither side ever blocks: try_push() fails when the queue
+ * is full, which lets real-time stages drop a frame instead of falling
+ * behind, and try_pop() fails when it is empty. */
+template <typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity) : slots(capacity + 1), head(0), tail(0)
+	{
+	}
+
+	/* Producer side */
+	bool try_push(const T &item)
+	{
+		size_t t = tail.load(memory_order_relaxed);
+		size_t next = (t + 1) % slots.size();
+
+		if (next == head.load(memory_order_acquire))
+		{
+			return false;
+		}
+
+		slots[t] = item;
+		tail.store(next, memory_order_release);
+		return true;
+	}
+
+	/* Consumer side. The slot is cleared so the queue does not keep the item
+	 * (and the frames it references) alive. */
+	bool try_pop(T &item)
+	{
+		size_t h = head.load(memory_order_relaxed);
+
+		if (h == tail.load(memory_order_acquire))
+		{
+			return false;
+		}
+
+		item = slots[h];
+		slots[h] = T();
+		head.store((h + 1) % slots.size(), memory_order_release);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+	}
+
+private:
+	vector<T> slots;
+	atomic<size_t> head; /* Next slot to read, owned by the consumer */
+	atomic<size_t> tail; /* Next slot to write, owned by the producer */
+};
+
+/* Waiting strategy for threads polling SpscQueues: spin briefly, then yield,
+ * then sleep a millisecond at a time */
+class Backoff
+{
+public:
+	Backoff() : count(0)
+	{
+	}
+
+	void wait()
+	{
+		if (count < 64)
+		{
+			count++;
+		}
+		else if (count < 128)
+		{
+			count++;
+			this_thread::yield();
+		}
+		else
+		{
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	}
+
+	void reset()
+	{
+		count = 0;
+	}
+
+private:
+	int count;
+};
+
+#endif
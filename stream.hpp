@@ -0,0 +1,647 @@
+#ifndef STEREO_TUNER_STREAM_HPP
+#define STEREO_TUNER_STREAM_HPP
+
+#include <glib.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "disparity_range.hpp"
+#include "profiler.hpp"
+#include "rectify.hpp"
+#include "shm_ring.hpp"
+#include "spsc_queue.hpp"
+#include "worker.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Frame rate used when a source does not report one (image sequences) */
+static const double STREAM_DEFAULT_FPS = 30.0;
+
+/* With range estimation on, every n-th frame has its disparity range
+ * measured, over the matches of the last few measured frames */
+static const unsigned long STREAM_RANGE_INTERVAL = 10;
+static const int STREAM_RANGE_HISTORY = 5;
+
+/* Frames each pipeline stage can have queued before the one upstream starts
+ * dropping */
+static const size_t STREAM_QUEUE_FRAMES = 2;
+
+/* Splits a side-by-side stereo frame (left half, right half) into two views
+ * of it, without copying. An odd last column is left out. */
+static void split_side_by_side(const Mat &frame, Mat &left, Mat &right)
+{
+	int half = frame.cols / 2;
+	left = frame(Rect(0, 0, half, frame.rows));
+	right = frame(Rect(half, 0, half, frame.rows));
+}
+
+/* Gray version of a frame, the frame itself when it is gray already */
+static void gray_view(const Mat &frame, Mat &gray)
+{
+	if (frame.channels() == 1)
+	{
+		gray = frame;
+	}
+	else
+	{
+		cvtColor(frame, gray, COLOR_BGR2GRAY);
+	}
+}
+
+/* Publishes a disparity map on a ring, as CV_16S scaled by 16 whatever the
+ * matcher produced */
+static void publish_disparity(ShmRingWriter &ring, const Mat &disparity, uint64_t sequence, int64_t timestamp_ns)
+{
+	ScopedTimer timer("publish");
+	Mat fixed = disparity;
+
+	if (disparity.type() != CV_16SC1)
+	{
+		disparity.convertTo(fixed, CV_16S, StereoMatcher::DISP_SCALE);
+	}
+
+	ring.publish(&fixed, 1, sequence, timestamp_ns);
+}
+
+/* Left and right videos read in lockstep. Each side is a video file, a
+ * numbered image sequence given as a printf pattern ("left/%04d.png", as
+ * understood by VideoCapture) or a camera index. A side-by-side source (ZED
+ * cameras and their recordings) is a single one of those, decoded once per
+ * frame and split into views.
+ *
+ * A shared memory source is a ShmRingReader fed by another process with
+ * rectified pairs, gray or colour: the views point into the ring, nothing is
+ * decoded or copied. It is live, paced by its producer. */
+class StereoSource
+{
+public:
+	StereoSource() : live(false), side_by_side(false), shm(false), frame_rate(STREAM_DEFAULT_FPS)
+	{
+	}
+
+	/* `fps` overrides the rate reported by the files when positive. Returns
+	 * false, after printing why, when a side cannot be opened. */
+	bool open(const string &left_spec, const string &right_spec, double fps)
+	{
+		bool left_live, right_live;
+
+		if (!open_capture(left_spec, left, left_live) || !open_capture(right_spec, right, right_live))
+		{
+			return false;
+		}
+
+		live = left_live || right_live;
+		side_by_side = false;
+		set_frame_rate(fps);
+		return true;
+	}
+
+	bool open_side_by_side(const string &spec, double fps)
+	{
+		if (!open_capture(spec, left, live))
+		{
+			return false;
+		}
+
+		side_by_side = true;
+		set_frame_rate(fps);
+		return true;
+	}
+
+	bool open_shm(const string &name)
+	{
+		if (!ring.open(name))
+		{
+			return false;
+		}
+
+		if (ring.views() != 2)
+		{
+			printf("Shared memory ring %s holds %d views per frame instead of 2.\n", name.c_str(), ring.views());
+			return false;
+		}
+
+		live = true;
+		shm = true;
+		frame_rate = STREAM_DEFAULT_FPS;
+		return true;
+	}
+
+	/* Next pair. Both frames are grabbed before either is decoded, so the
+	 * two sides of a live rig are as close in time as the devices allow. */
+	bool read(Mat &left_frame, Mat &right_frame)
+	{
+		if (shm)
+		{
+			// A new Mat every time: it holds its slot of the ring
+			Mat frame;
+
+			if (!ring.read(frame))
+			{
+				return false;
+			}
+
+			// The ring may have been created again by its producer since open_shm
+			if (ring.views() != 2)
+			{
+				printf("Shared memory ring holds %d views per frame instead of 2.\n", ring.views());
+				return false;
+			}
+
+			int rows = frame.rows / 2;
+			left_frame = frame.rowRange(0, rows);
+			right_frame = frame.rowRange(rows, 2 * rows);
+			return true;
+		}
+
+		if (side_by_side)
+		{
+			// A new Mat every time: the previous frame may still be in the pipeline
+			Mat frame;
+
+			if (!left.read(frame) || frame.empty())
+			{
+				return false;
+			}
+
+			split_side_by_side(frame, left_frame, right_frame);
+			return true;
+		}
+
+		if (!left.grab() || !right.grab())
+		{
+			return false;
+		}
+
+		return left.retrieve(left_frame) && right.retrieve(right_frame) && !left_frame.empty() && !right_frame.empty();
+	}
+
+	/* Back to the first frame; only files and sequences can rewind */
+	bool rewind()
+	{
+		return !live && left.set(CAP_PROP_POS_FRAMES, 0) && (side_by_side || right.set(CAP_PROP_POS_FRAMES, 0));
+	}
+
+	bool is_live() const
+	{
+		return live;
+	}
+
+	/* Producer's sequence number and timestamp of the last frame read from
+	 * shared memory, 0 for the other sources */
+	uint64_t sequence() const
+	{
+		return shm ? ring.sequence() : 0;
+	}
+
+	int64_t timestamp_ns() const
+	{
+		return shm ? ring.timestamp_ns() : 0;
+	}
+
+	/* Makes a read() waiting on shared memory give up, from another thread */
+	void interrupt()
+	{
+		ring.interrupt();
+	}
+
+	double fps() const
+	{
+		return frame_rate;
+	}
+
+private:
+	void set_frame_rate(double fps)
+	{
+		frame_rate = fps > 0 ? fps : left.get(CAP_PROP_FPS);
+
+		if (!(frame_rate > 0 && frame_rate < 1000))
+		{
+			frame_rate = STREAM_DEFAULT_FPS;
+		}
+	}
+
+	static bool open_capture(const string &spec, VideoCapture &capture, bool &is_device)
+	{
+		is_device = !spec.empty() && spec.find_first_not_of("0123456789") == string::npos;
+
+		if (is_device ? !capture.open(atoi(spec.c_str())) : !capture.open(spec))
+		{
+			printf("Could not open video source %s.\n", spec.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	VideoCapture left, right;
+	ShmRingReader ring;
+	bool live;
+	bool side_by_side;
+	bool shm;
+	double frame_rate;
+};
+
+/* A pair travelling through the streaming pipeline. The colour frames are
+ * kept for display, the gray ones are matched (they are the same Mats when
+ * the source is gray). `sequence` and `timestamp_ns` come from the producer
+ * of a shared memory source, otherwise they count frames from 1 and date
+ * their decoding; they go out with the disparity map. */
+struct StreamFrame
+{
+	unsigned long index;
+	uint64_t sequence;
+	int64_t timestamp_ns;
+	Mat left, right;
+	Mat gray_left, gray_right;
+
+	StreamFrame() : index(0), sequence(0), timestamp_ns(0)
+	{
+	}
+};
+
+/* A matched frame, ready to be displayed */
+struct StreamResult
+{
+	StreamFrame frame;
+	DisparityResult disparity;
+};
+
+/* Plays a StereoSource through decode -> rectify -> match stages, each on
+ * its own thread, connected by SpscQueues. The decode stage paces files and
+ * sequences to their frame rate (live sources pace themselves). A stage
+ * whose downstream queue is full drops the frame instead of waiting, so the
+ * pipeline stays at the source rate and the latency never grows: when
+ * matching is slower than the source, only every n-th frame is matched.
+ *
+ * Matched frames are announced to the main loop with g_idle_add; the main
+ * loop collects them with take_latest(), which keeps the newest one and
+ * drops the rest. Parameters reach the match stage through set_job(). With
+ * set_egress(), every matched map is also published on a ring. With
+ * set_range_estimation(), the rectify stage also measures the disparity
+ * range of the scene now and then, for the main loop to take_range(). With
+ * set_temporal(), CPU matchers search each tile of a frame over the range
+ * the previous frame found there (see TemporalRange). */
+class StreamPipeline
+{
+public:
+	StreamPipeline(StereoSource *source, const Rectification *rect, bool loop, GSourceFunc on_frame, gpointer user_data)
+		: source(source), rectify(rect != NULL), loop(loop), on_frame(on_frame), user_data(user_data),
+		  egress(NULL), decoded(STREAM_QUEUE_FRAMES), rectified(STREAM_QUEUE_FRAMES), matched(STREAM_QUEUE_FRAMES),
+		  range_estimator(STREAM_RANGE_HISTORY), estimate_range(false), range_pending(false), temporal(false), running(false),
+		  decode_done(false), rectify_done(false), finished(false), notify_pending(false), dropped(0), matched_count(0)
+	{
+		if (rect != NULL)
+		{
+			rectification = *rect;
+		}
+	}
+
+	~StreamPipeline()
+	{
+		stop();
+	}
+
+	/* Parameters, region and ROIs used for the next frames. The images of
+	 * `job` are ignored. */
+	void set_job(const DisparityJob &job)
+	{
+		lock_guard<mutex> lock(job_mtx);
+		job_template = job;
+		job_template.left = Mat();
+		job_template.right = Mat();
+		job_template.level = 0;
+	}
+
+	/* Before start(). The ring belongs to the caller. */
+	void set_egress(ShmRingWriter *ring)
+	{
+		egress = ring;
+	}
+
+	/* Can be switched at any time */
+	void set_range_estimation(bool enabled)
+	{
+		estimate_range = enabled;
+	}
+
+	/* Can be switched at any time */
+	void set_temporal(bool enabled)
+	{
+		temporal = enabled;
+	}
+
+	/* The disparity range measured since the last call, if any */
+	bool take_range(DisparityRange &range)
+	{
+		lock_guard<mutex> lock(range_mtx);
+
+		if (!range_pending)
+		{
+			return false;
+		}
+
+		range = latest_range;
+		range_pending = false;
+		return true;
+	}
+
+	void start()
+	{
+		running = true;
+		decode_thread = std::thread(&StreamPipeline::decode_stage, this);
+		rectify_thread = std::thread(&StreamPipeline::rectify_stage, this);
+		match_thread = std::thread(&StreamPipeline::match_stage, this);
+	}
+
+	void stop()
+	{
+		running = false;
+		source->interrupt();
+
+		std::thread *threads[3] = {&decode_thread, &rectify_thread, &match_thread};
+		for (int i = 0; i < 3; i++)
+		{
+			if (threads[i]->joinable())
+			{
+				threads[i]->join();
+			}
+		}
+	}
+
+	/* Called from the main loop once the idle callback fires. Returns the
+	 * newest matched frame; older ones still queued are dropped. */
+	bool take_latest(StreamResult &latest)
+	{
+		notify_pending = false;
+
+		bool found = false;
+		StreamResult item;
+
+		while (matched.try_pop(item))
+		{
+			if (found)
+			{
+				dropped++;
+			}
+
+			latest = item;
+			found = true;
+		}
+
+		return found;
+	}
+
+	/* Frames dropped so far, by any stage */
+	unsigned long dropped_frames() const
+	{
+		return dropped;
+	}
+
+	/* Frames matched so far, shown or not */
+	unsigned long matched_frames() const
+	{
+		return matched_count;
+	}
+
+	/* The source ended (and does not loop) and every frame was handled */
+	bool is_finished() const
+	{
+		return finished;
+	}
+
+	double fps() const
+	{
+		return source->fps();
+	}
+
+private:
+	void decode_stage()
+	{
+		chrono::duration<double> period(1.0 / source->fps());
+		chrono::steady_clock::time_point next = chrono::steady_clock::now();
+		unsigned long index = 0;
+
+		while (running)
+		{
+			StreamFrame frame;
+			int64 decode_start = getTickCount();
+
+			if (!source->read(frame.left, frame.right))
+			{
+				if (loop && source->rewind())
+				{
+					continue;
+				}
+
+				break;
+			}
+
+			Profiler::instance().record("decode", decode_start, getTickCount());
+			frame.index = index++;
+			frame.sequence = source->sequence() != 0 ? source->sequence() : frame.index + 1;
+			frame.timestamp_ns = source->timestamp_ns() != 0 ? source->timestamp_ns() : shm_ring_now_ns();
+
+			if (!source->is_live())
+			{
+				next += chrono::duration_cast<chrono::steady_clock::duration>(period);
+				this_thread::sleep_until(next);
+			}
+
+			if (!decoded.try_push(frame))
+			{
+				dropped++;
+			}
+		}
+
+		decode_done = true;
+	}
+
+	void rectify_stage()
+	{
+		Backoff backoff;
+		unsigned long rectified_frames = 0;
+
+		while (running)
+		{
+			StreamFrame frame;
+
+			if (!decoded.try_pop(frame))
+			{
+				if (decode_done && decoded.empty())
+				{
+					break;
+				}
+
+				backoff.wait();
+				continue;
+			}
+
+			backoff.reset();
+
+			try
+			{
+				ScopedTimer timer("rectify");
+
+				if (rectify)
+				{
+					rectify_view(frame.left, rectification.map11, rectification.map12, frame.left, frame.gray_left);
+					rectify_view(frame.right, rectification.map21, rectification.map22, frame.right, frame.gray_right);
+				}
+				else
+				{
+					gray_view(frame.left, frame.gray_left);
+					gray_view(frame.right, frame.gray_right);
+				}
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << e.what() << '\n';
+				continue;
+			}
+
+			// Counted here: upstream drops could skip every measured index
+			if (estimate_range && rectified_frames++ % STREAM_RANGE_INTERVAL == 0)
+			{
+				measure_range(frame);
+			}
+
+			if (!rectified.try_push(frame))
+			{
+				dropped++;
+			}
+		}
+
+		rectify_done = true;
+	}
+
+	/* Runs on the rectify thread, which has time to spare between frames
+	 * when matching is the bottleneck */
+	void measure_range(const StreamFrame &frame)
+	{
+		try
+		{
+			DisparityRange range = range_estimator.update(frame.gray_left, frame.gray_right);
+			lock_guard<mutex> lock(range_mtx);
+			latest_range = range;
+			range_pending = true;
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << e.what() << '\n';
+		}
+	}
+
+	void match_stage()
+	{
+		TiledMatcher matcher(getNumberOfCPUs());
+		TemporalRange temporal_range;
+		Backoff backoff;
+
+		while (running)
+		{
+			StreamResult result;
+
+			if (!rectified.try_pop(result.frame))
+			{
+				if (rectify_done && rectified.empty())
+				{
+					break;
+				}
+
+				backoff.wait();
+				continue;
+			}
+
+			backoff.reset();
+
+			DisparityJob job;
+			{
+				lock_guard<mutex> lock(job_mtx);
+				job = job_template;
+			}
+
+			job.left = result.frame.gray_left;
+			job.right = result.frame.gray_right;
+			job.full_size = job.left.size();
+			job.id = result.frame.index;
+
+			try
+			{
+				if (temporal)
+				{
+					run_disparity_job(matcher, job, result.disparity, &temporal_range);
+				}
+				else
+				{
+					// Switched back on later, it starts from a full search
+					temporal_range.reset();
+					run_disparity_job(matcher, job, result.disparity);
+				}
+
+				matched_count++;
+
+				if (egress != NULL)
+				{
+					publish_disparity(*egress, result.disparity.disparity, result.frame.sequence, result.frame.timestamp_ns);
+				}
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << e.what() << '\n';
+				continue;
+			}
+
+			if (!matched.try_push(result))
+			{
+				dropped++;
+				continue;
+			}
+
+			if (!notify_pending.exchange(true))
+			{
+				g_idle_add(on_frame, user_data);
+			}
+		}
+
+		finished = true;
+	}
+
+	StereoSource *source;
+	Rectification rectification;
+	bool rectify;
+	bool loop;
+	GSourceFunc on_frame;
+	gpointer user_data;
+	ShmRingWriter *egress;
+
+	SpscQueue<StreamFrame> decoded, rectified;
+	SpscQueue<StreamResult> matched;
+
+	mutex job_mtx;
+	DisparityJob job_template;
+
+	DisparityRangeEstimator range_estimator;
+	atomic<bool> estimate_range;
+	mutex range_mtx;
+	DisparityRange latest_range;
+	bool range_pending;
+
+	atomic<bool> temporal;
+
+	std::thread decode_thread, rectify_thread, match_thread;
+	atomic<bool> running, decode_done, rectify_done, finished, notify_pending;
+	atomic<unsigned long> dropped, matched_count;
+};
+
+#endif
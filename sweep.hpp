@@ -0,0 +1,284 @@
+#ifndef STEREO_TUNER_SWEEP_HPP
+#define STEREO_TUNER_SWEEP_HPP
+
+#include <glib.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "disparity_cache.hpp"
+#include "evaluation.hpp"
+#include "matcher.hpp"
+#include "work_stealing_pool.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Width of the sweep thumbnails, in pixels */
+static const int SWEEP_THUMBNAIL_WIDTH = 160;
+
+/* Parameters a sweep can vary, in the order of the sweep window's list */
+typedef enum
+{
+	SWEEP_BLOCK_SIZE,
+	SWEEP_MIN_DISPARITY,
+	SWEEP_NUM_DISPARITIES,
+	SWEEP_DISP_12_MAX_DIFF,
+	SWEEP_SPECKLE_RANGE,
+	SWEEP_SPECKLE_WINDOW_SIZE,
+	SWEEP_P1,
+	SWEEP_P2,
+	SWEEP_PRE_FILTER_CAP,
+	SWEEP_PRE_FILTER_SIZE,
+	SWEEP_UNIQUENESS_RATIO,
+	SWEEP_TEXTURE_THRESHOLD,
+	SWEEP_POST_FILTER_RADIUS,
+	SWEEP_POST_FILTER_SIGMA
+} SweepParameter;
+
+static int &sweep_field(MatcherParams &params, SweepParameter parameter)
+{
+	switch (parameter)
+	{
+	case SWEEP_BLOCK_SIZE:
+		return params.block_size;
+	case SWEEP_MIN_DISPARITY:
+		return params.min_disparity;
+	case SWEEP_NUM_DISPARITIES:
+		return params.num_disparities;
+	case SWEEP_DISP_12_MAX_DIFF:
+		return params.disp_12_max_diff;
+	case SWEEP_SPECKLE_RANGE:
+		return params.speckle_range;
+	case SWEEP_SPECKLE_WINDOW_SIZE:
+		return params.speckle_window_size;
+	case SWEEP_P1:
+		return params.p1;
+	case SWEEP_P2:
+		return params.p2;
+	case SWEEP_PRE_FILTER_CAP:
+		return params.pre_filter_cap;
+	case SWEEP_PRE_FILTER_SIZE:
+		return params.pre_filter_size;
+	case SWEEP_UNIQUENESS_RATIO:
+		return params.uniqueness_ratio;
+	case SWEEP_TEXTURE_THRESHOLD:
+		return params.texture_threshold;
+	case SWEEP_POST_FILTER_RADIUS:
+		return params.post_filter_radius;
+	default:
+		return params.post_filter_sigma;
+	}
+}
+
+/* `steps` values evenly spread from `from` to `to`, moved to the nearest
+ * value the matchers accept (odd windows, disparity ranges in multiples of
+ * 16), without repetitions */
+static vector<int> sweep_values(SweepParameter parameter, int from, int to, int steps)
+{
+	vector<int> values;
+	steps = max(steps, 1);
+
+	for (int i = 0; i < steps; i++)
+	{
+		int v = steps == 1 ? from : from + cvRound((double)(to - from) * i / (steps - 1));
+
+		switch (parameter)
+		{
+		case SWEEP_BLOCK_SIZE:
+			v = max(1, v | 1);
+			break;
+		case SWEEP_PRE_FILTER_SIZE:
+			v = max(5, v | 1);
+			break;
+		case SWEEP_NUM_DISPARITIES:
+			v = max(16, (v + 8) / 16 * 16);
+			break;
+		case SWEEP_POST_FILTER_RADIUS:
+			v = max(1, min(v, POST_FILTER_MAX_RADIUS));
+			break;
+		default:
+			break;
+		}
+
+		if (find(values.begin(), values.end(), v) == values.end())
+		{
+			values.push_back(v);
+		}
+	}
+
+	return values;
+}
+
+/* One configuration of a sweep, once matched */
+struct SweepTile
+{
+	int index;
+	int value;
+	Mat thumbnail; /* Disparity at thumbnail size, same type as the matcher's output */
+	double runtime_ms;
+	double bad_2px; /* Negative without ground truth */
+	bool cached;	/* Found in the disparity cache, `runtime_ms` is unknown */
+	bool failed;
+
+	SweepTile() : index(0), value(0), runtime_ms(0), bad_2px(-1), cached(false), failed(false)
+	{
+	}
+};
+
+/* Matches every value of a parameter sweep on a WorkStealingPool, one
+ * configuration per task, each with its own matcher. Tiles are handed to
+ * the main loop as they finish: on_tile is scheduled with g_idle_add and the
+ * main loop collects them with take_tiles(). Starting a sweep cancels the
+ * previous one; configurations that have not started yet are skipped.
+ *
+ * With a cache, configurations matched by an earlier sweep are not matched
+ * again, so running the same sweep twice, or a finer one, is cheap. */
+class SweepRunner
+{
+public:
+	SweepRunner(GSourceFunc on_tile, gpointer user_data, DisparityCache *cache = NULL)
+		: pool(getNumberOfCPUs()), on_tile(on_tile), user_data(user_data), cache(cache), cancelled(false), notify_pending(false)
+	{
+	}
+
+	~SweepRunner()
+	{
+		cancel();
+	}
+
+	/* The images are shared, not copied: they must not change while the
+	 * sweep runs. `input_hash` is their hash_pair(), 0 to skip the cache.
+	 * `ground_truth` may be empty. */
+	void start(const MatcherParams &base, SweepParameter parameter, const vector<int> &values, const Mat &left, const Mat &right,
+			   uint64_t input_hash, const Mat &ground_truth, const Rect *roi1, const Rect *roi2)
+	{
+		cancel();
+
+		{
+			lock_guard<mutex> lock(mtx);
+			finished.clear();
+		}
+
+		cancelled = false;
+		runner = std::thread(&SweepRunner::run, this, base, parameter, values, left, right, input_hash, ground_truth,
+							 roi1 != NULL && roi2 != NULL, roi1 != NULL ? *roi1 : Rect(), roi2 != NULL ? *roi2 : Rect());
+	}
+
+	/* Skips the configurations not started yet and waits for the others */
+	void cancel()
+	{
+		cancelled = true;
+
+		if (runner.joinable())
+		{
+			runner.join();
+		}
+	}
+
+	/* Called from the main loop once the idle callback fires */
+	bool take_tiles(vector<SweepTile> &tiles)
+	{
+		notify_pending = false;
+		lock_guard<mutex> lock(mtx);
+		tiles.swap(finished);
+		finished.clear();
+		return !tiles.empty();
+	}
+
+private:
+	void run(MatcherParams base, SweepParameter parameter, vector<int> values, Mat left, Mat right, uint64_t input_hash,
+			 Mat ground_truth, bool use_roi, Rect roi1, Rect roi2)
+	{
+		vector<function<void()>> tasks;
+
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			tasks.push_back([=]()
+							{
+								if (cancelled)
+								{
+									return;
+								}
+
+								MatcherParams params = base;
+								sweep_field(params, parameter) = values[i];
+
+								SweepTile tile;
+								tile.index = (int)i;
+								tile.value = values[i];
+
+								try
+								{
+									Mat disparity;
+									uint64_t key = cache != NULL && input_hash != 0 ? whole_pair_key(input_hash, params, use_roi ? &roi1 : NULL, use_roi ? &roi2 : NULL) : 0;
+									tile.cached = key != 0 && cache->get(key, disparity);
+
+									if (!tile.cached)
+									{
+										Ptr<StereoMatcher> matcher;
+										configure_matcher(matcher, params, use_roi ? &roi1 : NULL, use_roi ? &roi2 : NULL);
+
+										int64 start = getTickCount();
+										compute_disparity(matcher, left, right, disparity);
+										post_filter(params, left, disparity);
+										tile.runtime_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+										if (key != 0)
+										{
+											cache->put(key, disparity);
+										}
+									}
+
+									if (!ground_truth.empty())
+									{
+										tile.bad_2px = evaluate_disparity(disparity, params.min_disparity, ground_truth).bad[2];
+									}
+
+									Size size(SWEEP_THUMBNAIL_WIDTH, max(1, SWEEP_THUMBNAIL_WIDTH * disparity.rows / disparity.cols));
+									resize(disparity, tile.thumbnail, size, 0, 0, INTER_NEAREST);
+								}
+								catch (const std::exception &e)
+								{
+									// Rejected by the matcher (P2 <= P1, window too large, ...)
+									std::cerr << e.what() << '\n';
+									tile.failed = true;
+								}
+
+								lock_guard<mutex> lock(mtx);
+								finished.push_back(tile);
+
+								if (!notify_pending.exchange(true))
+								{
+									g_idle_add(on_tile, user_data);
+								} });
+		}
+
+		try
+		{
+			pool.run(tasks);
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << e.what() << '\n';
+		}
+	}
+
+	WorkStealingPool pool;
+	GSourceFunc on_tile;
+	gpointer user_data;
+	DisparityCache *cache;
+
+	std::thread runner;
+	mutex mtx;
+	vector<SweepTile> finished;
+	atomic<bool> cancelled, notify_pending;
+};
+
+#endif
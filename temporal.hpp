@@ -0,0 +1,187 @@
+#ifndef STEREO_TUNER_TEMPORAL_HPP
+#define STEREO_TUNER_TEMPORAL_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+#include "disparity_cache.hpp"
+#include "matcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* Frames matched with narrowed ranges before one is searched in full again,
+ * so objects entering a tile outside its range are found */
+static const int TEMPORAL_REFRESH_FRAMES = 30;
+
+/* Disparities added on each side of the previous range of a tile, for what
+ * moved since */
+static const int TEMPORAL_MARGIN_PX = 6;
+
+/* Below this share of valid pixels in the previous map of a tile, the
+ * previous range is not trusted */
+static const double TEMPORAL_MIN_VALID = 0.4;
+
+/* Mean gray level change of a tile since the previous frame above which it
+ * moved too much to keep its range */
+static const double TEMPORAL_MAX_MOTION = 12.0;
+
+/* Share of the previous disparities of a tile left out at each end */
+static const double TEMPORAL_OUTLIER_RATIO = 0.01;
+
+/* Pixels sampled: every n-th row and column */
+static const int TEMPORAL_SAMPLE_STEP = 2;
+
+/* Narrows the disparity range searched in each tile of a video frame to the
+ * range the previous frame found there, plus a margin. A tile is searched
+ * over the whole range when there is no previous map of the same
+ * parameters, when too few of its previous disparities were valid, when its
+ * left image changed too much since the previous frame, and on every
+ * TEMPORAL_REFRESH_FRAMES-th frame.
+ *
+ * For CPU matchers only: a GPU matcher gets a single tile, and CUDA SGM only
+ * takes multiples of 64 disparities. narrow() can be called from several
+ * threads between begin() and end(). */
+class TemporalRange
+{
+public:
+	TemporalRange() : previous_key(0), narrowed_frames(0), usable(false), searched(0), full(0)
+	{
+	}
+
+	/* Before a frame is matched, at full resolution */
+	void begin(const MatcherParams &params, const Mat &left)
+	{
+		DisparityKey key;
+		key.add(params);
+
+		usable = !runs_on_gpu(params) && previous_disparity.type() == CV_16SC1 && previous_left.type() == CV_8UC1 &&
+				 previous_left.size() == left.size() && key.value() == previous_key && narrowed_frames < TEMPORAL_REFRESH_FRAMES;
+		narrowed_frames = usable ? narrowed_frames + 1 : 0;
+		previous_key = key.value();
+		searched = 0;
+		full = 0;
+	}
+
+	/* Parameters to match the tile whose output is `tile` with */
+	MatcherParams narrow(const MatcherParams &params, const Mat &left, const Rect &tile)
+	{
+		MatcherParams narrowed = params;
+
+		if (usable && tile.area() > 0 && still(left, tile))
+		{
+			narrow_range(params, tile, narrowed);
+		}
+
+		searched += narrowed.num_disparities;
+		full += params.num_disparities;
+		return narrowed;
+	}
+
+	/* After the frame is matched. Both images are kept, not copied. */
+	void end(const Mat &left, const Mat &disparity)
+	{
+		previous_left = left;
+		previous_disparity = disparity;
+	}
+
+	void reset()
+	{
+		previous_left.release();
+		previous_disparity.release();
+		previous_key = 0;
+	}
+
+	/* Share of the disparity range searched over the tiles of the frame */
+	double search_ratio() const
+	{
+		return full > 0 ? (double)searched / full : 1.0;
+	}
+
+private:
+	/* Whether the tile changed little since the previous frame */
+	bool still(const Mat &left, const Rect &tile) const
+	{
+		long difference = 0, samples = 0;
+
+		for (int y = tile.y; y < tile.y + tile.height; y += TEMPORAL_SAMPLE_STEP)
+		{
+			const uchar *now = left.ptr<uchar>(y);
+			const uchar *before = previous_left.ptr<uchar>(y);
+
+			for (int x = tile.x; x < tile.x + tile.width; x += TEMPORAL_SAMPLE_STEP)
+			{
+				difference += abs(now[x] - before[x]);
+				samples++;
+			}
+		}
+
+		return samples > 0 && difference <= TEMPORAL_MAX_MOTION * samples;
+	}
+
+	/* Range of the previous disparities of the tile, from a histogram in
+	 * whole pixels. Leaves `narrowed` alone when they cannot be trusted. */
+	void narrow_range(const MatcherParams &params, const Rect &tile, MatcherParams &narrowed) const
+	{
+		const int scale = StereoMatcher::DISP_SCALE;
+		const int lowest = params.min_disparity * scale;
+		vector<int> histogram(params.num_disparities, 0);
+		int valid = 0, samples = 0;
+
+		for (int y = tile.y; y < tile.y + tile.height; y += TEMPORAL_SAMPLE_STEP)
+		{
+			const short *row = previous_disparity.ptr<short>(y);
+
+			for (int x = tile.x; x < tile.x + tile.width; x += TEMPORAL_SAMPLE_STEP, samples++)
+			{
+				if (row[x] >= lowest)
+				{
+					histogram[min(params.num_disparities - 1, (row[x] - lowest) / scale)]++;
+					valid++;
+				}
+			}
+		}
+
+		if (valid == 0 || valid < TEMPORAL_MIN_VALID * samples)
+		{
+			return;
+		}
+
+		int outliers = (int)(valid * TEMPORAL_OUTLIER_RATIO);
+		int low = 0, high = params.num_disparities - 1;
+
+		for (int below = 0; low < high && below + histogram[low] <= outliers; low++)
+		{
+			below += histogram[low];
+		}
+
+		for (int above = 0; high > low && above + histogram[high] <= outliers; high--)
+		{
+			above += histogram[high];
+		}
+
+		// Rounded up to 16 disparities, kept within the full range
+		int first = max(params.min_disparity, params.min_disparity + low - TEMPORAL_MARGIN_PX);
+		int last = params.min_disparity + high + TEMPORAL_MARGIN_PX;
+		int count = (last - first + 16) / 16 * 16;
+
+		if (count >= params.num_disparities)
+		{
+			return;
+		}
+
+		narrowed.min_disparity = min(first, params.min_disparity + params.num_disparities - count);
+		narrowed.num_disparities = count;
+	}
+
+	Mat previous_left, previous_disparity;
+	uint64_t previous_key;
+	int narrowed_frames;
+	bool usable;
+	atomic<long> searched, full;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef STEREO_TUNER_TILED_MATCHER_HPP
+#define STEREO_TUNER_TILED_MATCHER_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <climits>
+#include <functional>
+#include <vector>
+
+#include "matcher.hpp"
+#include "temporal.hpp"
+#include "work_stealing_pool.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* A horizontal slice of the region being matched: the pixels it produces and
+ * the (larger) window of the pair it reads */
+struct DisparityTile
+{
+	Rect output;
+	Rect input;
+};
+
+static const int TILE_MIN_ROWS = 32;
+static const int TILES_PER_THREAD = 3;
+
+/* Extra rows given to SGBM tiles so its vertical paths are not cut right at
+ * the tile border */
+static const int SGBM_TILE_OVERLAP = 16;
+
+/* Reach of what a matcher computes from the pair before its costs: the
+ * prefilter of the block matchers (SGBM's is an x-Sobel too), the census
+ * transform. The tiles replicate their borders there, like the full frame
+ * does at the image borders. */
+static void prefilter_radius(const MatcherParams &params, int &radius_x, int &radius_y)
+{
+	if (params.matcher_type == CENSUS)
+	{
+		radius_x = CENSUS_RADIUS_X;
+		radius_y = CENSUS_RADIUS_Y;
+	}
+	else if (params.matcher_type == BM && params.pre_filter_type == StereoBM::PREFILTER_NORMALIZED_RESPONSE)
+	{
+		radius_x = radius_y = params.pre_filter_size / 2;
+	}
+	else
+	{
+		radius_x = radius_y = 1;
+	}
+}
+
+/* Splits `region` into at most `max_tiles` horizontal tiles. Each input window
+ * is padded by half a block plus the prefilter radius on every side and, on
+ * the left, by the disparity range, since the matchers leave the first
+ * maxDisparity columns of their input unmatched. The tiles of BM and census
+ * then match exactly like the full frame, but for the speckle filter.
+ * Padding is clipped to the image, where the full-frame result would be
+ * invalid anyway. */
+static vector<DisparityTile> plan_tiles(const MatcherParams &params, Size image_size, const Rect &region, int max_tiles)
+{
+	vector<DisparityTile> tiles;
+	int radius = params.block_size / 2;
+	int max_disparity = params.min_disparity + params.num_disparities - 1;
+	int prefilter_x, prefilter_y;
+	prefilter_radius(params, prefilter_x, prefilter_y);
+	int pad_left = radius + prefilter_x + max(0, max_disparity);
+	int pad_right = radius + prefilter_x + max(0, -params.min_disparity);
+	int pad_y = radius + prefilter_y + (params.matcher_type == SGBM ? SGBM_TILE_OVERLAP : 0);
+	int count = min(max(region.height / TILE_MIN_ROWS, 1), max(max_tiles, 1));
+
+	int x0 = max(0, region.x - pad_left);
+	int x1 = min(image_size.width, region.x + region.width + pad_right);
+
+	for (int t = 0; t < count; t++)
+	{
+		int y0 = region.y + region.height * t / count;
+		int y1 = region.y + region.height * (t + 1) / count;
+		int input_y0 = max(0, y0 - pad_y);
+		int input_y1 = min(image_size.height, y1 + pad_y);
+
+		DisparityTile tile;
+		tile.output = Rect(region.x, y0, region.width, y1 - y0);
+		tile.input = Rect(x0, input_y0, x1 - x0, input_y1 - input_y0);
+		tiles.push_back(tile);
+	}
+
+	return tiles;
+}
+
+/* Computes the disparity of a region of the pair only, tile by tile on a
+ * work-stealing pool, and stitches the tiles into a full-size map whose other
+ * pixels are invalid. Each tile keeps its own matcher instance across calls,
+ * so the tile layout and any state a matcher keeps (the winner data of a
+ * CostVolumeMatcher) survive between calls with the same region.
+ *
+ * Matchers that run on the GPU get the region as a single tile. The speckle
+ * filter sees one tile at a time, so a speckle crossing a tile border may be
+ * kept where the full-frame filter would remove it.
+ *
+ * With a TemporalRange, the region is cut into as many tiles as
+ * TILE_MIN_ROWS allows and each one searches the range its part of the
+ * previous frame needs. */
+class TiledMatcher
+{
+public:
+	explicit TiledMatcher(int threads) : pool(threads), volume_reused(false)
+	{
+	}
+
+	/* `region` is in image coordinates; an empty one means the whole image */
+	void compute(const MatcherParams &params, const Mat &left, const Mat &right, Rect region, Mat &disparity,
+				 TemporalRange *temporal = NULL)
+	{
+		Rect frame(0, 0, left.cols, left.rows);
+		region = region.area() > 0 ? region & frame : frame;
+
+		int max_tiles = runs_on_gpu(params) ? 1 : (temporal != NULL ? INT_MAX : pool.size() * TILES_PER_THREAD);
+		vector<DisparityTile> tiles = plan_tiles(params, left.size(), region, max_tiles);
+		tile_matchers.resize(tiles.size());
+		vector<char> reused(tiles.size(), 0);
+
+		if (tiles.size() == 1)
+		{
+			// The output type is whatever the matcher produces (8-bit on CUDA)
+			Mat tile_disparity;
+			MatcherParams tile_params = temporal != NULL ? temporal->narrow(params, left, tiles[0].output) : params;
+			match_tile(tile_params, left, right, tiles[0], tile_matchers[0], tile_disparity);
+			disparity.create(left.size(), tile_disparity.type());
+			fill_invalid(params, disparity);
+			tile_disparity.copyTo(disparity(tiles[0].output));
+			widen_invalid(params, tile_params, disparity(tiles[0].output));
+			reused[0] = matcher_reused(tile_matchers[0]);
+		}
+		else
+		{
+			disparity.create(left.size(), CV_16S);
+			fill_invalid(params, disparity);
+
+			vector<function<void()>> tasks;
+			for (size_t i = 0; i < tiles.size(); i++)
+			{
+				tasks.push_back([this, i, &params, &left, &right, &tiles, &disparity, &reused, temporal]()
+								{
+									Mat tile_disparity;
+									MatcherParams tile_params = temporal != NULL ? temporal->narrow(params, left, tiles[i].output) : params;
+									match_tile(tile_params, left, right, tiles[i], tile_matchers[i], tile_disparity);
+									tile_disparity.convertTo(disparity(tiles[i].output), CV_16S);
+									widen_invalid(params, tile_params, disparity(tiles[i].output));
+									reused[i] = matcher_reused(tile_matchers[i]); });
+			}
+			pool.run(tasks);
+		}
+
+		volume_reused = true;
+		for (size_t i = 0; i < reused.size(); i++)
+		{
+			volume_reused = volume_reused && reused[i];
+		}
+	}
+
+	/* Whether every tile of the last compute() only reran the post-processing */
+	bool reused_cost_volume() const
+	{
+		return volume_reused;
+	}
+
+private:
+	static void match_tile(const MatcherParams &params, const Mat &left, const Mat &right, const DisparityTile &tile,
+						   Ptr<StereoMatcher> &matcher, Mat &tile_disparity)
+	{
+		Mat padded_disparity;
+		configure_matcher(matcher, params, NULL, NULL);
+		compute_disparity(matcher, left(tile.input), right(tile.input), padded_disparity);
+
+		Rect inside(tile.output.x - tile.input.x, tile.output.y - tile.input.y, tile.output.width, tile.output.height);
+		tile_disparity = padded_disparity(inside);
+	}
+
+	static bool matcher_reused(const Ptr<StereoMatcher> &matcher)
+	{
+		Ptr<CostVolumeMatcher> cost_volume = matcher.dynamicCast<CostVolumeMatcher>();
+		return cost_volume && cost_volume->reused_cost_volume();
+	}
+
+	static void fill_invalid(const MatcherParams &params, Mat &disparity)
+	{
+		double invalid = disparity.depth() == CV_16S ? (params.min_disparity - 1) * StereoMatcher::DISP_SCALE : 0;
+		disparity.setTo(Scalar(invalid));
+	}
+
+	/* A tile matched over a narrower range marks its invalid pixels below
+	 * that range: they get the invalid value of the whole map */
+	static void widen_invalid(const MatcherParams &params, const MatcherParams &tile_params, Mat tile_disparity)
+	{
+		if (tile_params.min_disparity == params.min_disparity || tile_disparity.depth() != CV_16S)
+		{
+			return;
+		}
+
+		Mat below = tile_disparity < tile_params.min_disparity * StereoMatcher::DISP_SCALE;
+		tile_disparity.setTo(Scalar((params.min_disparity - 1) * StereoMatcher::DISP_SCALE), below);
+	}
+
+	WorkStealingPool pool;
+	vector<Ptr<StereoMatcher>> tile_matchers;
+	bool volume_reused;
+};
+
+#endif
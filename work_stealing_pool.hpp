@@ -0,0 +1,181 @@
+#ifndef STEREO_TUNER_WORK_STEALING_POOL_HPP
+#define STEREO_TUNER_WORK_STEALING_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Fixed set of threads running batches of tasks. Every thread has its own
+ * deque: it takes its own tasks from the back and, once it runs dry, steals
+ * from the front of the others, so uneven tasks (a textured tile next to a
+ * flat one) keep all the threads busy until the batch is done. */
+class WorkStealingPool
+{
+public:
+	explicit WorkStealingPool(int threads) : remaining(0), generation(0), stopping(false)
+	{
+		threads = threads < 1 ? 1 : threads;
+
+		for (int i = 0; i < threads; i++)
+		{
+			queues.push_back(unique_ptr<TaskQueue>(new TaskQueue()));
+		}
+
+		for (int i = 0; i < threads; i++)
+		{
+			workers.push_back(std::thread(&WorkStealingPool::work, this, i));
+		}
+	}
+
+	~WorkStealingPool()
+	{
+		{
+			lock_guard<mutex> lock(mtx);
+			stopping = true;
+			wake.notify_all();
+		}
+
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+	}
+
+	int size() const
+	{
+		return (int)workers.size();
+	}
+
+	/* Runs the tasks and returns once all of them are done. The first
+	 * exception thrown by a task is rethrown here. One batch at a time. */
+	void run(vector<function<void()>> &tasks)
+	{
+		if (tasks.empty())
+		{
+			return;
+		}
+
+		failure = exception_ptr();
+		remaining = tasks.size();
+
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			TaskQueue &queue = *queues[i % queues.size()];
+			lock_guard<mutex> lock(queue.mtx);
+			queue.tasks.push_back(&tasks[i]);
+		}
+
+		unique_lock<mutex> lock(mtx);
+		generation++;
+		wake.notify_all();
+		done.wait(lock, [this]
+				  { return remaining == 0; });
+
+		if (failure)
+		{
+			rethrow_exception(failure);
+		}
+	}
+
+private:
+	struct TaskQueue
+	{
+		mutex mtx;
+		deque<function<void()> *> tasks;
+	};
+
+	bool take(int self, function<void()> *&task)
+	{
+		{
+			TaskQueue &own = *queues[self];
+			lock_guard<mutex> lock(own.mtx);
+
+			if (!own.tasks.empty())
+			{
+				task = own.tasks.back();
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+
+		for (size_t i = 1; i < queues.size(); i++)
+		{
+			TaskQueue &victim = *queues[(self + i) % queues.size()];
+			lock_guard<mutex> lock(victim.mtx);
+
+			if (!victim.tasks.empty())
+			{
+				task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void work(int self)
+	{
+		unsigned long seen = 0;
+
+		for (;;)
+		{
+			{
+				unique_lock<mutex> lock(mtx);
+				wake.wait(lock, [this, seen]
+						  { return stopping || generation != seen; });
+
+				if (stopping)
+				{
+					return;
+				}
+
+				seen = generation;
+			}
+
+			function<void()> *task;
+
+			while (take(self, task))
+			{
+				try
+				{
+					(*task)();
+				}
+				catch (...)
+				{
+					lock_guard<mutex> lock(mtx);
+
+					if (!failure)
+					{
+						failure = current_exception();
+					}
+				}
+
+				if (--remaining == 0)
+				{
+					lock_guard<mutex> lock(mtx);
+					done.notify_all();
+				}
+			}
+		}
+	}
+
+	vector<unique_ptr<TaskQueue>> queues;
+	vector<std::thread> workers;
+	atomic<size_t> remaining;
+	exception_ptr failure;
+	mutex mtx;
+	condition_variable wake, done;
+	unsigned long generation;
+	bool stopping;
+};
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef STEREO_TUNER_WORKER_HPP
+#define STEREO_TUNER_WORKER_HPP
+
+#include <glib.h>
+#include <opencv2/core.hpp>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "disparity_cache.hpp"
+#include "matcher.hpp"
+#include "profiler.hpp"
+#include "pyramid.hpp"
+#include "tiled_matcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/* A disparity request: a snapshot of the parameters and the pair to match.
+ * Only `region` is matched (the whole pair when it is empty), further
+ * restricted to the valid disparity area of the rectification ROIs.
+ *
+ * Previews match a pyramid level of the pair: `left` and `right` are that
+ * level, while the parameters, the region and the ROIs are the full
+ * resolution ones. The result is brought back to `full_size`.
+ *
+ * `input_hash` is the hash_pair() of the full resolution pair, for the
+ * disparity cache; jobs left at 0 are always matched. */
+struct DisparityJob
+{
+	MatcherParams params;
+	Mat left, right;
+	int level;
+	Size full_size;
+	Rect region;
+	bool use_roi;
+	Rect roi1, roi2;
+	uint64_t input_hash;
+	unsigned long id;
+
+	DisparityJob() : level(0), use_roi(false), input_hash(0), id(0)
+	{
+	}
+};
+
+/* The outcome of a job, handed back to the GTK main loop */
+struct DisparityResult
+{
+	MatcherParams params;
+	Mat disparity;
+	double elapsed_ms;
+	bool volume_reused; /* Only the post-processing of a CostVolumeMatcher ran */
+	bool cached;		/* Taken from the disparity cache, `elapsed_ms` is the lookup */
+	int level;			/* Pyramid level of a preview, 0 at full resolution */
+	double search_ratio; /* Share of the disparity range searched, below 1 with a TemporalRange */
+	Rect region;		 /* Part of the full resolution map matched, all of it when empty */
+	unsigned long id;
+
+	DisparityResult() : elapsed_ms(0), volume_reused(false), cached(false), level(0), search_ratio(1.0), id(0)
+	{
+	}
+};
+
+/* Part of the pair the job asks for, at the level of the job */
+static Rect job_region(const DisparityJob &job, const MatcherParams &params)
+{
+	Rect region = scale_rect(job.region, job.level);
+
+	if (job.use_roi)
+	{
+		Rect valid = getValidDisparityROI(scale_rect(job.roi1, job.level), scale_rect(job.roi2, job.level),
+										  params.min_disparity, params.num_disparities, params.block_size);
+
+		if (region.area() == 0 || (region & valid).area() == 0)
+		{
+			region = valid;
+		}
+		else
+		{
+			region &= valid;
+		}
+	}
+
+	return region;
+}
+
+/* Part of the full resolution pair the job asks for, whatever its level */
+static Rect job_full_region(const DisparityJob &job)
+{
+	DisparityJob full = job;
+	full.level = 0;
+	return job_region(full, job.params);
+}
+
+/* Key of the map a job produces in a DisparityCache, 0 when the job is not
+ * to be cached. The tiled matching of the interface keys on the matched
+ * region and the pyramid level besides the pair and the parameters. */
+static uint64_t disparity_job_key(const DisparityJob &job)
+{
+	if (job.input_hash == 0)
+	{
+		return 0;
+	}
+
+	DisparityKey key(job.input_hash);
+	key.add(job.params);
+	key.add(job.level);
+	key.add(job_region(job, scale_params(job.params, job.level)));
+	return key.value();
+}
+
+/* Matches a job and fills in its result: the disparity at full size, even
+ * for a preview, and the time it took. A TemporalRange, for the frames of a
+ * video, narrows the search to the previous frame's disparities. */
+static void run_disparity_job(TiledMatcher &matcher, const DisparityJob &job, DisparityResult &done, TemporalRange *temporal = NULL)
+{
+	MatcherParams params = scale_params(job.params, job.level);
+	Rect region = job_region(job, params);
+	ScopedTimer timer("match");
+
+	if (temporal != NULL)
+	{
+		temporal->begin(params, job.left);
+	}
+
+	matcher.compute(params, job.left, job.right, region, done.disparity, temporal);
+	post_filter(params, job.left, done.disparity, region);
+
+	if (temporal != NULL)
+	{
+		temporal->end(job.left, done.disparity);
+		done.search_ratio = temporal->search_ratio();
+	}
+
+	if (job.level > 0)
+	{
+		ScopedTimer upscale_timer("upscale");
+		Mat coarse = done.disparity;
+		upscale_disparity(coarse, job.level, job.params, job.full_size, done.disparity);
+	}
+
+	done.elapsed_ms = timer.elapsed_ms();
+	done.volume_reused = matcher.reused_cost_volume();
+	done.params = job.params;
+	done.level = job.level;
+	done.region = job_full_region(job);
+	done.id = job.id;
+}
+
+/* Runs the matcher on a dedicated thread.
+ *
+ * Only the most recent request is kept: submitting a job while another one is
+ * pending replaces it, so dragging a slider costs at most one compute behind
+ * the pointer. A job that became stale is abandoned at the next safe point
+ * (before and after the matcher runs). Finished results are announced to the
+ * main loop with g_idle_add and collected there with take_result().
+ *
+ * With a cache, jobs that carry an input hash are looked up before matching
+ * and their maps stored once matched, stale or not, as the pointer may come
+ * back to those parameters.
+ *
+ * Previews and full resolution jobs have their own TiledMatcher: each change
+ * runs both, and with a single one the winner data kept by a
+ * CostVolumeMatcher would be rebuilt at both resolutions every time. */
+class ComputeWorker
+{
+public:
+	ComputeWorker(GSourceFunc on_result, gpointer user_data, DisparityCache *cache = NULL)
+		: on_result(on_result), user_data(user_data), cache(cache), latest_id(0),
+		  has_job(false), has_result(false), result_scheduled(false), stopping(false)
+	{
+		thread = std::thread(&ComputeWorker::run, this);
+	}
+
+	~ComputeWorker()
+	{
+		stop();
+	}
+
+	/* Queues a job, dropping any job that has not started yet. Returns the
+	 * id assigned to it. */
+	unsigned long submit(const DisparityJob &job)
+	{
+		lock_guard<mutex> lock(mtx);
+		pending = job;
+		pending.id = ++latest_id;
+		has_job = true;
+		cond.notify_one();
+		return pending.id;
+	}
+
+	/* Called from the main loop once the idle callback fires */
+	bool take_result(DisparityResult &out)
+	{
+		lock_guard<mutex> lock(mtx);
+		result_scheduled = false;
+
+		if (!has_result)
+		{
+			return false;
+		}
+
+		out = result;
+		result = DisparityResult();
+		has_result = false;
+		return true;
+	}
+
+	void stop()
+	{
+		{
+			lock_guard<mutex> lock(mtx);
+			stopping = true;
+			cond.notify_one();
+		}
+
+		if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
+
+private:
+	bool is_stale(unsigned long id)
+	{
+		lock_guard<mutex> lock(mtx);
+		return stopping || id != latest_id;
+	}
+
+	void run()
+	{
+		TiledMatcher matcher(getNumberOfCPUs());
+		TiledMatcher preview_matcher(getNumberOfCPUs());
+
+		for (;;)
+		{
+			DisparityJob job;
+
+			{
+				unique_lock<mutex> lock(mtx);
+				cond.wait(lock, [this]
+						  { return has_job || stopping; });
+
+				if (stopping)
+				{
+					return;
+				}
+
+				job = pending;
+				pending = DisparityJob();
+				has_job = false;
+			}
+
+			try
+			{
+				if (is_stale(job.id))
+				{
+					continue;
+				}
+
+				DisparityResult done;
+				uint64_t key = cache != NULL ? disparity_job_key(job) : 0;
+				int64 start = getTickCount();
+
+				if (key != 0 && cache->get(key, done.disparity))
+				{
+					done.elapsed_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+					done.cached = true;
+					done.params = job.params;
+					done.level = job.level;
+					done.region = job_full_region(job);
+					done.id = job.id;
+				}
+				else
+				{
+					run_disparity_job(job.level > 0 ? preview_matcher : matcher, job, done);
+				}
+
+				// A newer request arrived while computing, its result is the one to show
+				if (!is_stale(job.id))
+				{
+					lock_guard<mutex> lock(mtx);
+					result = done;
+					has_result = true;
+
+					if (!result_scheduled)
+					{
+						result_scheduled = true;
+						g_idle_add(on_result, user_data);
+					}
+				}
+
+				// After the result is on its way: the disk tier takes a while
+				if (key != 0 && !done.cached)
+				{
+					cache->put(key, done.disparity);
+				}
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << e.what() << '\n';
+			}
+		}
+	}
+
+	GSourceFunc on_result;
+	gpointer user_data;
+	DisparityCache *cache;
+
+	std::thread thread;
+	mutex mtx;
+	condition_variable cond;
+	DisparityJob pending;
+	DisparityResult result;
+	unsigned long latest_id;
+	bool has_job;
+	bool has_result;
+	bool result_scheduled;
+	bool stopping;
+};
+
+#endif